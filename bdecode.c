@@ -0,0 +1,184 @@
+#include <string.h>
+#include <limits.h>
+#include "bdecode.h"
+
+// Lists and dictionaries nested deeper than this are refused, so a
+// hostile file can't run the stack out.
+#define MAX_DEPTH 64
+
+struct parser
+{
+	const unsigned char *p, *end;
+	const char *err;
+};
+
+static int fail(struct parser *ps, const char *msg)
+{
+	if (ps->err == NULL)
+		ps->err = msg;
+	return -1;
+}
+
+// Parse a run of digits, with no leading zeros, ending at term.
+static int number(struct parser *ps, unsigned char term, long long *n)
+{
+	const unsigned char *start = ps->p;
+	long long v = 0;
+
+	while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9')
+	{
+		if (v > (LLONG_MAX - (*ps->p - '0')) / 10)
+			return fail(ps, "number too big");
+		v = v * 10 + (*ps->p++ - '0');
+	}
+	if (ps->p == start || ps->p == ps->end || *ps->p != term)
+		return fail(ps, "bad number");
+	if (*start == '0' && ps->p - start > 1)
+		return fail(ps, "number with leading zeros");
+	ps->p++;
+	*n = v;
+	return 0;
+}
+
+static int compare(const struct bval *a, const struct bval *b)
+{
+	int ret;
+
+	ret = memcmp(a->data, b->data, a->len < b->len ? a->len : b->len);
+	if (ret != 0)
+		return ret;
+	return a->len < b->len ? -1 : a->len > b->len;
+}
+
+// Parse the value at ps->p, moving past it.
+static int value(struct parser *ps, struct bval *v, int depth)
+{
+	struct bval key, prev, item;
+	long long n;
+	int neg;
+
+	if (ps->p == ps->end)
+		return fail(ps, "unexpected end of data");
+	v->raw = ps->p;
+
+	if (*ps->p == 'i')
+	{
+		ps->p++;
+		neg = ps->p < ps->end && *ps->p == '-';
+		if (neg)
+			ps->p++;
+		if (number(ps, 'e', &n) == -1)
+			return -1;
+		if (neg && n == 0)
+			return fail(ps, "negative zero");
+		v->type = BDEC_INT;
+		v->n = neg ? -n : n;
+		v->data = NULL;
+		v->len = 0;
+	}
+	else if (*ps->p >= '0' && *ps->p <= '9')
+	{
+		if (number(ps, ':', &n) == -1)
+			return -1;
+		if (n > ps->end - ps->p)
+			return fail(ps, "string runs past the end");
+		v->type = BDEC_STR;
+		v->data = ps->p;
+		v->len = n;
+		ps->p += n;
+	}
+	else if (*ps->p == 'l' || *ps->p == 'd')
+	{
+		if (depth == MAX_DEPTH)
+			return fail(ps, "nested too deeply");
+		v->type = *ps->p == 'l' ? BDEC_LIST : BDEC_DICT;
+		v->data = ++ps->p;
+		prev.data = NULL;	// no key yet
+		prev.len = 0;
+		while (ps->p < ps->end && *ps->p != 'e')
+		{
+			if (v->type == BDEC_DICT)
+			{
+				if (value(ps, &key, depth + 1) == -1)
+					return -1;
+				if (key.type != BDEC_STR)
+					return fail(ps, "key isn't a string");
+				if (prev.data != NULL
+					&& compare(&prev, &key) >= 0)
+				{
+					return fail(ps, "keys out of order or "
+						"repeated");
+				}
+				prev = key;
+			}
+			if (value(ps, &item, depth + 1) == -1)
+				return -1;
+		}
+		if (ps->p == ps->end)
+			return fail(ps, "unexpected end of data");
+		v->len = ps->p - v->data;
+		ps->p++;
+	}
+	else
+		return fail(ps, "not bencoded data");
+
+	v->rawlen = ps->p - v->raw;
+	return 0;
+}
+
+int bdec_parse(const unsigned char *buf, size_t len, struct bval *v,
+	const char **err)
+{
+	struct parser ps;
+
+	ps.p = buf;
+	ps.end = buf + len;
+	ps.err = NULL;
+	if (value(&ps, v, 0) == -1)
+	{
+		*err = ps.err;
+		return -1;
+	}
+	return 0;
+}
+
+int bdec_next(const struct bval *v, const unsigned char **pos,
+	struct bval *key, struct bval *item)
+{
+	struct parser ps;
+
+	ps.p = *pos != NULL ? *pos : v->data;
+	ps.end = v->data + v->len;
+	ps.err = NULL;
+	if (ps.p == ps.end)
+		return -1;
+
+	// Already checked, so this can't fail.
+	if (v->type == BDEC_DICT)
+		value(&ps, key, 0);
+	value(&ps, item, 0);
+	*pos = ps.p;
+	return 0;
+}
+
+int bdec_lookup(const struct bval *dict, const char *key, struct bval *item)
+{
+	const unsigned char *pos = NULL;
+	struct bval k;
+
+	while (bdec_next(dict, &pos, &k, item) == 0)
+	{
+		if (bdec_strcmp(&k, key) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+int bdec_strcmp(const struct bval *v, const char *s)
+{
+	struct bval sv;
+
+	sv.data = (const unsigned char *)s;
+	sv.len = strlen(s);
+	return compare(v, &sv);
+}
@@ -0,0 +1,41 @@
+// Reading bencoded data in place. Values are spans of the buffer they were
+// parsed from, which must stay around while they're in use, so nothing is
+// copied; a value can be written back out as it was with benc_raw().
+
+#define BDEC_INT 1
+#define BDEC_STR 2
+#define BDEC_LIST 3
+#define BDEC_DICT 4
+
+struct bval
+{
+	int type;
+	const unsigned char *raw;	// the whole encoded value
+	size_t rawlen;
+
+	// For a string, its contents; for a list or dictionary, what's
+	// between its opening and closing characters.
+	const unsigned char *data;
+	size_t len;
+
+	long long n;		// for an integer
+};
+
+// Parse the value at the start of buf, checking that it and everything in
+// it is well formed. Returns 0, with *v set, or -1 with *err saying what
+// was wrong. Data after the value is left alone.
+int bdec_parse(const unsigned char *buf, size_t len, struct bval *v,
+	const char **err);
+
+// Step through a list or dictionary that has been parsed: *pos should be
+// NULL to start with. Sets *item (and *key, for a dictionary) to the next
+// entry, returning 0, or returns -1 after the last.
+int bdec_next(const struct bval *v, const unsigned char **pos,
+	struct bval *key, struct bval *item);
+
+// Find key in a dictionary. Returns 0 with *item set, or -1 if it isn't
+// there.
+int bdec_lookup(const struct bval *dict, const char *key, struct bval *item);
+
+// Compare a string value with s, as strcmp() does.
+int bdec_strcmp(const struct bval *v, const char *s);
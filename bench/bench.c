@@ -0,0 +1,463 @@
+// torrentize-bench: throughput benchmarks for libtorrentize, from the raw
+// hash functions up to whole torrents made from generated data sets.
+//
+// Each result is printed as one JSON object per line, so runs from
+// different versions can be collected and compared.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <err.h>
+#include "../xm.h"
+#include "../sha1lib.h"
+#include "../md5.h"
+#include "../sha256.h"
+#include "../hashq.h"
+#include "../numa.h"
+#include "../bencode.h"
+#include "../diag.h"
+#include "../filelist.h"
+#include "../torrent.h"
+
+// How long to keep repeating each measurement, in seconds.
+static double min_time = 0.5;
+
+// Size of each generated data set, in megabytes.
+static int dataset_mb = 256;
+
+static int nthreads;
+static const char *workdir = "/tmp";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *bench, const char *variant, long long size,
+	double secs, long long bytes, long long items)
+{
+	printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"size\":%lld,"
+		"\"seconds\":%.6f,\"bytes\":%lld,\"items\":%lld,"
+		"\"mb_per_s\":%.2f,\"items_per_s\":%.1f}\n",
+		bench, variant, size, secs, bytes, items,
+		bytes / secs / (1024 * 1024), items / secs);
+	fflush(stdout);
+}
+
+static unsigned char *random_buffer(size_t len)
+{
+	unsigned char *buf;
+	unsigned int x = 12345;
+	size_t ix;
+
+	buf = xm(1, len);
+	for (ix = 0; ix < len; ix++)
+	{
+		x = x * 1103515245 + 12345;
+		buf[ix] = x >> 16;
+	}
+	return buf;
+}
+
+// Raw hash function throughput, over a 1 MB buffer.
+static void bench_hashes(void)
+{
+	const int len = 1024 * 1024;
+	unsigned char *buf = random_buffer(len);
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA1_CTX sha1;
+	struct md5_ctx md5;
+	struct sha256_ctx sha256;
+	long long bytes;
+	double start, secs;
+	int algo;
+
+	for (algo = 0; algo < 3; algo++)
+	{
+		bytes = 0;
+		start = now();
+		do
+		{
+			if (algo == 0)
+			{
+				SHA1Init(&sha1);
+				SHA1Update(&sha1, buf, len);
+				SHA1Final(digest, &sha1);
+			}
+			else if (algo == 1)
+			{
+				md5_init(&md5);
+				md5_update(&md5, buf, len);
+				md5_final(digest, &md5);
+			}
+			else
+			{
+				sha256_init(&sha256);
+				sha256_update(&sha256, buf, len);
+				sha256_final(digest, &sha256);
+			}
+			bytes += len;
+		} while ((secs = now() - start) < min_time);
+
+		result("hash", algo == 0 ? "sha1" : algo == 1 ? "md5"
+			: "sha256", len, secs, bytes, bytes / len);
+	}
+	free(buf);
+}
+
+// Counts pieces coming back from the hashing stage.
+struct counter
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long long done;
+};
+
+static void piece_done(void *arg, unsigned char *buf, unsigned char *digest,
+	double cpu)
+{
+	struct counter *c = arg;
+
+	(void)buf;
+	(void)digest;
+	(void)cpu;
+	pthread_mutex_lock(&c->lock);
+	c->done++;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Piece hashing through the hashing stage, at a range of piece sizes,
+// inline and with a thread per CPU.
+static void bench_pieces(void)
+{
+	static const int sizes[] = { 16, 64, 256, 1024, 4096 };
+	const int maxlen = 4096 * 1024;
+	unsigned char *buf = random_buffer(maxlen);
+	unsigned char *digests;
+	struct hashq *hq;
+	struct counter c;
+	char variant[32];
+	long long n;
+	double start, secs;
+	int threads;
+	int ix;
+
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+	digests = xm(SHA1_DIGEST_LENGTH, 2 * nthreads + 2);
+
+	for (threads = 0; threads <= nthreads; threads += nthreads)
+	{
+		if ((hq = hq_new(threads, numa_get())) == NULL)
+			errx(1, "cannot create hashing threads");
+		for (ix = 0; ix < (int)(sizeof sizes / sizeof sizes[0]); ix++)
+		{
+			c.done = 0;
+			n = 0;
+			start = now();
+			do
+			{
+				// Every job reads the same buffer, which
+				// the hashers leave alone.
+				hq_submit(hq, buf, sizes[ix] * 1024, digests
+					+ n % (2 * nthreads + 2)
+					* SHA1_DIGEST_LENGTH, piece_done, &c,
+					NULL);
+				n++;
+			} while (now() - start < min_time);
+
+			pthread_mutex_lock(&c.lock);
+			while (c.done < n)
+				pthread_cond_wait(&c.cond, &c.lock);
+			pthread_mutex_unlock(&c.lock);
+			secs = now() - start;
+
+			snprintf(variant, sizeof variant, "threads=%d",
+				threads);
+			result("pieces", variant, sizes[ix] * 1024LL, secs,
+				n * sizes[ix] * 1024, n);
+		}
+		hq_free(hq);
+		if (nthreads == 0)
+			break;
+	}
+
+	free(digests);
+	free(buf);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+}
+
+static int null_write(void *arg, const void *buf, size_t len)
+{
+	(void)buf;
+	*(long long *)arg += len;
+	return 0;
+}
+
+// The bencode writer on the file list of a huge torrent.
+static void bench_bencode(void)
+{
+	const int nfiles = 1000000;
+	static struct benc b;
+	char path[64];
+	long long bytes = 0;
+	double start;
+	int ix;
+
+	benc_init(&b, null_write, &bytes);
+	start = now();
+	benc_list(&b);
+	for (ix = 0; ix < nfiles; ix++)
+	{
+		snprintf(path, sizeof path, "dir%d/sub%d/file%d.dat",
+			ix / 10000, ix / 100 % 100, ix);
+		benc_dict(&b);
+		benc_str(&b, "length");
+		benc_int(&b, 1000LL * ix);
+		benc_str(&b, "path");
+		benc_path(&b, path);
+		benc_end(&b);
+	}
+	benc_end(&b);
+	benc_flush(&b);
+	result("bencode", "file list", nfiles, now() - start, bytes, nfiles);
+}
+
+static void write_file(const char *path, const unsigned char *data,
+	size_t len)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		err(1, "cannot create %s", path);
+	if (len > 0 && write(fd, data, len) != (ssize_t)len)
+		err(1, "error writing to %s", path);
+	close(fd);
+}
+
+static char *make_dir(const char *parent, const char *name)
+{
+	char *path;
+
+	path = xm(1, strlen(parent) + strlen(name) + 2);
+	sprintf(path, "%s/%s", parent, name);
+	if (mkdir(path, 0755) == -1)
+		err(1, "cannot create %s", path);
+	return path;
+}
+
+// Make a data set of nfiles files of size bytes each, spread over
+// subdirectories of 100 files. Sparse files are left as holes.
+static char *make_dataset(const char *name, int nfiles, long long size,
+	int sparse)
+{
+	char *top;
+	char *dir = NULL;
+	char sub[32];
+	char path[4096];
+	unsigned char *data = NULL;
+	int fd;
+	int ix;
+
+	top = make_dir(workdir, name);
+	if (!sparse)
+		data = random_buffer(size);
+	for (ix = 0; ix < nfiles; ix++)
+	{
+		if (ix % 100 == 0)
+		{
+			free(dir);
+			snprintf(sub, sizeof sub, "d%d", ix / 100);
+			dir = make_dir(top, sub);
+		}
+		snprintf(path, sizeof path, "%s/f%d", dir, ix);
+		if (!sparse)
+			write_file(path, data, size);
+		else
+		{
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1 || ftruncate(fd, size) == -1)
+				err(1, "cannot create %s", path);
+			close(fd);
+		}
+	}
+	free(dir);
+	free(data);
+	return top;
+}
+
+static void remove_tree(const char *path)
+{
+	struct filelist fl;
+	struct diag d;
+	char *full;
+	int ix;
+
+	diag_init(&d, NULL, NULL);
+	if (getfilelist(&fl, path, 0, NULL, &d) == 0)
+	{
+		for (ix = 0; ix < fl.n; ix++)
+		{
+			full = xm(1, strlen(path) + strlen(fl.names[ix]) + 2);
+			sprintf(full, "%s/%s", path, fl.names[ix]);
+			unlink(full);
+			free(full);
+		}
+		freefilelist(&fl);
+	}
+
+	// The directories are only ever two deep.
+	for (ix = 0; ; ix++)
+	{
+		full = xm(1, strlen(path) + 32);
+		sprintf(full, "%s/d%d", path, ix);
+		if (rmdir(full) == -1)
+		{
+			free(full);
+			break;
+		}
+		free(full);
+	}
+	rmdir(path);
+}
+
+// Directory scanning on a tree of empty files.
+static void bench_scan(void)
+{
+	const int nfiles = 20000;
+	struct filelist fl;
+	struct diag d;
+	char *top;
+	double start;
+	long long n = 0;
+
+	top = make_dataset("torrentize-bench-scan", nfiles, 0, 0);
+	diag_init(&d, NULL, NULL);
+	start = now();
+	do
+	{
+		if (getfilelist(&fl, top, 0, NULL, &d) == -1)
+			errx(1, "%s", d.msg);
+		n += fl.n;
+		freefilelist(&fl);
+	} while (now() - start < min_time);
+	result("scan", "flat files", nfiles, now() - start, 0, n);
+
+	remove_tree(top);
+	free(top);
+}
+
+// Whole torrents made from a data set, written nowhere. The data has just
+// been written, so this measures the warm-cache case.
+static void bench_torrent(const char *variant, int nfiles, long long size,
+	int sparse)
+{
+	static const char *const trackers[] = { "http://tracker/announce" };
+	struct torrent_opts opts;
+	struct torrent *t;
+	char name[64];
+	char *top;
+	long long written = 0;
+	double start;
+
+	snprintf(name, sizeof name, "torrentize-bench-%s", variant);
+	top = make_dataset(name, nfiles, size, sparse);
+
+	torrent_defaults(&opts);
+	opts.hash_threads = nthreads;
+	opts.tracker_urls = trackers;
+	opts.num_tracker_urls = 1;
+	opts.write = null_write;
+	opts.writearg = &written;
+
+	t = torrent_new(&opts);
+	start = now();
+	if (torrent_create(t, top, NULL, "null") == -1)
+		errx(1, "%s", torrent_error(t));
+	result("torrent", variant, size, now() - start, nfiles * size,
+		nfiles);
+	torrent_free(t);
+
+	remove_tree(top);
+	free(top);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: torrentize-bench [-d dir] [-j threads] "
+		"[-s MB] [-t seconds] [bench ...]\n"
+		"benches: hash pieces bencode scan torrent (default: all)\n");
+	exit(1);
+}
+
+static int wanted(int argc, char *argv[], const char *bench)
+{
+	int ix;
+
+	if (argc == 0)
+		return 1;
+	for (ix = 0; ix < argc; ix++)
+	{
+		if (strcmp(argv[ix], bench) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long long total;
+	int ret;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	while ((ret = getopt(argc, argv, "d:j:s:t:")) != -1)
+	{
+		if (ret == 'd')
+			workdir = optarg;
+		else if (ret == 'j')
+			nthreads = atoi(optarg);
+		else if (ret == 's')
+			dataset_mb = atoi(optarg);
+		else if (ret == 't')
+			min_time = atof(optarg);
+		else
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+	if (nthreads < 0 || dataset_mb < 1 || min_time <= 0)
+		usage();
+
+	if (wanted(argc, argv, "hash"))
+		bench_hashes();
+	if (wanted(argc, argv, "pieces"))
+		bench_pieces();
+	if (wanted(argc, argv, "bencode"))
+		bench_bencode();
+	if (wanted(argc, argv, "scan"))
+		bench_scan();
+	if (wanted(argc, argv, "torrent"))
+	{
+		total = dataset_mb * 1024LL * 1024;
+		bench_torrent("dense", 4, total / 4, 0);
+		bench_torrent("sparse", 4, total / 4, 1);
+		bench_torrent("small-files", total / 4096 < 100000
+			? total / 4096 : 100000, 4096, 0);
+	}
+	return 0;
+}
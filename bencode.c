@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include "bencode.h"
+
+void benc_init(struct benc *b, benc_write_fn write, void *arg)
+{
+	b->write = write;
+	b->arg = arg;
+	b->len = 0;
+	b->error = 0;
+}
+
+int benc_flush(struct benc *b)
+{
+	if (b->len > 0 && !b->error && b->write(b->arg, b->buf, b->len) != 0)
+		b->error = 1;
+	b->len = 0;
+	return b->error ? -1 : 0;
+}
+
+void benc_raw(struct benc *b, const void *data, size_t len)
+{
+	if (b->len + len > sizeof b->buf)
+	{
+		benc_flush(b);
+
+		// Big enough not to be worth copying.
+		if (len > sizeof b->buf / 2)
+		{
+			if (!b->error && b->write(b->arg, data, len) != 0)
+				b->error = 1;
+			return;
+		}
+	}
+	memcpy(&b->buf[b->len], data, len);
+	b->len += len;
+}
+
+void benc_bytes(struct benc *b, const void *data, size_t len)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof buf, "%lu:", (unsigned long)len);
+	benc_raw(b, buf, strlen(buf));
+	benc_raw(b, data, len);
+}
+
+void benc_str(struct benc *b, const char *s)
+{
+	benc_bytes(b, s, strlen(s));
+}
+
+void benc_int(struct benc *b, long long n)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof buf, "i%llde", n);
+	benc_raw(b, buf, strlen(buf));
+}
+
+void benc_list(struct benc *b)
+{
+	benc_raw(b, "l", 1);
+}
+
+void benc_dict(struct benc *b)
+{
+	benc_raw(b, "d", 1);
+}
+
+void benc_end(struct benc *b)
+{
+	benc_raw(b, "e", 1);
+}
+
+void benc_path(struct benc *b, const char *path)
+{
+	const char *next;
+
+	benc_list(b);
+	while ((next = strchr(path, '/')) != NULL)
+	{
+		benc_bytes(b, path, next - path);
+		path = next + 1;
+	}
+	benc_str(b, path);
+	benc_end(b);
+}
+
+int benc_write_file(void *arg, const void *buf, size_t len)
+{
+	FILE *fp = arg;
+
+	return fwrite(buf, 1, len, fp) == len ? 0 : -1;
+}
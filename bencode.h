@@ -0,0 +1,36 @@
+// Writing bencoded data to an output sink, through a buffer.
+
+#define BENC_BUFSIZE 65536
+
+// An output sink: write len bytes, returning 0 on success or -1 on error.
+typedef int (*benc_write_fn)(void *arg, const void *buf, size_t len);
+
+struct benc
+{
+	benc_write_fn write;
+	void *arg;
+	unsigned char buf[BENC_BUFSIZE];
+	size_t len;
+	int error;		// set once a write fails; then output is dropped
+};
+
+void benc_init(struct benc *b, benc_write_fn write, void *arg);
+
+// Write out whatever is buffered. Returns -1 if any write has failed.
+int benc_flush(struct benc *b);
+
+void benc_raw(struct benc *b, const void *data, size_t len);
+void benc_bytes(struct benc *b, const void *data, size_t len);
+void benc_str(struct benc *b, const char *s);
+void benc_int(struct benc *b, long long n);
+
+// Start a list; start a dictionary; end a list or dictionary.
+void benc_list(struct benc *b);
+void benc_dict(struct benc *b);
+void benc_end(struct benc *b);
+
+// Write a path as a list of the components.
+void benc_path(struct benc *b, const char *path);
+
+// A sink writing to a stdio stream.
+int benc_write_file(void *arg, const void *buf, size_t len);
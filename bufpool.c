@@ -0,0 +1,258 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include "err.h"
+#include "xm.h"
+#include "numa.h"
+#include "bufpool.h"
+
+#define BUF_ALIGN 4096
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+// How a slab of buffers was allocated.
+enum
+{
+	SLAB_HUGETLB,		// mmap() with MAP_HUGETLB
+	SLAB_THP,		// posix_memalign(), madvise(MADV_HUGEPAGE)
+	SLAB_NORMAL		// posix_memalign()
+};
+
+static const char *const mode_names[] =
+{
+	"huge pages (MAP_HUGETLB)",
+	"transparent huge pages",
+	"normal pages"
+};
+
+struct slab
+{
+	void *p;
+	size_t len;
+	int mode;
+	int node;
+};
+
+// Buffers that have been returned and can be reused, from one node's
+// slabs.
+struct freelist
+{
+	unsigned char **bufs;
+	int n, s;
+};
+
+struct bufpool
+{
+	size_t bufsize;
+	int maxbufs;
+	int nout;		// buffers currently handed out
+	int nbufs;		// buffers carved out of slabs so far
+
+	// Buffers are carved out of slabs of one or more huge pages where
+	// possible, to cut down on TLB misses while hashing.
+	struct slab *slabs;
+	int nslabs, sslabs;
+
+	// A free list for each NUMA node, so a buffer goes back to the
+	// node whose memory it's in, and threads there get it next.
+	const struct numa *numa;
+	struct freelist *free;
+	int nnodes;
+};
+
+struct bufpool *bp_new(size_t bufsize, int maxbufs, const struct numa *nu)
+{
+	struct bufpool *bp;
+	int ix;
+
+	bp = xm(sizeof *bp, 1);
+	bp->bufsize = (bufsize + BUF_ALIGN - 1) / BUF_ALIGN * BUF_ALIGN;
+	bp->maxbufs = maxbufs;
+	bp->nout = 0;
+	bp->nbufs = 0;
+	bp->slabs = NULL;
+	bp->nslabs = bp->sslabs = 0;
+	bp->numa = nu;
+	bp->nnodes = numa_nodes(nu);
+	bp->free = xm(sizeof bp->free[0], bp->nnodes);
+	for (ix = 0; ix < bp->nnodes; ix++)
+	{
+		bp->free[ix].bufs = NULL;
+		bp->free[ix].n = bp->free[ix].s = 0;
+	}
+	return bp;
+}
+
+void bp_free(struct bufpool *bp)
+{
+	int ix;
+
+	for (ix = 0; ix < bp->nslabs; ix++)
+	{
+		if (bp->slabs[ix].mode == SLAB_HUGETLB)
+			munmap(bp->slabs[ix].p, bp->slabs[ix].len);
+		else
+			free(bp->slabs[ix].p);
+	}
+	free(bp->slabs);
+	for (ix = 0; ix < bp->nnodes; ix++)
+		free(bp->free[ix].bufs);
+	free(bp->free);
+	free(bp);
+}
+
+void bp_limit(struct bufpool *bp, int maxbufs)
+{
+	bp->maxbufs = maxbufs;
+}
+
+// Allocate a slab of len bytes, trying huge pages first and falling back
+// transparently if they aren't available.
+static void *alloc_slab(size_t len, int *mode)
+{
+	void *p;
+
+#ifdef MAP_HUGETLB
+	if (len % HUGE_PAGE == 0)
+	{
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			*mode = SLAB_HUGETLB;
+			return p;
+		}
+	}
+#endif
+
+	if (len % HUGE_PAGE == 0
+		&& posix_memalign(&p, HUGE_PAGE, len) == 0)
+	{
+#ifdef MADV_HUGEPAGE
+		if (madvise(p, len, MADV_HUGEPAGE) == 0)
+		{
+			*mode = SLAB_THP;
+			return p;
+		}
+#endif
+		*mode = SLAB_NORMAL;
+		return p;
+	}
+
+	if (posix_memalign(&p, BUF_ALIGN, len) != 0)
+		errx(1, "cannot allocate %lu bytes", (unsigned long)len);
+	*mode = SLAB_NORMAL;
+	return p;
+}
+
+// Add a new slab's worth of buffers to node's free list.
+static void add_slab(struct bufpool *bp, int node)
+{
+	struct freelist *fl = &bp->free[node];
+	struct slab *sl;
+	size_t count;
+	size_t ix;
+
+	// Enough buffers to fill at least one huge page, but no more
+	// than the limit allows.
+	count = HUGE_PAGE / bp->bufsize;
+	if (count < 1)
+		count = 1;
+	if (bp->maxbufs > 0 && bp->nbufs < bp->maxbufs
+		&& count > (size_t)(bp->maxbufs - bp->nbufs))
+	{
+		count = bp->maxbufs - bp->nbufs;
+	}
+
+	XPND(bp->slabs, bp->nslabs, bp->sslabs);
+	sl = &bp->slabs[bp->nslabs++];
+	sl->len = count * bp->bufsize;
+	if (sl->len >= HUGE_PAGE)
+		sl->len = (sl->len + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+	sl->p = alloc_slab(sl->len, &sl->mode);
+	sl->node = node;
+	numa_bind_memory(bp->numa, sl->p, sl->len, node);
+
+	for (ix = 0; ix < count; ix++)
+	{
+		XPND(fl->bufs, fl->n, fl->s);
+		fl->bufs[fl->n++] = (unsigned char *)sl->p + ix * bp->bufsize;
+	}
+	bp->nbufs += count;
+}
+
+// Buffers come from the calling thread's node where there are any. When
+// there aren't, but there are on other nodes and the limit has been
+// reached, one of those is used rather than going over.
+unsigned char *bp_force(struct bufpool *bp)
+{
+	struct freelist *fl;
+	int node;
+
+	node = numa_current(bp->numa);
+	if (bp->free[node].n == 0)
+	{
+		if (bp->nout == bp->nbufs || bp->maxbufs == 0
+			|| bp->nbufs < bp->maxbufs)
+		{
+			add_slab(bp, node);
+		}
+		else
+		{
+			for (node = 0; bp->free[node].n == 0; node++)
+				;
+		}
+	}
+	fl = &bp->free[node];
+	bp->nout++;
+	return fl->bufs[--fl->n];
+}
+
+unsigned char *bp_get(struct bufpool *bp)
+{
+	if (bp->maxbufs > 0 && bp->nout >= bp->maxbufs)
+		return NULL;
+	return bp_force(bp);
+}
+
+// Which node's slab buf was carved out of.
+static int buf_node(const struct bufpool *bp, const unsigned char *buf)
+{
+	const struct slab *sl;
+	int ix;
+
+	if (bp->nnodes == 1)
+		return 0;
+	for (ix = 0; ix < bp->nslabs; ix++)
+	{
+		sl = &bp->slabs[ix];
+		if (buf >= (unsigned char *)sl->p
+			&& buf < (unsigned char *)sl->p + sl->len)
+		{
+			return sl->node;
+		}
+	}
+	return 0;
+}
+
+void bp_put(struct bufpool *bp, unsigned char *buf)
+{
+	struct freelist *fl = &bp->free[buf_node(bp, buf)];
+
+	XPND(fl->bufs, fl->n, fl->s);
+	fl->bufs[fl->n++] = buf;
+	bp->nout--;
+}
+
+const char *bp_mode(const struct bufpool *bp)
+{
+	int ix;
+
+	if (bp->nslabs == 0)
+		return "none allocated";
+	for (ix = 1; ix < bp->nslabs; ix++)
+	{
+		if (bp->slabs[ix].mode != bp->slabs[0].mode)
+			return "a mix of page sizes";
+	}
+	return mode_names[bp->slabs[0].mode];
+}
@@ -0,0 +1,28 @@
+// A pool of equal-sized, page-aligned buffers, recycled rather than freed
+// so that piece buffers aren't malloc'd over and over. Buffers are backed
+// by 2 MB huge pages when the system allows it, and on NUMA machines, come
+// from the memory of the node the thread getting them runs on. Not
+// thread-safe; callers provide their own locking.
+
+struct bufpool;
+struct numa;
+
+// maxbufs is the most buffers that may be handed out at once, or 0 for
+// no limit. nu is the NUMA layout, or NULL to pay it no attention.
+struct bufpool *bp_new(size_t bufsize, int maxbufs, const struct numa *nu);
+void bp_free(struct bufpool *bp);
+
+// Change the limit, so a pool can be kept for reuse. Buffers already
+// allocated are kept either way.
+void bp_limit(struct bufpool *bp, int maxbufs);
+
+// Get a buffer, or NULL if the limit has been reached.
+unsigned char *bp_get(struct bufpool *bp);
+
+// Get a buffer even if that means going over the limit.
+unsigned char *bp_force(struct bufpool *bp);
+
+void bp_put(struct bufpool *bp, unsigned char *buf);
+
+// Describe what kind of pages the buffers were allocated from.
+const char *bp_mode(const struct bufpool *bp);
@@ -0,0 +1,273 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "xm.h"
+#include "io.h"
+#include "sha1lib.h"
+#include "diag.h"
+#include "piecemap.h"
+#include "checkpoint.h"
+
+#define MAGIC "TZCKPT1\n"
+#define MAGIC_LEN 8
+
+// The header: magic, signature, then piece count as 4 big-endian bytes.
+#define HEADER_LEN (MAGIC_LEN + CKPT_SIG_LENGTH + 4)
+
+// Digests are restored this many at a time.
+#define RESTORE_CHUNK 4096
+
+struct checkpoint
+{
+	char *path;
+	int fd;
+	struct diag *diag;
+
+	int npieces;
+	int mapbytes;
+	unsigned char *saved;	// bitmap of the pieces in the file
+	unsigned char *map;	// scratch copy of the piece map's
+	int restored;
+};
+
+static off_t digest_offset(const struct checkpoint *ck, int index)
+{
+	return HEADER_LEN + ck->mapbytes + (off_t)index * SHA1_DIGEST_LENGTH;
+}
+
+static void make_header(unsigned char *hdr, const unsigned char *sig,
+	int npieces)
+{
+	memcpy(hdr, MAGIC, MAGIC_LEN);
+	memcpy(hdr + MAGIC_LEN, sig, CKPT_SIG_LENGTH);
+	hdr[HEADER_LEN - 4] = npieces >> 24;
+	hdr[HEADER_LEN - 3] = npieces >> 16;
+	hdr[HEADER_LEN - 2] = npieces >> 8;
+	hdr[HEADER_LEN - 1] = npieces;
+}
+
+// Load the pieces saved by an earlier run into pm. Returns 0 if the file
+// isn't a checkpoint for this data, leaving pm alone.
+static int restore(struct checkpoint *ck, const unsigned char *hdr,
+	struct piecemap *pm)
+{
+	unsigned char old[HEADER_LEN];
+	unsigned char *digests;
+	int first, n;
+	int ix;
+
+	if (pread_fully(ck->fd, old, HEADER_LEN, 0) == -1
+		|| memcmp(old, hdr, HEADER_LEN) != 0
+		|| pread_fully(ck->fd, ck->saved, ck->mapbytes, HEADER_LEN)
+		== -1)
+	{
+		return 0;
+	}
+
+	// Keep stray bits past the last piece out of it.
+	if (ck->npieces % 8 != 0)
+		ck->saved[ck->mapbytes - 1] &= (1 << ck->npieces % 8) - 1;
+
+	digests = xm(SHA1_DIGEST_LENGTH, RESTORE_CHUNK);
+	for (first = 0; first < ck->npieces; first += RESTORE_CHUNK)
+	{
+		n = ck->npieces - first < RESTORE_CHUNK
+			? ck->npieces - first : RESTORE_CHUNK;
+		if (pread_fully(ck->fd, digests, (size_t)n
+			* SHA1_DIGEST_LENGTH, digest_offset(ck, first)) == -1)
+		{
+			free(digests);
+			memset(ck->saved, 0, ck->mapbytes);
+			return 0;
+		}
+		for (ix = 0; ix < n; ix++)
+		{
+			if (ck->saved[(first + ix) / 8] >> (first + ix) % 8 & 1)
+			{
+				pm_preset(pm, first + ix,
+					digests + ix * SHA1_DIGEST_LENGTH);
+				ck->restored++;
+			}
+		}
+	}
+	free(digests);
+	return 1;
+}
+
+struct checkpoint *ckpt_open(const char *path, const unsigned char *sig,
+	struct piecemap *pm, int resume, struct diag *d)
+{
+	struct checkpoint *ck;
+	unsigned char hdr[HEADER_LEN];
+
+	ck = xm(sizeof *ck, 1);
+	ck->diag = d;
+	ck->npieces = pm_npieces(pm);
+	ck->mapbytes = (ck->npieces + 7) / 8;
+	ck->saved = xm(1, ck->mapbytes + 1);
+	ck->map = xm(1, ck->mapbytes + 1);
+	memset(ck->saved, 0, ck->mapbytes);
+	ck->restored = 0;
+
+	ck->fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (ck->fd == -1)
+	{
+		diag_err(d, "cannot open checkpoint %s", path);
+		goto fail;
+	}
+	ck->path = xsd(path);
+
+	make_header(hdr, sig, ck->npieces);
+	if (resume && restore(ck, hdr, pm))
+		return ck;
+	if (resume && lseek(ck->fd, 0, SEEK_END) > 0)
+		diag_warnx(d, "%s is for other data; starting over", path);
+
+	// Start afresh: the bitmap and digests are all zeros to begin
+	// with, and the file is sparse until they're filled in.
+	if (ftruncate(ck->fd, 0) == -1
+		|| pwrite_fully(ck->fd, hdr, HEADER_LEN, 0) == -1
+		|| ftruncate(ck->fd, digest_offset(ck, ck->npieces)) == -1)
+	{
+		diag_err(d, "cannot write checkpoint %s", path);
+		close(ck->fd);
+		remove(ck->path);
+		free(ck->path);
+		goto fail;
+	}
+	return ck;
+
+fail:
+	free(ck->saved);
+	free(ck->map);
+	free(ck);
+	return NULL;
+}
+
+int ckpt_restored(const struct checkpoint *ck)
+{
+	return ck->restored;
+}
+
+// Is piece ix finished but not saved yet?
+static int unsaved(const struct checkpoint *ck, int ix)
+{
+	return (ck->map[ix / 8] & ~ck->saved[ix / 8]) >> ix % 8 & 1;
+}
+
+// Save any newly finished pieces, returning -1 with errno set on error.
+static int save(struct checkpoint *ck, struct piecemap *pm)
+{
+	const unsigned char *digests = pm_digests(pm);
+	int lo = -1, hi = -1;
+	int ix, end;
+
+	pm_done_map(pm, ck->map);
+
+	// Write out the new digests in runs, skipping a byte of the bitmap
+	// at a time where nothing has changed.
+	for (ix = 0; ix < ck->npieces; ix = end)
+	{
+		if (ck->map[ix / 8] == ck->saved[ix / 8])
+		{
+			end = (ix / 8 + 1) * 8;
+			continue;
+		}
+		end = ix + 1;
+		if (!unsaved(ck, ix))
+			continue;
+		while (end < ck->npieces && unsaved(ck, end))
+			end++;
+
+		if (pwrite_fully(ck->fd,
+			digests + (size_t)ix * SHA1_DIGEST_LENGTH,
+			(size_t)(end - ix) * SHA1_DIGEST_LENGTH,
+			digest_offset(ck, ix)) == -1)
+		{
+			return -1;
+		}
+		if (lo == -1)
+			lo = ix / 8;
+		hi = (end - 1) / 8;
+	}
+	if (lo == -1)
+		return 0;
+
+	// Only then mark them as saved.
+	if (fsync(ck->fd) == -1
+		|| pwrite_fully(ck->fd, ck->map + lo, hi - lo + 1,
+		HEADER_LEN + lo) == -1
+		|| fsync(ck->fd) == -1)
+	{
+		return -1;
+	}
+	memcpy(ck->saved + lo, ck->map + lo, hi - lo + 1);
+	return 0;
+}
+
+int ckpt_save(struct checkpoint *ck, struct piecemap *pm)
+{
+	if (save(ck, pm) == 0)
+		return 0;
+	diag_warnx(ck->diag, "cannot save checkpoint %s: %s", ck->path,
+		strerror(errno));
+	return -1;
+}
+
+void ckpt_close(struct checkpoint *ck, int finished)
+{
+	close(ck->fd);
+	if (finished)
+		remove(ck->path);
+	free(ck->path);
+	free(ck->saved);
+	free(ck->map);
+	free(ck);
+}
+
+int ckpt_write(const char *path, const unsigned char *sig,
+	struct piecemap *pm, struct diag *d)
+{
+	struct checkpoint *ck;
+
+	ck = ckpt_open(path, sig, pm, 0, d);
+	if (ck == NULL)
+		return -1;
+	if (save(ck, pm) == -1)
+	{
+		diag_err(d, "cannot write %s", path);
+		ckpt_close(ck, 1);
+		return -1;
+	}
+	ckpt_close(ck, 0);
+	return 0;
+}
+
+int ckpt_load(const char *path, const unsigned char *sig,
+	struct piecemap *pm, struct diag *d)
+{
+	struct checkpoint ck;
+	unsigned char hdr[HEADER_LEN];
+	int ok;
+
+	ck.fd = open(path, O_RDONLY);
+	if (ck.fd == -1)
+		return diag_err(d, "cannot open %s", path);
+	ck.npieces = pm_npieces(pm);
+	ck.mapbytes = (ck.npieces + 7) / 8;
+	ck.saved = xm(1, ck.mapbytes + 1);
+	memset(ck.saved, 0, ck.mapbytes);
+	ck.restored = 0;
+
+	make_header(hdr, sig, ck.npieces);
+	ok = restore(&ck, hdr, pm);
+	close(ck.fd);
+	free(ck.saved);
+	if (!ok)
+		return diag_errx(d, "%s is for other data", path);
+	return ck.restored;
+}
@@ -0,0 +1,43 @@
+// Checkpoints: a sidecar file holding the digests of the pieces hashed so
+// far, so that a torrent interrupted partway through can be carried on
+// with rather than started again.
+//
+// The file is a header identifying the data, a bitmap of the pieces
+// saved, then room for every piece's digest. Digests are written and
+// synced before the bitmap says they're there, so a run killed in the
+// middle of saving still leaves a usable file.
+
+struct piecemap;
+struct diag;
+
+#define CKPT_SIG_LENGTH 20
+
+struct checkpoint;
+
+// Open the checkpoint at path for data with the given signature, which
+// should change whenever the data might have. With resume set, an
+// existing file with the same signature is carried on with, and the
+// pieces saved in it given to pm with pm_preset(); otherwise the file is
+// started afresh. Returns NULL on error.
+struct checkpoint *ckpt_open(const char *path, const unsigned char *sig,
+	struct piecemap *pm, int resume, struct diag *d);
+
+// How many pieces were restored from an earlier run.
+int ckpt_restored(const struct checkpoint *ck);
+
+// Save the digests of any pieces pm has finished since the last save.
+// Problems are passed on as warnings, returning -1.
+int ckpt_save(struct checkpoint *ck, struct piecemap *pm);
+
+// Close the file, removing it if the torrent is finished with it.
+void ckpt_close(struct checkpoint *ck, int finished);
+
+// The same format holds the digests hashed by one shard of a torrent split
+// across machines. ckpt_write() saves the pieces pm has to a new file at
+// path, and ckpt_load() gives those saved at path to pm with pm_preset(),
+// returning how many, or -1 on error (including a signature that doesn't
+// match).
+int ckpt_write(const char *path, const unsigned char *sig,
+	struct piecemap *pm, struct diag *d);
+int ckpt_load(const char *path, const unsigned char *sig,
+	struct piecemap *pm, struct diag *d);
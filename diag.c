@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "diag.h"
+
+// Errors are rare, so one lock for every struct diag will do.
+static pthread_mutex_t diag_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void diag_init(struct diag *d, void (*warning)(void *arg, const char *msg),
+	void *arg)
+{
+	d->msg[0] = '\0';
+	d->failed = 0;
+	d->warning = warning;
+	d->arg = arg;
+}
+
+static void vdiag(struct diag *d, int errnum, const char *fmt, va_list args)
+{
+	size_t len;
+
+	pthread_mutex_lock(&diag_lock);
+	if (!d->failed)
+	{
+		vsnprintf(d->msg, sizeof d->msg, fmt, args);
+		if (errnum != 0)
+		{
+			len = strlen(d->msg);
+			snprintf(&d->msg[len], sizeof d->msg - len, ": %s",
+				strerror(errnum));
+		}
+		d->failed = 1;
+	}
+	pthread_mutex_unlock(&diag_lock);
+}
+
+int diag_err(struct diag *d, const char *fmt, ...)
+{
+	int errnum = errno;
+	va_list argptr;
+
+	va_start(argptr, fmt);
+	vdiag(d, errnum, fmt, argptr);
+	va_end(argptr);
+	return -1;
+}
+
+int diag_errx(struct diag *d, const char *fmt, ...)
+{
+	va_list argptr;
+
+	va_start(argptr, fmt);
+	vdiag(d, 0, fmt, argptr);
+	va_end(argptr);
+	return -1;
+}
+
+int diag_failed(struct diag *d)
+{
+	int ret;
+
+	pthread_mutex_lock(&diag_lock);
+	ret = d->failed;
+	pthread_mutex_unlock(&diag_lock);
+	return ret;
+}
+
+void diag_warnx(struct diag *d, const char *fmt, ...)
+{
+	char buf[DIAG_LEN];
+	va_list argptr;
+
+	if (d->warning == NULL)
+		return;
+
+	va_start(argptr, fmt);
+	vsnprintf(buf, sizeof buf, fmt, argptr);
+	va_end(argptr);
+	d->warning(d->arg, buf);
+}
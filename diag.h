@@ -0,0 +1,29 @@
+// Diagnostics for library code, which reports errors back to its caller
+// rather than exiting the way err() and errx() do.
+
+#define DIAG_LEN 512
+
+struct diag
+{
+	char msg[DIAG_LEN];	// the first error reported
+	int failed;
+
+	// Where warnings go; may be NULL to drop them.
+	void (*warning)(void *arg, const char *msg);
+	void *arg;
+};
+
+void diag_init(struct diag *d, void (*warning)(void *arg, const char *msg),
+	void *arg);
+
+// Record an error, like err() and errx() respectively. Only the first
+// error is kept. These may be called from any thread, and return -1 so
+// they can be used as `return diag_err(...)'.
+int diag_err(struct diag *d, const char *fmt, ...);
+int diag_errx(struct diag *d, const char *fmt, ...);
+
+// Has an error been recorded?
+int diag_failed(struct diag *d);
+
+// Pass a warning on, like warnx().
+void diag_warnx(struct diag *d, const char *fmt, ...);
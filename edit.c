@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include "xm.h"
+#include "sha1lib.h"
+#include "diag.h"
+#include "bencode.h"
+#include "bdecode.h"
+#include "torrent.h"
+#include "edit.h"
+
+struct editor
+{
+	const struct torrent_changes *c;
+	struct bval info;	// the original info dictionary
+	struct benc *out;
+
+	// The info dictionary is written through hb on its way to out, to
+	// work out the new info-hash.
+	struct benc hb;
+	SHA1_CTX ctx;
+};
+
+// A key to give a new value while copying a dictionary, or to remove if
+// write is NULL.
+struct setkey
+{
+	const char *key;
+	void (*write)(struct editor *ed, struct benc *b);
+};
+
+static int hash_sink(void *arg, const void *buf, size_t len)
+{
+	struct editor *ed = arg;
+
+	SHA1UpdateLarge(&ed->ctx, buf, len);
+	benc_raw(ed->out, buf, len);
+	return 0;
+}
+
+static void put(struct editor *ed, struct benc *b, const struct setkey *sk)
+{
+	if (sk->write == NULL)
+		return;
+	benc_str(b, sk->key);
+	sk->write(ed, b);
+}
+
+// Copy a dictionary, with the keys in set (in sorted order, as the keys
+// of a dictionary are) given new values or removed.
+static void copy_dict(struct editor *ed, struct benc *b,
+	const struct bval *dict, const struct setkey *set, int nset)
+{
+	const unsigned char *pos = NULL;
+	struct bval key, item;
+	int ix = 0;
+	int cmp = 1;
+
+	benc_dict(b);
+	while (bdec_next(dict, &pos, &key, &item) == 0)
+	{
+		// Put in new keys coming before this one.
+		for (; ix < nset; ix++)
+		{
+			cmp = bdec_strcmp(&key, set[ix].key);
+			if (cmp <= 0)
+				break;
+			put(ed, b, &set[ix]);
+		}
+		if (ix < nset && cmp == 0)
+		{
+			put(ed, b, &set[ix++]);
+			continue;
+		}
+		benc_raw(b, key.raw, key.rawlen);
+		benc_raw(b, item.raw, item.rawlen);
+	}
+	for (; ix < nset; ix++)
+		put(ed, b, &set[ix]);
+	benc_end(b);
+}
+
+static void write_announce(struct editor *ed, struct benc *b)
+{
+	benc_str(b, ed->c->tracker_urls[0]);
+}
+
+// Each tracker in its own tier, as torrent_create() does.
+static void write_announce_list(struct editor *ed, struct benc *b)
+{
+	int ix;
+
+	benc_list(b);
+	for (ix = 0; ix < ed->c->num_tracker_urls; ix++)
+	{
+		benc_list(b);
+		benc_str(b, ed->c->tracker_urls[ix]);
+		benc_end(b);
+	}
+	benc_end(b);
+}
+
+static void write_comment(struct editor *ed, struct benc *b)
+{
+	benc_str(b, ed->c->comment);
+}
+
+static void write_name(struct editor *ed, struct benc *b)
+{
+	benc_str(b, ed->c->name);
+}
+
+static void write_private(struct editor *ed, struct benc *b)
+{
+	(void)ed;
+	benc_int(b, 1);
+}
+
+static void write_info(struct editor *ed, struct benc *b)
+{
+	struct setkey set[3];
+	int nset = 0;
+
+	benc_flush(b);
+	SHA1Init(&ed->ctx);
+	benc_init(&ed->hb, hash_sink, ed);
+
+	if (ed->c->name != NULL)
+	{
+		// The UTF-8 copy of the name some clients add would be
+		// left saying the old one.
+		set[nset].key = "name";
+		set[nset++].write = write_name;
+		set[nset].key = "name.utf-8";
+		set[nset++].write = NULL;
+	}
+	if (ed->c->private != -1)
+	{
+		set[nset].key = "private";
+		set[nset++].write = ed->c->private ? write_private : NULL;
+	}
+
+	if (nset == 0)
+		benc_raw(&ed->hb, ed->info.raw, ed->info.rawlen);
+	else
+		copy_dict(ed, &ed->hb, &ed->info, set, nset);
+	benc_flush(&ed->hb);
+}
+
+int edit_torrent(const char *name, const unsigned char *buf, size_t len,
+	const struct torrent_changes *c, struct benc *out,
+	unsigned char *oldhash, unsigned char *newhash, struct diag *d)
+{
+	struct editor *ed;
+	struct bval top;
+	struct setkey set[4];
+	const char *err;
+	SHA1_CTX ctx;
+	int nset = 0;
+
+	if (bdec_parse(buf, len, &top, &err) == -1)
+		return diag_errx(d, "%s isn't a torrent: %s", name, err);
+	if (top.rawlen != len)
+	{
+		return diag_errx(d, "%s isn't a torrent: junk at the end",
+			name);
+	}
+
+	ed = xm(sizeof *ed, 1);
+	ed->c = c;
+	ed->out = out;
+	if (top.type != BDEC_DICT
+		|| bdec_lookup(&top, "info", &ed->info) == -1
+		|| ed->info.type != BDEC_DICT)
+	{
+		free(ed);
+		return diag_errx(d, "%s isn't a torrent: no info dictionary",
+			name);
+	}
+
+	SHA1Init(&ctx);
+	SHA1UpdateLarge(&ctx, ed->info.raw, ed->info.rawlen);
+	SHA1Final(oldhash, &ctx);
+
+	// With one tracker, there's no need for an announce-list.
+	if (c->num_tracker_urls > 0)
+	{
+		set[nset].key = "announce";
+		set[nset++].write = write_announce;
+		set[nset].key = "announce-list";
+		set[nset++].write = c->num_tracker_urls > 1
+			? write_announce_list : NULL;
+	}
+	if (c->comment != NULL)
+	{
+		set[nset].key = "comment";
+		set[nset++].write = c->comment[0] != '\0'
+			? write_comment : NULL;
+	}
+	set[nset].key = "info";
+	set[nset++].write = write_info;
+
+	copy_dict(ed, out, &top, set, nset);
+	SHA1Final(newhash, &ed->ctx);
+	free(ed);
+	return 0;
+}
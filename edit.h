@@ -0,0 +1,14 @@
+// Rewriting the metainfo of an existing torrent, for torrent_edit(). The
+// torrent is parsed in place, and everything not being changed, the
+// pieces above all, is copied through byte for byte.
+
+struct torrent_changes;
+struct benc;
+struct diag;
+
+// Write the torrent in buf, read from the file name, to out with the
+// changes made, setting oldhash and newhash to its info-hash before and
+// after. Returns -1 with an error in d if buf isn't a torrent.
+int edit_torrent(const char *name, const unsigned char *buf, size_t len,
+	const struct torrent_changes *c, struct benc *out,
+	unsigned char *oldhash, unsigned char *newhash, struct diag *d);
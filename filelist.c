@@ -5,36 +5,47 @@
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
-#include <assert.h>
-#include "err.h"
 #include "xm.h"
-
-static char **fnams;
-static int nfnams, sfnams;
-
-static const char **ignores;
-static int num_ignores;
+#include "diag.h"
+#include "ignore.h"
+#include "filelist.h"
 
 // Recursively add a directory. prefix is the prefix used to store
 // each name, as opposed to the real filename given by starting with
 // dirname.
-static void add_dir(const char *dirname, const char *prefix)
+static int add_dir(struct filelist *fl, const char *dirname,
+	const char *prefix)
 {
 	DIR *dh;
 	struct dirent *de;
 	char *newprefix;
 	char *newdirname;
 	char *fname;
+	int ret;
 
 	if ((dh = opendir(dirname)) == NULL)
-		err(1, "cannot open directory %s", dirname);
+		return diag_err(fl->diag, "cannot open directory %s", dirname);
+	fl->ndirs++;
 
 	while ((de = readdir(dh)) != NULL)
 	{
 		size_t namlen;
 		int filetype;
 
-		// TODO: check for wildcard match & skip
+		if (strcmp(de->d_name, ".") == 0
+			|| strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+		fl->nentries++;
+
+		// Skip ignored entries before even finding out what they
+		// are. Patterns only for directories are checked below.
+		if (fl->ignore != NULL
+			&& ignore_match(fl->ignore, prefix, de->d_name, 0))
+		{
+			continue;
+		}
 
 		filetype = de->d_type;
 		namlen = strlen(de->d_name);
@@ -55,11 +66,16 @@ static void add_dir(const char *dirname, const char *prefix)
 			sprintf(fname, "%s%s%s", dirname,
 				strlen(dirname) == 0 ? "" : "/", de->d_name);
 
+			fl->nstats++;
 			if (stat(fname, &info) == -1)
-				warnx("\rcan't stat file %s, skipping", fname);
+			{
+				diag_warnx(fl->diag,
+					"can't stat file %s, skipping", fname);
+			}
 			else if (filetype == DT_LNK && S_ISDIR(info.st_mode))
 			{
-				warnx("\rskipping symlinked directory %s",
+				diag_warnx(fl->diag,
+					"skipping symlinked directory %s",
 					fname);
 			}
 			else if (S_ISDIR(info.st_mode))
@@ -67,7 +83,10 @@ static void add_dir(const char *dirname, const char *prefix)
 			else if (S_ISREG(info.st_mode))
 				filetype = DT_REG; // XXX
 			else
-				warnx("\rskipping non-regular file %s", fname);
+			{
+				diag_warnx(fl->diag,
+					"skipping non-regular file %s", fname);
+			}
 
 			free(fname);
 			fname = NULL;
@@ -78,13 +97,15 @@ static void add_dir(const char *dirname, const char *prefix)
 			fname = xm(1, strlen(prefix) + 1 + namlen + 1);
 			sprintf(fname, "%s%s%s", prefix,
 				strlen(prefix) == 0 ? "" : "/", de->d_name);
-			XPND(fnams, nfnams, sfnams);
-			fnams[nfnams++] = fname;
+			XPND(fl->names, fl->n, fl->s);
+			fl->names[fl->n++] = fname;
 		}
 		else if (filetype == DT_DIR)
 		{
-			if (strcmp(de->d_name, ".") == 0
-				|| strcmp(de->d_name, "..") == 0)
+			// Ignored directories are pruned without being
+			// opened.
+			if (fl->ignore != NULL && ignore_match(fl->ignore,
+				prefix, de->d_name, 1))
 			{
 				continue;
 			}
@@ -98,13 +119,19 @@ static void add_dir(const char *dirname, const char *prefix)
 				+ namlen + 1);
 			sprintf(newdirname, "%s/%s", dirname, de->d_name);
 
-			add_dir(newdirname, newprefix);
+			ret = add_dir(fl, newdirname, newprefix);
 			free(newprefix);
 			free(newdirname);
+			if (ret == -1)
+			{
+				closedir(dh);
+				return -1;
+			}
 		}
 		else
 		{
-			warnx("\rskipping non-regular file %s%s%s (type %d)",
+			diag_warnx(fl->diag,
+				"skipping non-regular file %s%s%s (type %d)",
 				dirname,
 				strlen(dirname) == 0 ? "" : "/",
 				de->d_name,
@@ -113,7 +140,8 @@ static void add_dir(const char *dirname, const char *prefix)
 	}
 
 	if (closedir(dh) == -1)
-		err(1, "cannot close directory %s", dirname);
+		return diag_err(fl->diag, "cannot close directory %s", dirname);
+	return 0;
 }
 
 int mystrcmp(const void *one, const void *two)
@@ -167,32 +195,35 @@ int extstrcmp(const void *one, const void *two)
 	return strcmp(s1, s2);
 }
 
-void getfilelist(const char ***files, int *numfiles, const char *dirname,
-	int sort_by_ext,
-	const char **ignore_patterns, int num_ignore_patterns)
+int getfilelist(struct filelist *fl, const char *dirname, int sort_by_ext,
+	const struct ignore *ig, struct diag *d)
 {
-	assert(fnams == NULL);
-	assert(nfnams == 0);
-	assert(sfnams == 0);
-
-	ignores = ignore_patterns;
-	num_ignores = num_ignore_patterns;
+	fl->names = NULL;
+	fl->n = fl->s = 0;
+	fl->ignore = ig;
+	fl->ndirs = fl->nentries = fl->nstats = 0;
+	fl->diag = d;
 
-	add_dir(dirname, "");
-
-	qsort(fnams, nfnams, sizeof fnams[0],
-		sort_by_ext ? extstrcmp : mystrcmp);
+	if (add_dir(fl, dirname, "") == -1)
+	{
+		freefilelist(fl);
+		return -1;
+	}
 
-	*files = (const char **)fnams;
-	*numfiles = nfnams;
+	if (fl->n > 0)
+	{
+		qsort(fl->names, fl->n, sizeof fl->names[0],
+			sort_by_ext ? extstrcmp : mystrcmp);
+	}
+	return 0;
 }
 
-void freefilelist(void)
+void freefilelist(struct filelist *fl)
 {
 	int ix;
-	for (ix = 0; ix < nfnams; ix++)
-		free(fnams[ix]);
-	free(fnams);
-	nfnams = sfnams = 0;
-	fnams = NULL;
+	for (ix = 0; ix < fl->n; ix++)
+		free(fl->names[ix]);
+	free(fl->names);
+	fl->n = fl->s = 0;
+	fl->names = NULL;
 }
@@ -1,4 +1,28 @@
-void getfilelist(const char ***files, int *numfiles, const char *dirname,
-	int sort_by_ext,
-	const char **ignore_patterns, int num_ignore_patterns);
-void freefilelist(void);
+struct diag;
+struct ignore;
+
+// The files under a directory, as paths relative to it, sorted.
+struct filelist
+{
+	char **names;
+	int n, s;
+
+	const struct ignore *ignore;	// or NULL
+
+	// What it took to find them.
+	long long ndirs;	// directories read
+	long long nentries;	// directory entries looked at
+	long long nstats;	// stat() calls, for entries of unknown type
+
+	struct diag *diag;
+};
+
+// Entries matching ig are left out, and ignored directories aren't read.
+int getfilelist(struct filelist *fl, const char *dirname, int sort_by_ext,
+	const struct ignore *ig, struct diag *d);
+void freefilelist(struct filelist *fl);
+
+// The orders getfilelist() sorts names in, as qsort() comparisons of
+// char *s: by name, or with sort_by_ext, by extension first.
+int mystrcmp(const void *one, const void *two);
+int extstrcmp(const void *one, const void *two);
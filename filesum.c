@@ -0,0 +1,33 @@
+#include "filesum.h"
+#include "torrent.h"
+
+void fsum_init(struct filesum *fs, int algos)
+{
+	fs->algos = algos;
+	if (algos & TORRENT_SHA1)
+		SHA1Init(&fs->sha1);
+	if (algos & TORRENT_MD5)
+		md5_init(&fs->md5);
+	if (algos & TORRENT_SHA256)
+		sha256_init(&fs->sha256);
+}
+
+void fsum_update(struct filesum *fs, const unsigned char *buf, int len)
+{
+	if (fs->algos & TORRENT_SHA1)
+		SHA1Update(&fs->sha1, buf, len);
+	if (fs->algos & TORRENT_MD5)
+		md5_update(&fs->md5, buf, len);
+	if (fs->algos & TORRENT_SHA256)
+		sha256_update(&fs->sha256, buf, len);
+}
+
+void fsum_final(struct filesum *fs, unsigned char *out)
+{
+	if (fs->algos & TORRENT_SHA1)
+		SHA1Final(out + FILESUM_SHA1, &fs->sha1);
+	if (fs->algos & TORRENT_MD5)
+		md5_final(out + FILESUM_MD5, &fs->md5);
+	if (fs->algos & TORRENT_SHA256)
+		sha256_final(out + FILESUM_SHA256, &fs->sha256);
+}
@@ -0,0 +1,27 @@
+// Per-file checksums, computed from the same buffers as the piece hashes
+// so that no file has to be read a second time.
+
+#include "sha1lib.h"
+#include "md5.h"
+#include "sha256.h"
+
+// Where each digest goes in the FILESUM_LEN bytes fsum_final() stores.
+#define FILESUM_SHA1 0
+#define FILESUM_MD5 (FILESUM_SHA1 + SHA1_DIGEST_LENGTH)
+#define FILESUM_SHA256 (FILESUM_MD5 + MD5_DIGEST_LENGTH)
+#define FILESUM_LEN (FILESUM_SHA256 + SHA256_DIGEST_LENGTH)
+
+struct filesum
+{
+	int algos;		// TORRENT_SHA1 etc.
+	SHA1_CTX sha1;
+	struct md5_ctx md5;
+	struct sha256_ctx sha256;
+};
+
+void fsum_init(struct filesum *fs, int algos);
+void fsum_update(struct filesum *fs, const unsigned char *buf, int len);
+
+// Store the digests at their offsets in out; ones not asked for are left
+// alone.
+void fsum_final(struct filesum *fs, unsigned char *out);
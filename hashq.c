@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "xm.h"
+#include "sha1lib.h"
+#include "timing.h"
+#include "numa.h"
+#include "hashq.h"
+
+struct job
+{
+	const unsigned char *buf;
+	int len;
+	unsigned char *digest;
+	hq_done_fn done;
+	void *arg;
+};
+
+// Ring buffer of queued jobs, only limit of which are used, so the queue
+// stays as deep as the active threads need.
+struct ring
+{
+	struct job *jobs;
+	int maxjobs, limit;
+	int head, njobs;
+};
+
+struct hashq
+{
+	int nthreads;
+	pthread_t *threads;
+	int active;		// threads taking jobs, the rest waiting
+
+	// A ring for each NUMA node, filled by readers running there and
+	// emptied by the threads kept there, thread ix being on node ix
+	// modulo nrings, so pieces are hashed where they were read. Threads
+	// with nothing queued on their own node take jobs from the others.
+	const struct numa *numa;
+	struct ring *rings;
+	int nrings;
+	int njobs;		// in all the rings
+
+	pthread_mutex_t lock;
+	pthread_cond_t *nonempty;	// for each node, when a job is queued
+	int *idle;			// active threads waiting on each
+	pthread_cond_t nonfull;		// signalled when a job is taken
+	pthread_cond_t held;		// ... when threads are let go
+
+	int quit;
+};
+
+static void run_job(const struct job *j)
+{
+	double start;
+
+	start = thread_cpu_time();
+	SHA1Data(j->digest, j->buf, j->len);
+	if (j->done != NULL)
+	{
+		j->done(j->arg, (unsigned char *)j->buf, j->digest,
+			thread_cpu_time() - start);
+	}
+}
+
+// Each thread's place among the others, so those past hq->active know to
+// wait.
+struct hasher_arg
+{
+	struct hashq *hq;
+	int ix;
+};
+
+// How many of n threads, spread over the nodes in turn, are on node.
+static int on_node(const struct hashq *hq, int n, int node)
+{
+	return (n + hq->nrings - 1 - node) / hq->nrings;
+}
+
+// Size each ring for the active threads on its node.
+static void set_limits(struct hashq *hq)
+{
+	int ix;
+
+	for (ix = 0; ix < hq->nrings; ix++)
+		hq->rings[ix].limit = 2 * on_node(hq, hq->active, ix) + 1;
+}
+
+// Take the next job from node's ring, or with none there, from the ring
+// with the most.
+static struct job take_job(struct hashq *hq, int node)
+{
+	struct ring *r = &hq->rings[node];
+	struct job j;
+	int ix;
+
+	for (ix = 0; r->njobs == 0 && ix < hq->nrings; ix++)
+	{
+		if (hq->rings[ix].njobs > r->njobs)
+			r = &hq->rings[ix];
+	}
+	j = r->jobs[r->head];
+	r->head = (r->head + 1) % r->maxjobs;
+	r->njobs--;
+	hq->njobs--;
+	return j;
+}
+
+static void *hasher(void *arg)
+{
+	struct hasher_arg *ha = arg;
+	struct hashq *hq = ha->hq;
+	int node = ha->ix % hq->nrings;
+	struct job j;
+
+	numa_bind_thread(hq->numa, node);
+	pthread_mutex_lock(&hq->lock);
+	for (;;)
+	{
+		if (ha->ix >= hq->active && !hq->quit)
+		{
+			pthread_cond_wait(&hq->held, &hq->lock);
+			continue;
+		}
+		if (hq->njobs == 0 && !hq->quit)
+		{
+			hq->idle[node]++;
+			pthread_cond_wait(&hq->nonempty[node], &hq->lock);
+			hq->idle[node]--;
+			continue;
+		}
+		if (hq->njobs == 0)
+			break;
+
+		j = take_job(hq, node);
+		// With several rings, the reader waiting for room may not be
+		// the one a signal would wake.
+		if (hq->nrings > 1)
+			pthread_cond_broadcast(&hq->nonfull);
+		else
+			pthread_cond_signal(&hq->nonfull);
+		pthread_mutex_unlock(&hq->lock);
+
+		run_job(&j);
+
+		pthread_mutex_lock(&hq->lock);
+	}
+	pthread_mutex_unlock(&hq->lock);
+
+	free(ha);
+	return NULL;
+}
+
+struct hashq *hq_new(int nthreads, const struct numa *nu)
+{
+	struct hashq *hq;
+	struct hasher_arg *ha;
+	struct ring *r;
+	int ix;
+	int ret;
+
+	hq = xm(sizeof *hq, 1);
+	hq->nthreads = hq->active = nthreads;
+	hq->threads = NULL;
+	hq->numa = nu;
+	hq->nrings = numa_nodes(nu);
+	hq->rings = xm(sizeof hq->rings[0], hq->nrings);
+	hq->nonempty = xm(sizeof hq->nonempty[0], hq->nrings);
+	hq->idle = xm(sizeof hq->idle[0], hq->nrings);
+	for (ix = 0; ix < hq->nrings; ix++)
+	{
+		r = &hq->rings[ix];
+		r->maxjobs = 2 * on_node(hq, nthreads, ix) + 1;
+		r->jobs = xm(sizeof r->jobs[0], r->maxjobs);
+		r->head = r->njobs = 0;
+		pthread_cond_init(&hq->nonempty[ix], NULL);
+		hq->idle[ix] = 0;
+	}
+	set_limits(hq);
+	hq->njobs = hq->quit = 0;
+
+	pthread_mutex_init(&hq->lock, NULL);
+	pthread_cond_init(&hq->nonfull, NULL);
+	pthread_cond_init(&hq->held, NULL);
+
+	if (nthreads > 0)
+	{
+		hq->threads = xm(sizeof hq->threads[0], nthreads);
+		for (ix = 0; ix < nthreads; ix++)
+		{
+			ha = xm(sizeof *ha, 1);
+			ha->hq = hq;
+			ha->ix = ix;
+			ret = pthread_create(&hq->threads[ix], NULL, hasher,
+				ha);
+			if (ret != 0)
+			{
+				free(ha);
+				// Shut down just the threads that did start.
+				hq->nthreads = ix;
+				hq_free(hq);
+				return NULL;
+			}
+		}
+	}
+
+	return hq;
+}
+
+static void wake_all(struct hashq *hq)
+{
+	int ix;
+
+	for (ix = 0; ix < hq->nrings; ix++)
+		pthread_cond_broadcast(&hq->nonempty[ix]);
+	pthread_cond_broadcast(&hq->held);
+	pthread_cond_broadcast(&hq->nonfull);
+}
+
+void hq_free(struct hashq *hq)
+{
+	int ix;
+
+	pthread_mutex_lock(&hq->lock);
+	hq->quit = 1;
+	wake_all(hq);
+	pthread_mutex_unlock(&hq->lock);
+
+	for (ix = 0; ix < hq->nthreads; ix++)
+		pthread_join(hq->threads[ix], NULL);
+
+	pthread_mutex_destroy(&hq->lock);
+	for (ix = 0; ix < hq->nrings; ix++)
+	{
+		pthread_cond_destroy(&hq->nonempty[ix]);
+		free(hq->rings[ix].jobs);
+	}
+	pthread_cond_destroy(&hq->nonfull);
+	pthread_cond_destroy(&hq->held);
+	free(hq->threads);
+	free(hq->rings);
+	free(hq->nonempty);
+	free(hq->idle);
+	free(hq);
+}
+
+int hq_threads(const struct hashq *hq)
+{
+	return hq->nthreads;
+}
+
+void hq_set_active(struct hashq *hq, int n)
+{
+	if (hq->nthreads == 0)
+		return;
+	if (n < 1)
+		n = 1;
+	if (n > hq->nthreads)
+		n = hq->nthreads;
+
+	pthread_mutex_lock(&hq->lock);
+	hq->active = n;
+	set_limits(hq);
+	wake_all(hq);
+	pthread_mutex_unlock(&hq->lock);
+}
+
+int hq_active(struct hashq *hq)
+{
+	int n;
+
+	pthread_mutex_lock(&hq->lock);
+	n = hq->active;
+	pthread_mutex_unlock(&hq->lock);
+	return n;
+}
+
+int hq_depth(struct hashq *hq)
+{
+	int n = 0;
+	int ix;
+
+	pthread_mutex_lock(&hq->lock);
+	for (ix = 0; ix < hq->nrings && hq->nthreads > 0; ix++)
+		n += hq->rings[ix].limit;
+	pthread_mutex_unlock(&hq->lock);
+	return n;
+}
+
+int hq_submit(struct hashq *hq, const unsigned char *buf, int len,
+	unsigned char *digest, hq_done_fn done, void *arg, double *stall)
+{
+	struct ring *r;
+	struct job j;
+	double start;
+	int depth;
+	int node;
+	int ix;
+
+	j.buf = buf;
+	j.len = len;
+	j.digest = digest;
+	j.done = done;
+	j.arg = arg;
+
+	if (hq->nthreads == 0)
+	{
+		run_job(&j);
+		return 0;
+	}
+
+	node = numa_current(hq->numa);
+	r = &hq->rings[node];
+	pthread_mutex_lock(&hq->lock);
+	if (r->njobs >= r->limit)
+	{
+		// Only look at the clock when there's a wait to time.
+		start = wall_time();
+		while (r->njobs >= r->limit)
+			pthread_cond_wait(&hq->nonfull, &hq->lock);
+		if (stall != NULL)
+			*stall += wall_time() - start;
+	}
+	r->jobs[(r->head + r->njobs) % r->maxjobs] = j;
+	r->njobs++;
+	depth = ++hq->njobs;
+
+	// Wake a thread on this node if one is waiting, or else one
+	// elsewhere.
+	for (ix = 0; hq->idle[node] == 0 && ix < hq->nrings; ix++)
+	{
+		if (hq->idle[ix] > 0)
+			node = ix;
+	}
+	pthread_cond_signal(&hq->nonempty[node]);
+	pthread_mutex_unlock(&hq->lock);
+	return depth;
+}
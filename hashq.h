@@ -0,0 +1,37 @@
+// The hashing stage: a pool of threads computing SHA-1 digests of
+// completed pieces, fed by however many readers there are.
+
+struct hashq;
+struct numa;
+
+// Called from a hashing thread once a piece's digest has been stored,
+// with the CPU time hashing it took.
+typedef void (*hq_done_fn)(void *arg, unsigned char *buf,
+	unsigned char *digest, double cpu);
+
+// With nthreads == 0, hq_submit() hashes in the calling thread. Given a
+// NUMA layout, the threads are spread over its nodes, and each piece is
+// hashed on the node it was queued from where possible. Returns NULL if
+// the threads can't be created.
+struct hashq *hq_new(int nthreads, const struct numa *nu);
+void hq_free(struct hashq *hq);
+
+int hq_threads(const struct hashq *hq);
+
+// Let only n of the threads take jobs, the rest waiting until let go
+// again, with the queue as deep as n threads need. All of them are active
+// to begin with.
+void hq_set_active(struct hashq *hq, int n);
+int hq_active(struct hashq *hq);
+
+// How many jobs may be queued before hq_submit() blocks, or 0 without
+// threads.
+int hq_depth(struct hashq *hq);
+
+// Queue len bytes at buf to be hashed into digest. Blocks while the queue
+// is full, so readers can't get too far ahead of the hashers; if stall
+// isn't NULL, the time spent blocked is added to it. Returns how many
+// jobs were queued once this one was, or 0 if it was hashed right away.
+int hq_submit(struct hashq *hq, const unsigned char *buf, int len,
+	unsigned char *digest, hq_done_fn done, void *arg, double *stall);
+
@@ -0,0 +1,974 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include "xm.h"
+#include "diag.h"
+#include "ignore.h"
+#include "filelist.h"
+#include "source.h"
+#include "http.h"
+
+#define HTTP_PREFIX "http://"
+
+// Give up on a server that hasn't answered for this long.
+#define TIMEOUT_SECS 60
+
+// Room for a line of a response's headers, and for reading ahead.
+#define LINE_LEN 8192
+#define BUF_LEN 16384
+
+// The biggest object listing that will be read.
+#define MAX_LISTING (64 * 1024 * 1024)
+
+struct site
+{
+	char *host;
+	char *port;
+};
+
+struct conn
+{
+	const struct site *site;
+	int fd;			// -1 when not connected
+	unsigned char buf[BUF_LEN];
+	int pos, len;		// what's read ahead in buf
+};
+
+struct response
+{
+	int status;
+	int close;		// the server closes the connection after
+	int chunked;
+	long long length;	// of the body, or -1 if not given
+	long long mtime;	// from Last-Modified, or -1
+	long long range_start;	// where Content-Range starts, or -1
+
+	// Reading the body: what's left of it, or of the current chunk,
+	// and whether it's all been read.
+	long long left;
+	int chunks;
+	int done;
+};
+
+static char *copy(const char *s, const char *end)
+{
+	char *out;
+
+	out = xm(1, end - s + 1);
+	memcpy(out, s, end - s);
+	out[end - s] = '\0';
+	return out;
+}
+
+// Split an http:// URL into where the server is and the path to ask it
+// for.
+static int parse_url(const char *url, struct site *site, char **path,
+	struct diag *d)
+{
+	const char *host, *hostend, *port, *end;
+
+	if (strncmp(url, HTTP_PREFIX, strlen(HTTP_PREFIX)) != 0)
+		return diag_errx(d, "%s isn't an http:// URL", url);
+	host = url + strlen(HTTP_PREFIX);
+	end = strchr(host, '/');
+	if (end == NULL)
+		end = host + strlen(host);
+
+	// An IPv6 address is in brackets, to set it apart from the port.
+	if (*host == '[')
+	{
+		hostend = memchr(host, ']', end - host);
+		if (hostend == NULL || (hostend + 1 < end && hostend[1] != ':'))
+			return diag_errx(d, "bad address in %s", url);
+		host++;
+		port = hostend + 1 < end ? hostend + 2 : NULL;
+	}
+	else
+	{
+		hostend = memchr(host, ':', end - host);
+		port = hostend != NULL ? hostend + 1 : NULL;
+		if (hostend == NULL)
+			hostend = end;
+	}
+	if (hostend == host || port == end)
+		return diag_errx(d, "no server in %s", url);
+
+	site->host = copy(host, hostend);
+	site->port = port != NULL ? copy(port, end) : xsd("80");
+	*path = xsd(*end != '\0' ? end : "/");
+	return 0;
+}
+
+static void free_site(struct site *site)
+{
+	free(site->host);
+	free(site->port);
+}
+
+static void conn_init(struct conn *c, const struct site *site)
+{
+	c->site = site;
+	c->fd = -1;
+	c->pos = c->len = 0;
+}
+
+static void conn_close(struct conn *c)
+{
+	if (c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+	c->pos = c->len = 0;
+}
+
+static int conn_connect(struct conn *c, struct diag *d)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	int one = 1;
+	int ret;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(c->site->host, c->site->port, &hints, &res);
+	if (ret != 0)
+	{
+		return diag_errx(d, "cannot find %s: %s", c->site->host,
+			gai_strerror(ret));
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		c->fd = socket(ai->ai_family, ai->ai_socktype,
+			ai->ai_protocol);
+		if (c->fd == -1)
+			continue;
+		if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(c->fd);
+		c->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (c->fd == -1)
+	{
+		return diag_err(d, "cannot connect to %s:%s", c->site->host,
+			c->site->port);
+	}
+
+	tv.tv_sec = TIMEOUT_SECS;
+	tv.tv_usec = 0;
+	setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	c->pos = c->len = 0;
+	return 0;
+}
+
+static int send_all(struct conn *c, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = send(c->fd, buf, len, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+// Read up to len bytes, from what's read ahead first. Returns 0 at the end
+// of the connection.
+static int read_some(struct conn *c, unsigned char *buf, int len)
+{
+	ssize_t ret;
+
+	if (c->pos < c->len)
+	{
+		if (len > c->len - c->pos)
+			len = c->len - c->pos;
+		memcpy(buf, c->buf + c->pos, len);
+		c->pos += len;
+		return len;
+	}
+	do
+		ret = recv(c->fd, buf, len, 0);
+	while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+// Read a line, without its CRLF. Returns -1 at the end of the connection
+// or if the line is too long.
+static int read_line(struct conn *c, char *line)
+{
+	int n = 0;
+	ssize_t ret;
+
+	for (;;)
+	{
+		if (c->pos == c->len)
+		{
+			do
+				ret = recv(c->fd, c->buf, BUF_LEN, 0);
+			while (ret == -1 && errno == EINTR);
+			if (ret <= 0)
+				return -1;
+			c->pos = 0;
+			c->len = ret;
+		}
+		if (c->buf[c->pos] == '\n')
+		{
+			c->pos++;
+			break;
+		}
+		if (n == LINE_LEN - 1)
+			return -1;
+		line[n++] = c->buf[c->pos++];
+	}
+	if (n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+	return 0;
+}
+
+// Parse a date in the form HTTP uses, as in "Sun, 06 Nov 1994 08:49:37
+// GMT", or the ISO 8601 form of S3's listings, "1994-11-06T08:49:37.000Z".
+static long long parse_date(const char *s)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm tm;
+	char mon[4];
+	const char *m;
+
+	memset(&tm, 0, sizeof tm);
+	if (sscanf(s, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6)
+	{
+		tm.tm_mon--;
+	}
+	else if (sscanf(s, "%*3s, %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+		&tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6
+		&& (m = strstr(months, mon)) != NULL && (m - months) % 3 == 0)
+	{
+		tm.tm_mon = (m - months) / 3;
+	}
+	else
+		return -1;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+// Send a request and read the response's status and headers. Returns -1
+// if the connection failed, which may just mean the server closed it
+// while it was idle, or -2 for a response that doesn't make sense.
+static int exchange(struct conn *c, const char *req, struct response *r)
+{
+	char line[LINE_LEN];
+	char *value;
+	int minor;
+
+	if (send_all(c, req, strlen(req)) == -1 || read_line(c, line) == -1)
+		return -1;
+	if (sscanf(line, "HTTP/1.%d %d", &minor, &r->status) != 2)
+		return -2;
+
+	r->close = minor == 0;
+	r->chunked = 0;
+	r->length = -1;
+	r->mtime = -1;
+	r->range_start = -1;
+	for (;;)
+	{
+		if (read_line(c, line) == -1)
+			return -2;
+		if (line[0] == '\0')
+			break;
+		value = strchr(line, ':');
+		if (value == NULL)
+			continue;
+		*value++ = '\0';
+		while (*value == ' ' || *value == '\t')
+			value++;
+
+		if (strcasecmp(line, "Content-Length") == 0)
+			r->length = strtoll(value, NULL, 10);
+		else if (strcasecmp(line, "Transfer-Encoding") == 0)
+			r->chunked = strstr(value, "chunked") != NULL;
+		else if (strcasecmp(line, "Connection") == 0)
+		{
+			if (strcasecmp(value, "close") == 0)
+				r->close = 1;
+			else if (strcasecmp(value, "keep-alive") == 0)
+				r->close = 0;
+		}
+		else if (strcasecmp(line, "Last-Modified") == 0)
+			r->mtime = parse_date(value);
+		else if (strcasecmp(line, "Content-Range") == 0
+			&& strncasecmp(value, "bytes ", 6) == 0
+			&& isdigit((unsigned char)value[6]))
+		{
+			r->range_start = strtoll(value + 6, NULL, 10);
+		}
+	}
+
+	r->left = r->chunked ? 0 : r->length;
+	r->chunks = 0;
+	r->done = 0;
+	return 0;
+}
+
+// Ask for path, or len bytes of it from offset if len isn't 0, and read
+// the response's headers. A connection that has been used before gets a
+// second try, in case the server has given up on it in the meantime.
+static int request(struct conn *c, const char *method, const char *path,
+	long long offset, long long len, struct response *r, struct diag *d)
+{
+	const char *host = c->site->host;
+	int ipv6 = strchr(host, ':') != NULL;
+	int port = strcmp(c->site->port, "80") != 0;
+	char *req;
+	size_t size;
+	int reused;
+	int ret = -1;
+	int tries;
+
+	// An IPv6 address goes back in the brackets parse_url() took off.
+	size = strlen(method) + strlen(path) + strlen(host) + 256;
+	req = xm(1, size);
+	snprintf(req, size, "%s %s HTTP/1.1\r\nHost: %s%s%s%s%s\r\n",
+		method, path, ipv6 ? "[" : "", host, ipv6 ? "]" : "",
+		port ? ":" : "", port ? c->site->port : "");
+	if (len > 0)
+	{
+		snprintf(req + strlen(req), size - strlen(req),
+			"Range: bytes=%lld-%lld\r\n", offset, offset + len - 1);
+	}
+	strcat(req, "\r\n");
+
+	for (tries = 0; tries < 2; tries++)
+	{
+		reused = c->fd != -1;
+		if (!reused && conn_connect(c, d) == -1)
+			break;
+		ret = exchange(c, req, r);
+		if (ret == 0)
+			break;
+		conn_close(c);
+		if (ret == -1 && reused)
+			continue;
+		if (ret == -1)
+		{
+			diag_err(d, "no answer from %s:%s", c->site->host,
+				c->site->port);
+		}
+		else
+		{
+			diag_errx(d, "bad response from %s:%s", c->site->host,
+				c->site->port);
+		}
+		break;
+	}
+	free(req);
+	return ret == 0 ? 0 : -1;
+}
+
+// Read up to len bytes of the body, returning how many, with r->done set
+// once it's all been read.
+static long long read_body(struct conn *c, struct response *r,
+	unsigned char *buf, long long len)
+{
+	char line[LINE_LEN];
+	long long got = 0;
+	long long n;
+	int ret;
+
+	while (got < len && !r->done)
+	{
+		if (r->chunked && r->left == 0)
+		{
+			// The CRLF after the last chunk, then the size of
+			// this one; after the last, any trailers.
+			if (r->chunks++ > 0 && read_line(c, line) == -1)
+				return -1;
+			if (read_line(c, line) == -1)
+				return -1;
+			r->left = strtoll(line, NULL, 16);
+			if (r->left < 0)
+				return -1;
+			if (r->left == 0)
+			{
+				do
+				{
+					if (read_line(c, line) == -1)
+						return -1;
+				} while (line[0] != '\0');
+				r->done = 1;
+				break;
+			}
+		}
+		if (r->left == 0)
+		{
+			r->done = 1;
+			break;
+		}
+
+		// Without a length, the body runs until the connection
+		// closes.
+		n = len - got;
+		if (r->left > 0 && n > r->left)
+			n = r->left;
+		if (n > BUF_LEN * 64)
+			n = BUF_LEN * 64;
+		ret = read_some(c, buf + got, n);
+		if (ret == 0 && r->left == -1)
+		{
+			r->done = 1;
+			break;
+		}
+		if (ret <= 0)
+			return -1;
+		got += ret;
+		if (r->left > 0)
+			r->left -= ret;
+	}
+	if (!r->chunked && r->left == 0)
+		r->done = 1;
+	return got;
+}
+
+// Read a whole body into memory, NUL-terminated.
+static char *read_all(struct conn *c, struct response *r, struct diag *d)
+{
+	char *buf = NULL;
+	long long len = 0, size = 0;
+	long long ret;
+
+	while (!r->done)
+	{
+		if (size - len < BUF_LEN)
+		{
+			size = size == 0 ? BUF_LEN * 4 : size * 2;
+			if (size > MAX_LISTING)
+			{
+				free(buf);
+				diag_errx(d, "response from %s too big",
+					c->site->host);
+				return NULL;
+			}
+			buf = xr(buf, 1, size + 1);
+		}
+		ret = read_body(c, r, (unsigned char *)buf + len, size - len);
+		if (ret == -1)
+		{
+			free(buf);
+			diag_err(d, "error reading from %s", c->site->host);
+			return NULL;
+		}
+		len += ret;
+	}
+	if (buf == NULL)
+		buf = xm(1, 1);
+	buf[len] = '\0';
+	if (r->close)
+		conn_close(c);
+	return buf;
+}
+
+// Percent-encode s for a URL path, leaving slashes as they are.
+static char *encode(const char *s, int keep_slash)
+{
+	static const char hexdigits[] = "0123456789ABCDEF";
+	char *out, *p;
+
+	out = p = xm(3, strlen(s) + 1);
+	for (; *s != '\0'; s++)
+	{
+		if (isalnum((unsigned char)*s) || strchr("-_.~", *s) != NULL
+			|| (keep_slash && *s == '/'))
+		{
+			*p++ = *s;
+		}
+		else
+		{
+			*p++ = '%';
+			*p++ = hexdigits[(unsigned char)*s >> 4];
+			*p++ = hexdigits[(unsigned char)*s & 15];
+		}
+	}
+	*p = '\0';
+	return out;
+}
+
+// Undo percent-encoding, in place.
+static void decode(char *s)
+{
+	char *out = s;
+	unsigned int c;
+
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '%' && isxdigit((unsigned char)s[1])
+			&& isxdigit((unsigned char)s[2])
+			&& sscanf(s + 1, "%2x", &c) == 1)
+		{
+			*out++ = c;
+			s += 2;
+		}
+		else
+			*out++ = *s;
+	}
+	*out = '\0';
+}
+
+// Find the text of the first <name> element between p and end, with XML
+// entities replaced, or NULL if there isn't one.
+static char *element(const char *p, const char *end, const char *name)
+{
+	static const char *const entities[] =
+	{
+		"&amp;", "&lt;", "&gt;", "&quot;", "&apos;"
+	};
+	static const char chars[] = "&<>\"'";
+	char open[64], close[64];
+	const char *s, *e;
+	char *text, *out;
+	unsigned int c;
+	int n;
+	int ix;
+
+	snprintf(open, sizeof open, "<%s>", name);
+	snprintf(close, sizeof close, "</%s>", name);
+	s = strstr(p, open);
+	if (s == NULL || s >= end)
+		return NULL;
+	s += strlen(open);
+	e = strstr(s, close);
+	if (e == NULL || e > end)
+		return NULL;
+
+	text = out = xm(1, e - s + 1);
+	while (s < e)
+	{
+		if (*s != '&')
+		{
+			*out++ = *s++;
+			continue;
+		}
+		for (ix = 0; ix < 5; ix++)
+		{
+			n = strlen(entities[ix]);
+			if (strncmp(s, entities[ix], n) == 0)
+				break;
+		}
+		if (ix < 5)
+			*out++ = chars[ix];
+		else if ((sscanf(s, "&#x%x;%n", &c, &n) == 1
+			|| sscanf(s, "&#%u;%n", &c, &n) == 1) && c > 0
+			&& c < 128)
+		{
+			*out++ = c;
+		}
+		else
+		{
+			*out++ = *s++;
+			continue;
+		}
+		s += n;
+	}
+	*out = '\0';
+	return text;
+}
+
+// Would name do as a path within a torrent?
+static int good_name(const char *name)
+{
+	const char *p, *end;
+
+	for (p = name; ; p = end + 1)
+	{
+		end = strchr(p, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		if (end == p || (end - p == 1 && p[0] == '.')
+			|| (end - p == 2 && p[0] == '.' && p[1] == '.'))
+		{
+			return 0;
+		}
+		if (*end == '\0')
+			return 1;
+	}
+}
+
+static void add_object(struct httplist *hl, const struct ignore *ig,
+	const char *name, const char *path, long long length,
+	long long mtime)
+{
+	struct http_object *o;
+
+	if (!good_name(name))
+	{
+		diag_warnx(hl->diag, "skipping %s, which can't be a file name",
+			path);
+		return;
+	}
+	if (ig != NULL && ignore_path(ig, name))
+		return;
+
+	XPND(hl->objects, hl->n, hl->s);
+	o = &hl->objects[hl->n++];
+	o->name = xsd(name);
+	o->path = xsd(path);
+	o->length = length;
+	o->mtime = mtime;
+}
+
+// Look up a single object.
+static int head_object(struct httplist *hl, struct conn *c,
+	const char *path, struct diag *d)
+{
+	struct response r;
+	char *name;
+
+	hl->nrequests++;
+	if (request(c, "HEAD", path, 0, 0, &r, d) == -1)
+		return -1;
+	if (r.close)
+		conn_close(c);
+	if (r.status != 200)
+		return diag_errx(d, "cannot find %s: HTTP %d", path, r.status);
+	if (r.length < 0)
+		return diag_errx(d, "%s has no length", path);
+
+	name = xsd(strrchr(path, '/') + 1);
+	decode(name);
+	add_object(hl, NULL, name, path, r.length, r.mtime);
+	free(name);
+	return hl->n > 0 ? 0 : -1;
+}
+
+// List everything under a prefix, a page at a time.
+static int list_objects(struct httplist *hl, struct conn *c,
+	const char *bucket, const char *prefix, const struct ignore *ig,
+	struct diag *d)
+{
+	struct response r;
+	char *req, *eprefix, *etoken;
+	char *body, *key, *size, *date, *token = NULL;
+	char *truncated, *code, *path, *ekey;
+	const char *p, *s, *e;
+	size_t len;
+	int ret = -1;
+
+	eprefix = encode(prefix, 0);
+	for (;;)
+	{
+		etoken = token != NULL ? encode(token, 0) : xsd("");
+		len = strlen(bucket) + strlen(eprefix) + strlen(etoken) + 64;
+		req = xm(1, len);
+		snprintf(req, len, "/%s?list-type=2&prefix=%s%s%s", bucket,
+			eprefix, token != NULL ? "&continuation-token=" : "",
+			etoken);
+		free(etoken);
+
+		hl->nrequests++;
+		body = NULL;
+		if (request(c, "GET", req, 0, 0, &r, d) == 0)
+			body = read_all(c, &r, d);
+		free(req);
+		if (body == NULL)
+			break;
+		if (r.status != 200)
+		{
+			code = element(body, body + strlen(body), "Code");
+			diag_errx(d, "cannot list %s/%s: HTTP %d%s%s%s",
+				bucket, prefix, r.status, code != NULL ? " ("
+				: "", code != NULL ? code : "",
+				code != NULL ? ")" : "");
+			free(code);
+			free(body);
+			break;
+		}
+
+		for (p = body; (s = strstr(p, "<Contents>")) != NULL
+			&& (e = strstr(s, "</Contents>")) != NULL; p = e)
+		{
+			key = element(s, e, "Key");
+			size = element(s, e, "Size");
+			date = element(s, e, "LastModified");
+
+			// Keys ending in a slash stand for directories.
+			if (key != NULL && size != NULL
+				&& strncmp(key, prefix, strlen(prefix)) == 0
+				&& key[strlen(key) - 1] != '/')
+			{
+				ekey = encode(key, 1);
+				path = xm(1, strlen(bucket) + strlen(ekey) + 3);
+				sprintf(path, "/%s/%s", bucket, ekey);
+				add_object(hl, ig, key + strlen(prefix), path,
+					strtoll(size, NULL, 10),
+					date != NULL ? parse_date(date) : -1);
+				free(path);
+				free(ekey);
+			}
+			free(key);
+			free(size);
+			free(date);
+		}
+
+		free(token);
+		token = NULL;
+		truncated = element(body, body + strlen(body), "IsTruncated");
+		if (truncated != NULL && strcmp(truncated, "true") == 0)
+		{
+			token = element(body, body + strlen(body),
+				"NextContinuationToken");
+		}
+		free(truncated);
+		free(body);
+		if (token == NULL)
+		{
+			ret = 0;
+			break;
+		}
+	}
+	free(token);
+	free(eprefix);
+	return ret;
+}
+
+static int objcmp(const struct http_object *o1, const struct http_object *o2,
+	int (*cmp)(const void *, const void *))
+{
+	return cmp(&o1->name, &o2->name);
+}
+
+static int namecmp(const void *one, const void *two)
+{
+	return objcmp(one, two, mystrcmp);
+}
+
+static int extcmp(const void *one, const void *two)
+{
+	return objcmp(one, two, extstrcmp);
+}
+
+// The last part of the prefix, without its slash, or else the bucket.
+static void top_name(struct httplist *hl, const char *bucket,
+	const char *prefix)
+{
+	const char *p, *end;
+
+	if (prefix == NULL || *prefix == '\0')
+	{
+		hl->top = xsd(bucket);
+		return;
+	}
+	end = prefix + strlen(prefix);
+	while (end > prefix && end[-1] == '/')
+		end--;
+	for (p = end; p > prefix && p[-1] != '/'; p--)
+		;
+	hl->top = p < end ? copy(p, end) : xsd(bucket);
+}
+
+int gethttplist(struct httplist *hl, const char *url, int sort_by_ext,
+	const struct ignore *ig, struct diag *d)
+{
+	struct site site;
+	struct conn c;
+	char *path, *bucket, *slash;
+	int ret;
+
+	hl->objects = NULL;
+	hl->n = hl->s = 0;
+	hl->single = 0;
+	hl->top = NULL;
+	hl->nrequests = 0;
+	hl->diag = d;
+
+	if (parse_url(url, &site, &path, d) == -1)
+		return -1;
+	conn_init(&c, &site);
+
+	// Everything after the bucket is the key, or the prefix.
+	bucket = xsd(path + 1);
+	slash = strchr(bucket, '/');
+	if (slash != NULL)
+		*slash++ = '\0';
+	if (bucket[0] == '\0')
+		ret = diag_errx(d, "no bucket in %s", url);
+	else if (slash != NULL && *slash != '\0'
+		&& slash[strlen(slash) - 1] != '/')
+	{
+		hl->single = 1;
+		ret = head_object(hl, &c, path, d);
+	}
+	else
+	{
+		if (slash != NULL)
+			decode(slash);
+		decode(bucket);
+		top_name(hl, bucket, slash);
+		ret = list_objects(hl, &c, bucket, slash != NULL ? slash : "",
+			ig, d);
+	}
+
+	conn_close(&c);
+	free(bucket);
+	free(path);
+	free_site(&site);
+	if (ret == -1)
+	{
+		freehttplist(hl);
+		return -1;
+	}
+	if (hl->n > 0)
+	{
+		qsort(hl->objects, hl->n, sizeof hl->objects[0],
+			sort_by_ext ? extcmp : namecmp);
+	}
+	return 0;
+}
+
+void freehttplist(struct httplist *hl)
+{
+	int ix;
+
+	for (ix = 0; ix < hl->n; ix++)
+	{
+		free(hl->objects[ix].name);
+		free(hl->objects[ix].path);
+	}
+	free(hl->objects);
+	free(hl->top);
+	hl->objects = NULL;
+	hl->top = NULL;
+	hl->n = hl->s = 0;
+}
+
+static void *http_open(void *arg, struct diag *d)
+{
+	struct conn *c;
+
+	(void)d;
+	c = xm(sizeof *c, 1);
+	conn_init(c, arg);
+	return c;
+}
+
+// Read part of an object with a Range request.
+static int http_read(void *handle, const char *path, long long offset,
+	unsigned char *buf, int len, struct diag *d)
+{
+	struct conn *c = handle;
+	struct response r;
+	long long got;
+
+	if (request(c, "GET", path, offset, len, &r, d) == -1)
+		return -1;
+
+	// The object ends before offset.
+	if (r.status == 416)
+	{
+		conn_close(c);
+		return 0;
+	}
+
+	// A server that ignores the range sends the whole object, which
+	// will do if that's what was asked for.
+	if (r.status == 200 && (offset != 0 || r.length < 0
+		|| r.length > len))
+	{
+		conn_close(c);
+		return diag_errx(d, "%s doesn't support range requests",
+			c->site->host);
+	}
+	if (r.status != 200 && r.status != 206)
+	{
+		conn_close(c);
+		return diag_errx(d, "cannot fetch %s: HTTP %d", path,
+			r.status);
+	}
+
+	// Data from anywhere else would be hashed into the wrong piece.
+	if (r.status == 206 && r.range_start != offset)
+	{
+		conn_close(c);
+		return diag_errx(d, "%s sent the wrong range of %s",
+			c->site->host, path);
+	}
+
+	got = read_body(c, &r, buf, len);
+	if (got != -1 && !r.done)
+	{
+		// Sending more than was asked for, perhaps.
+		unsigned char extra;
+
+		if (read_body(c, &r, &extra, 1) != 0 || !r.done)
+			got = -1;
+	}
+	if (got == -1)
+	{
+		conn_close(c);
+		return diag_errx(d, "bad response from %s for %s",
+			c->site->host, path);
+	}
+	if (r.close)
+		conn_close(c);
+	return got;
+}
+
+static void http_close(void *handle)
+{
+	conn_close(handle);
+	free(handle);
+}
+
+struct source *http_source_new(const char *url, struct diag *d)
+{
+	struct source *src;
+	struct site *site;
+	char *path, *name;
+
+	site = xm(sizeof *site, 1);
+	if (parse_url(url, site, &path, d) == -1)
+	{
+		free(site);
+		return NULL;
+	}
+	free(path);
+
+	name = xm(1, strlen(site->host) + strlen(site->port) + 2);
+	sprintf(name, "%s:%s", site->host, site->port);
+
+	src = xm(sizeof *src, 1);
+	src->arg = site;
+	src->name = name;
+	src->open = http_open;
+	src->read = http_read;
+	src->close = http_close;
+	return src;
+}
+
+void http_source_free(struct source *src)
+{
+	free_site(src->arg);
+	free(src->arg);
+	free((char *)src->name);
+	free(src);
+}
@@ -0,0 +1,49 @@
+// Reading data kept on an S3-compatible object store, over plain HTTP, so
+// it can be torrentized without copying it somewhere first.
+//
+// URLs are path-style, http://host[:port]/bucket/key. One ending in a
+// slash (or naming just the bucket) stands for every object under that
+// prefix, listed with ListObjectsV2, and named relative to it. Requests
+// aren't signed, so the objects must be readable without credentials, or
+// the server must be one that doesn't ask for them.
+
+struct diag;
+struct ignore;
+struct source;
+
+struct http_object
+{
+	// Relative to the prefix, or the last part of the key for a
+	// single object.
+	char *name;
+	char *path;		// to ask the server for
+	long long length;
+	long long mtime;
+};
+
+// The objects at a URL, in the order getfilelist() would put them in once
+// copied to disk.
+struct httplist
+{
+	struct http_object *objects;
+	int n, s;
+	int single;		// the URL is of one object, not a prefix
+	char *top;		// last part of the prefix, or the bucket
+
+	long long nrequests;	// requests made to list them
+
+	struct diag *diag;
+};
+
+// Entries matching ig are left out, along with everything in ignored
+// "directories". Keys that wouldn't make file names, such as ones with ".."
+// in them, are skipped with a warning.
+int gethttplist(struct httplist *hl, const char *url, int sort_by_ext,
+	const struct ignore *ig, struct diag *d);
+void freehttplist(struct httplist *hl);
+
+// A source for reading the objects listed from url by their paths, with a
+// connection for each handle, kept open from one request to the next.
+// Returns NULL if the URL isn't one this can read.
+struct source *http_source_new(const char *url, struct diag *d);
+void http_source_free(struct source *src);
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <string.h>
+#include "xm.h"
+#include "ignore.h"
+
+// What a pattern matching means: skip anything, or only directories.
+#define MATCH_ANY 1
+#define MATCH_DIR 2
+
+// A trie of the literal parts of "abc*" patterns, or of "*abc" patterns
+// stored backwards, with each node's children in a linked list.
+struct tnode
+{
+	unsigned char c;
+	unsigned char match;	// a pattern ends here
+	int child, next;	// node indexes, or 0 for none
+};
+
+struct trie
+{
+	struct tnode *nodes;	// the root is node 0
+	int n, s;
+};
+
+// Slot in the hash table of patterns with no wildcards.
+struct literal
+{
+	char *name;		// NULL if the slot is empty
+	int match;
+};
+
+// Any other pattern, matched the slow way.
+struct glob
+{
+	char *pat;
+	int match;
+	int path;		// matched against the whole path
+};
+
+struct ignore
+{
+	struct literal *names;
+	int nnames, snames;	// used, allocated (a power of 2)
+
+	struct trie prefixes, suffixes;
+
+	struct glob *globs;
+	int nglobs, sglobs;
+};
+
+static unsigned int hash(const char *s)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
+
+static struct literal *lookup(const struct ignore *ig, const char *name)
+{
+	unsigned int mask = ig->snames - 1;
+	unsigned int h = hash(name) & mask;
+
+	while (ig->names[h].name != NULL
+		&& strcmp(ig->names[h].name, name) != 0)
+	{
+		h = (h + 1) & mask;
+	}
+	return &ig->names[h];
+}
+
+static void add_literal(struct ignore *ig, const char *name, int match)
+{
+	struct literal *old;
+	struct literal *l;
+	int sold;
+	int ix;
+
+	if (2 * (ig->nnames + 1) > ig->snames)
+	{
+		old = ig->names;
+		sold = ig->snames;
+		ig->snames *= 2;
+		ig->names = xm(sizeof ig->names[0], ig->snames);
+		for (ix = 0; ix < ig->snames; ix++)
+			ig->names[ix].name = NULL;
+		for (ix = 0; ix < sold; ix++)
+		{
+			if (old[ix].name != NULL)
+				*lookup(ig, old[ix].name) = old[ix];
+		}
+		free(old);
+	}
+
+	l = lookup(ig, name);
+	if (l->name == NULL)
+	{
+		l->name = xsd(name);
+		l->match = 0;
+		ig->nnames++;
+	}
+	l->match |= match;
+}
+
+static void trie_init(struct trie *tr)
+{
+	tr->nodes = NULL;
+	tr->n = tr->s = 0;
+	XPND(tr->nodes, tr->n, tr->s);
+	tr->nodes[0].match = 0;
+	tr->nodes[0].child = tr->nodes[0].next = 0;
+	tr->n = 1;
+}
+
+// Add len bytes starting at s, going backwards if step is -1.
+static void trie_add(struct trie *tr, const char *s, int len, int step,
+	int match)
+{
+	int node = 0;
+	int child;
+	unsigned char c;
+
+	for (; len > 0; len--, s += step)
+	{
+		c = *s;
+		for (child = tr->nodes[node].child; child != 0;
+			child = tr->nodes[child].next)
+		{
+			if (tr->nodes[child].c == c)
+				break;
+		}
+		if (child == 0)
+		{
+			XPND(tr->nodes, tr->n, tr->s);
+			child = tr->n++;
+			tr->nodes[child].c = c;
+			tr->nodes[child].match = 0;
+			tr->nodes[child].child = 0;
+			tr->nodes[child].next = tr->nodes[node].child;
+			tr->nodes[node].child = child;
+		}
+		node = child;
+	}
+	tr->nodes[node].match |= match;
+}
+
+// Walk len bytes of s, as for trie_add(), collecting the matches of every
+// pattern that is a prefix of the walk.
+static int trie_walk(const struct trie *tr, const char *s, int len, int step)
+{
+	int node = 0;
+	int match = tr->nodes[0].match;
+	unsigned char c;
+
+	for (; len > 0 && match != (MATCH_ANY | MATCH_DIR); len--, s += step)
+	{
+		c = *s;
+		for (node = tr->nodes[node].child; node != 0;
+			node = tr->nodes[node].next)
+		{
+			if (tr->nodes[node].c == c)
+				break;
+		}
+		if (node == 0)
+			break;
+		match |= tr->nodes[node].match;
+	}
+	return match;
+}
+
+// Does the character class starting after the [ at *pp match c? Moves *pp
+// past the closing ], or returns -1 if there isn't one, in which case the
+// [ is taken literally.
+static int match_class(const char **pp, unsigned char c)
+{
+	const char *p = *pp;
+	int negate = 0;
+	int found = 0;
+	unsigned char lo, hi;
+
+	if (*p == '!' || *p == '^')
+	{
+		negate = 1;
+		p++;
+	}
+	do
+	{
+		if (*p == '\0')
+			return -1;
+		lo = hi = *p++;
+		if (*p == '-' && p[1] != ']' && p[1] != '\0')
+		{
+			hi = p[1];
+			p += 2;
+		}
+		if (lo <= c && c <= hi)
+			found = 1;
+	} while (*p != ']');
+
+	*pp = p + 1;
+	return found != negate;
+}
+
+// Does the one-character part of the pattern at *pp match c? If so, moves
+// *pp past it.
+static int match_one(const char **pp, unsigned char c, int path)
+{
+	const char *p = *pp;
+	const char *q = p + 1;
+	int ret;
+
+	if (path && c == '/' && (*p == '?' || *p == '['))
+		return 0;
+	if (*p == '?')
+		ret = 1;
+	else if (*p == '[' && (ret = match_class(&q, c)) != -1)
+	{
+		*pp = q;
+		return ret;
+	}
+	else
+	{
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		ret = (unsigned char)*p == c;
+	}
+	if (ret)
+		*pp = p + 1;
+	return ret;
+}
+
+// Match a whole string against a wildcard pattern. Only the most recent *
+// ever needs to be backtracked to, so this takes linear time for most
+// patterns rather than exponential.
+static int glob_match(const char *p, const char *s, int path)
+{
+	const char *star_p = NULL;
+	const char *star_s = NULL;
+
+	while (*s != '\0')
+	{
+		if (*p == '*')
+		{
+			star_p = ++p;
+			star_s = s;
+		}
+		else if (*p != '\0' && match_one(&p, *s, path))
+			s++;
+		else if (star_p != NULL && !(path && *star_s == '/'))
+		{
+			p = star_p;
+			s = ++star_s;
+		}
+		else
+			return 0;
+	}
+	while (*p == '*')
+		p++;
+	return *p == '\0';
+}
+
+// Is s free of wildcards, over its first len bytes?
+static int literal(const char *s, size_t len)
+{
+	size_t ix;
+
+	for (ix = 0; ix < len; ix++)
+	{
+		if (strchr("*?[\\", s[ix]) != NULL)
+			return 0;
+	}
+	return 1;
+}
+
+struct ignore *ignore_new(const char *const *patterns, int num)
+{
+	struct ignore *ig;
+	struct glob *g;
+	char *pat;
+	size_t len;
+	int match;
+	int ix;
+
+	ig = xm(sizeof *ig, 1);
+	ig->nnames = 0;
+	ig->snames = 16;
+	ig->names = xm(sizeof ig->names[0], ig->snames);
+	for (ix = 0; ix < ig->snames; ix++)
+		ig->names[ix].name = NULL;
+	trie_init(&ig->prefixes);
+	trie_init(&ig->suffixes);
+	ig->globs = NULL;
+	ig->nglobs = ig->sglobs = 0;
+
+	for (ix = 0; ix < num; ix++)
+	{
+		pat = xsd(patterns[ix]);
+		len = strlen(pat);
+		match = MATCH_ANY;
+		if (len > 1 && pat[len - 1] == '/')
+		{
+			pat[--len] = '\0';
+			match = MATCH_DIR;
+		}
+
+		if (strchr(pat, '/') == NULL && literal(pat, len))
+			add_literal(ig, pat, match);
+		else if (strchr(pat, '/') == NULL && len > 0
+			&& pat[0] == '*' && literal(pat + 1, len - 1))
+		{
+			trie_add(&ig->suffixes, pat + len - 1, len - 1, -1,
+				match);
+		}
+		else if (strchr(pat, '/') == NULL && len > 0
+			&& pat[len - 1] == '*' && literal(pat, len - 1))
+		{
+			trie_add(&ig->prefixes, pat, len - 1, 1, match);
+		}
+		else
+		{
+			XPND(ig->globs, ig->nglobs, ig->sglobs);
+			g = &ig->globs[ig->nglobs++];
+			g->path = strchr(pat, '/') != NULL;
+			g->pat = xsd(pat[0] == '/' ? pat + 1 : pat);
+			g->match = match;
+		}
+		free(pat);
+	}
+
+	return ig;
+}
+
+void ignore_free(struct ignore *ig)
+{
+	int ix;
+
+	for (ix = 0; ix < ig->snames; ix++)
+		free(ig->names[ix].name);
+	for (ix = 0; ix < ig->nglobs; ix++)
+		free(ig->globs[ix].pat);
+	free(ig->names);
+	free(ig->prefixes.nodes);
+	free(ig->suffixes.nodes);
+	free(ig->globs);
+	free(ig);
+}
+
+int ignore_match(const struct ignore *ig, const char *dir, const char *name,
+	int isdir)
+{
+	const struct literal *l;
+	char *path = NULL;
+	int wanted;
+	int match = 0;
+	int len;
+	int ix;
+
+	wanted = isdir ? MATCH_ANY | MATCH_DIR : MATCH_ANY;
+	len = strlen(name);
+
+	l = lookup(ig, name);
+	if (l->name != NULL)
+		match |= l->match;
+	match |= trie_walk(&ig->prefixes, name, len, 1);
+	match |= trie_walk(&ig->suffixes, name + len - 1, len, -1);
+
+	for (ix = 0; ix < ig->nglobs && !(match & wanted); ix++)
+	{
+		if ((ig->globs[ix].match & wanted) == 0)
+			continue;
+		if (!ig->globs[ix].path)
+		{
+			if (glob_match(ig->globs[ix].pat, name, 0))
+				match |= ig->globs[ix].match;
+			continue;
+		}
+		if (path == NULL)
+		{
+			path = xm(1, strlen(dir) + 1 + len + 1);
+			strcpy(path, dir);
+			if (dir[0] != '\0')
+				strcat(path, "/");
+			strcat(path, name);
+		}
+		if (glob_match(ig->globs[ix].pat, path, 1))
+			match |= ig->globs[ix].match;
+	}
+	free(path);
+
+	return (match & wanted) != 0;
+}
+
+int ignore_path(const struct ignore *ig, const char *name)
+{
+	char *dir, *base;
+	const char *p, *end;
+	int ret = 0;
+
+	dir = xm(1, strlen(name) + 1);
+	base = xm(1, strlen(name) + 1);
+	for (p = name; !ret; p = end + 1)
+	{
+		end = strchr(p, '/');
+		memcpy(dir, name, p == name ? 0 : p - name - 1);
+		dir[p == name ? 0 : p - name - 1] = '\0';
+		if (end == NULL)
+		{
+			ret = ignore_match(ig, dir, p, 0);
+			break;
+		}
+		memcpy(base, p, end - p);
+		base[end - p] = '\0';
+		ret = ignore_match(ig, dir, base, 0)
+			|| ignore_match(ig, dir, base, 1);
+	}
+	free(dir);
+	free(base);
+	return ret;
+}
@@ -0,0 +1,25 @@
+// Matching file names against the -i ignore patterns, compiled once up
+// front so that each directory entry costs a hash lookup and a couple of
+// trie walks however many patterns there are.
+//
+// Patterns are wildcards using *, ? and [...], matched case-sensitively.
+// A pattern without a slash is matched against the last component of each
+// name, so "*.o" or ".git" apply at any depth. One with a slash is matched
+// against the whole path from the top of the torrent, with * and ? not
+// matching a slash. A trailing slash makes a pattern apply only to
+// directories, which are skipped without being opened.
+
+struct ignore;
+
+struct ignore *ignore_new(const char *const *patterns, int num);
+void ignore_free(struct ignore *ig);
+
+// Should the entry name in directory dir (relative to the top, "" for the
+// top itself) be skipped? isdir says whether it's known to be a directory.
+int ignore_match(const struct ignore *ig, const char *dir, const char *name,
+	int isdir);
+
+// Should the file at name, a path from the top, be skipped, because it or
+// one of the directories it's in matches? For lists of files that come
+// from somewhere other than reading directories.
+int ignore_path(const struct ignore *ig, const char *name);
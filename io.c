@@ -0,0 +1,44 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include "io.h"
+
+int pread_fully(int fd, void *buf, size_t len, off_t offset)
+{
+	unsigned char *p = buf;
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = pread(fd, p, len, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			errno = EIO;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+int pwrite_fully(int fd, const void *buf, size_t len, off_t offset)
+{
+	const unsigned char *p = buf;
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = pwrite(fd, p, len, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return -1;
+		p += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
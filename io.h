@@ -0,0 +1,7 @@
+// Reading and writing all of a buffer at an offset in a file, carrying on
+// through short transfers and interrupted calls.
+
+// Return -1 with errno set on error. Reading past the end of the file
+// is an error too, with EIO.
+int pread_fully(int fd, void *buf, size_t len, off_t offset);
+int pwrite_fully(int fd, const void *buf, size_t len, off_t offset);
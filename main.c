@@ -1,25 +1,69 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <assert.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "err.h"
 #include "xm.h"
+#include "diag.h"
+#include "watch.h"
+#include "timing.h"
 #include "torrent.h"
 
-#define DEFAULT_PIECESIZE 256
-
 const struct option opts[] =
 {
+	{ "tar",		no_argument,		NULL, 'a' },
+	{ "adaptive-io",	no_argument,		NULL, 'A' },
 	{ "piece-size",		required_argument,	NULL, 'b' },
+	{ "checkpoint",		required_argument,	NULL, 'c' },
+	{ "cpu-share",		required_argument,	NULL, 'C' },
+	{ "per-device",		no_argument,		NULL, 'D' },
+	{ "edit",		no_argument,		NULL, 'e' },
 	{ "sort-by-extensions",	no_argument,		NULL, 'E' },
+	{ "fastresume",		no_argument,		NULL, 'F' },
 	{ "ignore",		required_argument,	NULL, 'i' },
+	{ "shard",		required_argument,	NULL, 'k' },
+	{ "merge",		required_argument,	NULL, 'K' },
+	{ "max-iops",		required_argument,	NULL, 'I' },
+	{ "threads",		required_argument,	NULL, 'j' },
+	{ "jobs",		required_argument,	NULL, 'J' },
+	{ "lookup",		no_argument,		NULL, 'L' },
+	{ "input-list",		required_argument,	NULL, 'l' },
+	{ "manifest",		no_argument,		NULL, 'M' },
+	{ "memory-limit",	required_argument,	NULL, 'm' },
+	{ "name",		required_argument,	NULL, 'R' },
+	{ "comment",		required_argument,	NULL, 'n' },
+	{ "connections",	required_argument,	NULL, 'N' },
 	{ "output-name",	required_argument,	NULL, 'o' },
 	{ "private",		no_argument,		NULL, 'p' },
+	{ "physical-order",	no_argument,		NULL, 'P' },
+	{ "progress-log",	no_argument,		NULL, 'g' },
+	{ "public",		no_argument,		NULL, 'u' },
+	{ "auto-tune",		no_argument,		NULL, 'U' },
 	{ "quiet",		no_argument,		NULL, 'q' },
 	{ "rename",		required_argument,	NULL, 'R' },
+	{ "resume",		no_argument,		NULL, 'r' },
+	{ "checksum",		required_argument,	NULL, 's' },
+	{ "stats",		required_argument,	NULL, 'S' },
+	{ "max-read-rate",	required_argument,	NULL, 't' },
+	{ "tee",		required_argument,	NULL, 'T' },
+	{ "verbose",		no_argument,		NULL, 'v' },
+	{ "watch",		required_argument,	NULL, 'w' },
+	{ "reuse",		no_argument,		NULL, 'x' },
+	{ "index",		required_argument,	NULL, 'X' },
+	{ "tuning-cache",	required_argument,	NULL, 'y' },
+	{ "numa",		required_argument,	NULL, 'Z' },
 	{ NULL,			0,			NULL,  0  }
 };
 
@@ -27,31 +71,87 @@ static void usage(void)
 {
 	fprintf(stderr,
 		"usage: torrentize [options] tracker_URL ... file ...\n"
+		"       torrentize [options] -R name tracker_URL ... -\n"
+		"       torrentize -X index -L digest|file ...\n"
 		"\n"
+		"-a, --tar: Torrentize what's in tar archives given as files.\n"
+		"-A, --adaptive-io: Slow down reading when the disk is busy.\n"
 		"-b, --piece-size KB: Set piece size in kilobytes.\n"
+		"-c, --checkpoint secs: Save progress this often.\n"
+		"-C, --cpu-share percent: Limit CPU use to percent of a CPU.\n"
+		"-D, --per-device: Run a reader per device.\n"
+		"-e, --edit: Change existing torrents given as files.\n"
 		"-E, --sort-by-extensions: Sort by file extensions.\n"
-
-		// not implemented:
-		// "-i, --ignore pattern: Ignore wildcard pattern.\n"
-
+		"-F, --fastresume: Write libtorrent resume data too.\n"
+		"-g, --progress-log: Print progress as lines for logs.\n"
+		"-i, --ignore pattern: Ignore wildcard pattern.\n"
+		"-I, --max-iops N: Limit reads to N a second.\n"
+		"-j, --threads N: Hash using N threads.\n"
+		"-J, --jobs N: Make up to N torrents at once.\n"
+		"-k, --shard K/N: Hash only shard K of N.\n"
+		"-K, --merge N: Make torrent from the files of N shards.\n"
+		"-l, --input-list file: Read input files from file.\n"
+		"-L, --lookup: Find pieces or files in the index (-X).\n"
+		"-M, --manifest: Write file checksums to a .sums file.\n"
+		"-m, --memory-limit MB: Limit memory used for buffers.\n"
+		"-n, --comment text: Add a comment to the torrent.\n"
+		"-N, --connections N: Read from servers over N connections.\n"
 		"-o, --output-name file: Set output filename or directory.\n"
 		"-p, --private: Mark torrent private.\n"
+		"-P, --physical-order: Read files in on-disk order.\n"
 		"-q, --quiet: Don't print progress indicator.\n"
+		"-r, --resume: Carry on from a saved checkpoint.\n"
 		"-R, --rename name: Rename file or top dir for torrent.\n"
+		"-s, --checksum sha1|md5|sha256: Add per-file checksums.\n"
+		"-S, --stats file: Write timings and counts to file as JSON.\n"
+		"-t, --max-read-rate MB: Limit reading to MB a second.\n"
+		"-T, --tee file: Copy standard input to file.\n"
+		"-u, --public: With -e, unmark torrent private.\n"
+		"-U, --auto-tune: Work out how many threads to use.\n"
+		"-v, --verbose: Print extra information.\n"
+		"-w, --watch dir: Torrentize whatever is put in dir.\n"
+		"-x, --reuse: Check files found in the index against it.\n"
+		"-X, --index file: Add torrents to an index of pieces.\n"
+		"-y, --tuning-cache file: Keep what -U finds in file.\n"
+		"-Z, --numa off|cpus/cpus...: Set NUMA nodes' CPUs.\n"
 	);
 	exit(1);
 }
 
 #define MAX_IGNORE_PATTERNS 256
 
-static int piecesize = DEFAULT_PIECESIZE;
-static int mark_private = 0;
+// How often to save checkpoints with -r but no -c.
+#define DEFAULT_CHECKPOINT_SECS 60
+
+// How long something put in the watched directory must go unchanged
+// before it's taken to be complete.
+#define WATCH_SETTLE_MS 5000
+
+static struct torrent_opts topts;
 static int quiet = 0;
-static int sort_by_ext = 0;
+static int progress_log = 0;
+static int jobs = 1;
+static char *input_list = NULL;
+static char *watch_dir = NULL;
+static char *tee_path = NULL;
+static char *stats_path = NULL;
+static int tee_fd = -1;
+static int manifest = 0;
 static char *newname = NULL;
 static char *outpath = NULL;
 static char *ignore_patterns[MAX_IGNORE_PATTERNS];
 static int num_ignore_patterns = 0;
+static double max_read_rate = 0;
+static int max_iops = 0;
+static int cpu_share = 0;
+static int adaptive_io = 0;
+static int edit = 0;
+static int auto_tune = 0;
+static char *tuning_cache = NULL;
+static char *numa_layout = NULL;
+static char *index_path = NULL;
+static int lookup = 0;
+static int private_flag = -1;
 
 static char **tracker_urls = NULL;
 static int num_tracker_urls = 0;
@@ -62,34 +162,179 @@ static void read_options(int argc, char *argv[])
 {
 	int ret;
 
-	while ((ret = getopt_long(argc, argv, "b:Ei:o:pqR:", opts, NULL))
-		!= -1)
+	while ((ret = getopt_long(argc, argv,
+		"aAb:c:C:DeEFgi:I:j:J:k:K:l:LMm:n:N:o:pPqrR:s:S:t:T:uUv"
+		"w:xX:y:Z:",
+		opts, NULL)) != -1)
 	{
-		if (ret == 'b') // set piece size in KB
+		if (ret == 'a') // inputs are tar archives
+			topts.tar = 1;
+		else if (ret == 'A') // back off when the disk is busy
+			adaptive_io = 1;
+		else if (ret == 'b') // set piece size in KB
 		{
-			piecesize = atoi(optarg);
-			if (piecesize < 1)
+			topts.piece_kb = atoi(optarg);
+			if (topts.piece_kb < 1)
 			{
 				errx(1, "impossible piece size: %d KB\n",
-					piecesize);
+					topts.piece_kb);
 			}
 		}
+		else if (ret == 'c') // seconds between checkpoints
+		{
+			topts.checkpoint = atoi(optarg);
+			if (topts.checkpoint < 1)
+			{
+				errx(1, "impossible checkpoint interval: %d",
+					topts.checkpoint);
+			}
+		}
+		else if (ret == 'C') // percent of a CPU to use
+		{
+			cpu_share = atoi(optarg);
+			if (cpu_share < 1)
+			{
+				errx(1, "impossible CPU share: %d%%",
+					cpu_share);
+			}
+		}
+		else if (ret == 'D') // one reader per device
+			topts.per_device = 1;
+		else if (ret == 'e') // edit existing torrents
+			edit = 1;
 		else if (ret == 'E') // sort by extensions
-			sort_by_ext = 1;
+			topts.sort_by_ext = 1;
+		else if (ret == 'F') // write fastresume files
+			topts.fastresume = 1;
+		else if (ret == 'g') // progress as log lines
+			progress_log = 1;
 		else if (ret == 'i') // ignore pattern
 		{
 			if (num_ignore_patterns == MAX_IGNORE_PATTERNS)
 				errx(1, "too many ignore patterns");
 			ignore_patterns[num_ignore_patterns++] = optarg;
 		}
+		else if (ret == 'I') // reads per second
+		{
+			max_iops = atoi(optarg);
+			if (max_iops < 1)
+				errx(1, "impossible read limit: %d", max_iops);
+		}
+		else if (ret == 'j') // number of hashing threads
+		{
+			topts.hash_threads = atoi(optarg);
+			if (topts.hash_threads < 0)
+			{
+				errx(1, "impossible number of threads: %d",
+					topts.hash_threads);
+			}
+		}
+		else if (ret == 'J') // number of torrents at once
+		{
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				errx(1, "impossible number of jobs: %d", jobs);
+		}
+		else if (ret == 'k') // shard K of N
+		{
+			if (sscanf(optarg, "%d/%d", &topts.shard,
+				&topts.nshards) != 2 || topts.nshards < 1
+				|| topts.shard < 1
+				|| topts.shard > topts.nshards)
+			{
+				errx(1, "impossible shard: %s", optarg);
+			}
+		}
+		else if (ret == 'K') // merge N shards
+		{
+			topts.merge = atoi(optarg);
+			if (topts.merge < 1)
+			{
+				errx(1, "impossible number of shards: %d",
+					topts.merge);
+			}
+		}
+		else if (ret == 'l') // file listing inputs
+			input_list = optarg;
+		else if (ret == 'L') // look things up in the index
+			lookup = 1;
+		else if (ret == 'M') // write checksum manifests
+			manifest = 1;
+		else if (ret == 'm') // memory limit in MB
+		{
+			topts.memory_limit = atoi(optarg);
+			if (topts.memory_limit < 1)
+			{
+				errx(1, "impossible memory limit: %d MB",
+					topts.memory_limit);
+			}
+		}
+		else if (ret == 'n') // comment
+			topts.comment = optarg;
+		else if (ret == 'N') // connections to a server
+		{
+			topts.connections = atoi(optarg);
+			if (topts.connections < 1)
+			{
+				errx(1, "impossible number of connections: %d",
+					topts.connections);
+			}
+		}
 		else if (ret == 'o') // output file/dir
 			outpath = optarg;
 		else if (ret == 'p') // mark torrent as private
-			mark_private = 1;
+			private_flag = 1;
+		else if (ret == 'P') // read files in physical order
+			topts.physical_order = 1;
 		else if (ret == 'q') // quiet: no progress indicator
 			quiet = 1;
+		else if (ret == 'r') // resume from checkpoints
+			topts.resume = 1;
 		else if (ret == 'R') // rename topdir or file
 			newname = optarg;
+		else if (ret == 's') // per-file checksum
+		{
+			if (strcmp(optarg, "sha1") == 0)
+				topts.checksums |= TORRENT_SHA1;
+			else if (strcmp(optarg, "md5") == 0)
+				topts.checksums |= TORRENT_MD5;
+			else if (strcmp(optarg, "sha256") == 0)
+				topts.checksums |= TORRENT_SHA256;
+			else
+				errx(1, "unknown checksum: %s", optarg);
+		}
+		else if (ret == 'S') // JSON stats report
+			stats_path = optarg;
+		else if (ret == 't') // MB read per second
+		{
+			max_read_rate = atof(optarg);
+			if (max_read_rate <= 0)
+			{
+				errx(1, "impossible read rate: %s MB/s",
+					optarg);
+			}
+		}
+		else if (ret == 'T') // copy standard input here
+			tee_path = optarg;
+		else if (ret == 'u') // unmark torrent as private
+			private_flag = 0;
+		else if (ret == 'U') // tune thread counts
+			auto_tune = 1;
+		else if (ret == 'v') // verbose
+			topts.verbose = 1;
+		else if (ret == 'w') // directory to watch
+			watch_dir = optarg;
+		else if (ret == 'x') // check files against the index
+			topts.reuse = 1;
+		else if (ret == 'X') // index of pieces and files
+			index_path = optarg;
+		else if (ret == 'y') // where to remember tuning
+		{
+			tuning_cache = optarg;
+			auto_tune = 1;
+		}
+		else if (ret == 'Z') // NUMA layout in place of sysfs
+			numa_layout = optarg;
 		else // ':' or '?'
 			usage();
 	}
@@ -110,7 +355,7 @@ static void read_args(int argc, char *argv[])
 		argc--;
 	}
 
-	if (num_tracker_urls == 0)
+	if (num_tracker_urls == 0 && !edit && !lookup)
 	{
 		warnx("no tracker URL given");
 		usage();
@@ -119,20 +364,363 @@ static void read_args(int argc, char *argv[])
 	input_files = argv;
 	num_input_files = argc;
 
-	if (num_input_files == 0)
+	if (num_input_files == 0 && input_list == NULL && watch_dir == NULL)
 	{
 		warnx("no input file given");
 		usage();
 	}
 }
 
-static void do_torrent(const char *inputfile)
+// Read more input files, one per line, from a file or "-" for stdin.
+static void read_input_list(const char *filename)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t sline = 0;
+	ssize_t len;
+	char **files;
+	int nfiles, sfiles;
+
+	fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+	if (fp == NULL)
+		err(1, "cannot open %s", filename);
+
+	files = NULL;
+	nfiles = sfiles = 0;
+	for (; nfiles < num_input_files; nfiles++)
+	{
+		XPND(files, nfiles, sfiles);
+		files[nfiles] = input_files[nfiles];
+	}
+
+	while ((len = getline(&line, &sline, fp)) != -1)
+	{
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		XPND(files, nfiles, sfiles);
+		files[nfiles++] = xsd(line);
+	}
+	if (ferror(fp))
+		err(1, "error reading %s", filename);
+	if (fp != stdin)
+		fclose(fp);
+	free(line);
+
+	if (nfiles == 0)
+		errx(1, "no input file given");
+
+	input_files = files;
+	num_input_files = nfiles;
+}
+
+// Each worker makes one torrent at a time with its own context. When
+// several run at once, each one's output is collected and printed in one
+// piece once its torrent is done, so that nothing gets mixed together.
+struct worker
+{
+	pthread_t thread;
+	struct torrent *t;
+
+	FILE *log;		// where messages go
+	char *logbuf;		// ... buffered here if buffered is set
+	size_t loglen;
+
+	FILE *manifest;		// checksums go here with -M
+};
+
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_input = 0;
+static struct watch *watcher = NULL;
+static struct diag watch_diag;
+
+static struct worker *workers;
+static int buffered = 0;	// collect each job's output to print at once
+
+// The lock covers everything printed to stderr while workers run.
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_failed = 0;
+static int num_done = 0;
+static int printed = 0;		// any job's output printed yet
+
+// Progress is shown by a thread of its own, which looks in on the workers
+// every so often: as a line redrawn in place on a terminal, or with -g,
+// as a line of key=value pairs for logs to pick up.
+#define PROGRESS_MS 250
+#define PROGRESS_LOG_MS 5000
+
+static int live = 0;		// redrawing a progress line
+static int shown = 0;		// ... which is on the screen now
+static int stopping = 0;
+static pthread_t progress_thread;
+static pthread_cond_t progress_stop = PTHREAD_COND_INITIALIZER;
+
+// Get the progress line out of the way of other output. batch_lock must
+// be held.
+static void hide_progress(void)
+{
+	if (shown)
+	{
+		fputs("\r\033[K", stderr);
+		shown = 0;
+	}
+}
+
+// Messages go straight out as usual, or into the job's buffered output
+// when there is one, marked with kind.
+static void report(struct worker *w, const char *kind, const char *fmt, ...)
+{
+	char buf[DIAG_LEN];
+	va_list argptr;
+
+	va_start(argptr, fmt);
+	vsnprintf(buf, sizeof buf, fmt, argptr);
+	va_end(argptr);
+
+	if (buffered)
+		fprintf(w->log, "  %s: %s\n", kind, buf);
+	else
+		warnx("%s", buf);
+}
+
+static void show_warning(void *arg, const char *msg)
+{
+	report(arg, "warning", "%s", msg);
+}
+
+static void show_watch_warning(void *arg, const char *msg)
+{
+	(void)arg;
+	pthread_mutex_lock(&batch_lock);
+	hide_progress();
+	warnx("%s", msg);
+	pthread_mutex_unlock(&batch_lock);
+}
+
+static void show_info(void *arg, const char *msg)
+{
+	struct worker *w = arg;
+	fprintf(w->log, "  %s\n", msg);
+}
+
+// Write a checksum line in the tagged format of sha256sum --tag and the
+// like, which cksum -c can check even with several kinds mixed.
+static void show_checksum(void *arg, const char *name, const char *algo,
+	const char *hex)
+{
+	struct worker *w = arg;
+
+	if (w->manifest != NULL)
+		fprintf(w->manifest, "%s (%s) = %s\n", algo, name, hex);
+}
+
+// The manifest for a torrent goes next to it, named like it but ending in
+// .sums instead of .torrent.
+static char *manifest_name(const char *outfile)
+{
+	char *name;
+	size_t len;
+
+	len = strlen(outfile);
+	if (len > 8 && strcmp(outfile + len - 8, ".torrent") == 0)
+		len -= 8;
+	name = xm(1, len + strlen(".sums") + 1);
+	memcpy(name, outfile, len);
+	strcpy(name + len, ".sums");
+	return name;
+}
+
+// With -S, each torrent's figures are kept as a JSON object, and the
+// report is written out at the end. Watch mode has no end, so there each
+// object is added to the file as soon as it's made, and not kept.
+static char **stats_entries = NULL;
+static int num_stats_entries = 0, stats_space = 0;
+static double start_time;
+
+static void json_str(FILE *fp, const char *s)
+{
+	putc('"', fp);
+	for (; *s != '\0'; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			putc(*s, fp);
+	}
+	putc('"', fp);
+}
+
+static void json_stage(FILE *fp, const char *name,
+	const struct torrent_stage *st, const char *sep)
+{
+	fprintf(fp, "        \"%s\": { \"wall\": %.6f, \"cpu\": %.6f, "
+		"\"stall\": %.6f, \"throttled\": %.6f, \"bytes\": %lld, "
+		"\"calls\": %lld, \"items\": %lld }%s\n", name, st->wall,
+		st->cpu, st->stall, st->throttled, st->bytes, st->calls,
+		st->items, sep);
+}
+
+// Add one torrent's figures to the end of the file, in watch mode.
+static void append_stats(const char *entry)
+{
+	FILE *fp;
+
+	hide_progress();
+	fp = fopen(stats_path, "a");
+	if (fp == NULL)
+	{
+		warn("cannot open %s", stats_path);
+		return;
+	}
+	fprintf(fp, "%s\n", entry);
+	if (fclose(fp) != 0)
+		warn("error writing to %s", stats_path);
+}
+
+// Keep a torrent's figures for the report. batch_lock must be held.
+static void add_stats(const char *inputfile, const char *outfile, int ret,
+	const struct torrent_stats *st)
+{
+	FILE *fp;
+	char *buf;
+	size_t len;
+
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL)
+		err(1, "cannot buffer stats");
+
+	fprintf(fp, "    {\n      \"input\": ");
+	json_str(fp, inputfile);
+	fprintf(fp, ",\n      \"torrent\": ");
+	json_str(fp, outfile);
+	fprintf(fp, ",\n      \"ok\": %s,\n", ret == 0 ? "true" : "false");
+	fprintf(fp, "      \"wall\": %.6f,\n      \"cpu\": %.6f,\n",
+		st->wall, st->cpu);
+	fprintf(fp, "      \"readers\": %d,\n      \"hashers\": %d,\n"
+		"      \"queue_limit\": %d,\n", st->readers, st->hashers,
+		st->queue_limit);
+	fprintf(fp, "      \"max_queue\": %d,\n      \"max_pending\": %d,\n"
+		"      \"max_buffers\": %d,\n", st->max_queue, st->max_pending,
+		st->max_buffers);
+	fprintf(fp, "      \"reused_pieces\": %d,\n", st->reused);
+	fprintf(fp, "      \"stages\": {\n");
+	json_stage(fp, "scan", &st->scan, ",");
+	json_stage(fp, "stat", &st->stat, ",");
+	json_stage(fp, "read", &st->read, ",");
+	json_stage(fp, "hash", &st->hash, ",");
+	json_stage(fp, "write", &st->write, "");
+	fprintf(fp, "      }\n    }");
+
+	if (fclose(fp) != 0)
+		err(1, "cannot buffer stats");
+	if (watch_dir != NULL)
+	{
+		append_stats(buf);
+		free(buf);
+		return;
+	}
+	XPND(stats_entries, num_stats_entries, stats_space);
+	stats_entries[num_stats_entries++] = buf;
+}
+
+// Write the report, with totals for the whole run so far. batch_lock must
+// be held if other workers may be running.
+static void write_stats(void)
+{
+	struct rusage ru;
+	FILE *fp;
+	int ix;
+
+	hide_progress();
+	fp = fopen(stats_path, "w");
+	if (fp == NULL)
+	{
+		warn("cannot create %s", stats_path);
+		return;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(fp, "{\n  \"wall\": %.6f,\n  \"cpu\": %.6f,\n"
+		"  \"failed\": %d,\n  \"torrents\": [\n",
+		wall_time() - start_time,
+		ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+		num_failed);
+	for (ix = 0; ix < num_stats_entries; ix++)
+	{
+		fprintf(fp, "%s%s\n", stats_entries[ix],
+			ix + 1 < num_stats_entries ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+
+	if (fclose(fp) != 0)
+		warn("error writing to %s", stats_path);
+}
+
+// Rewrite an existing torrent with the changes asked for, in place unless
+// -o says otherwise.
+static int do_edit(struct worker *w, const char *inputfile)
+{
+	struct torrent_changes c;
+	const char *base;
+	struct stat info;
+	char *outfile;
+	int ret;
+
+	if (outpath == NULL)
+		outfile = xsd(inputfile);
+	else if (num_input_files == 1 && (stat(outpath, &info) == -1
+		|| S_ISREG(info.st_mode)))
+	{
+		outfile = xsd(outpath);
+	}
+	else
+	{
+		base = strrchr(inputfile, '/');
+		base = base != NULL ? base + 1 : inputfile;
+		outfile = xm(1, strlen(outpath) + 1 + strlen(base) + 1);
+		strcpy(outfile, outpath);
+		if (outfile[strlen(outfile) - 1] != '/')
+			strcat(outfile, "/");
+		strcat(outfile, base);
+	}
+
+	if (!quiet)
+		fprintf(w->log, "%s:\n", outfile);
+
+	c.tracker_urls = topts.tracker_urls;
+	c.num_tracker_urls = topts.num_tracker_urls;
+	c.comment = topts.comment;
+	c.name = newname;
+	c.private = private_flag;
+	ret = torrent_edit(w->t, inputfile, &c, outfile);
+	if (ret == -1)
+		report(w, "error", "%s", torrent_error(w->t));
+
+	if (stats_path != NULL)
+	{
+		pthread_mutex_lock(&batch_lock);
+		add_stats(inputfile, outfile, ret, torrent_stats(w->t));
+		pthread_mutex_unlock(&batch_lock);
+	}
+
+	free(outfile);
+	return ret;
+}
+
+static int do_torrent(struct worker *w, const char *inputfile)
 {
 	char *outfile;
 	char *realinputfile;
 	char *p;
 	const char *renamedname;
+	char *sumsfile;
 	struct stat info;
+	size_t len;
+	int ret;
 
 	// duplicate input file name, removing any trailing slashes
 	realinputfile = xsd(inputfile);
@@ -144,11 +732,22 @@ static void do_torrent(const char *inputfile)
 	}
 	if (realinputfile[0] == '\0')
 	{
-		warnx("ignoring empty argument");
-		return;
+		report(w, "warning", "ignoring empty argument");
+		free(realinputfile);
+		return 0;
 	}
 	if (realinputfile[0] == '/' && realinputfile[1] == '\0')
-		errx(1, "won't torrent the root directory");
+	{
+		report(w, "error", "won't torrent the root directory");
+		free(realinputfile);
+		return -1;
+	}
+	if (strcmp(realinputfile, "-") == 0 && newname == NULL)
+	{
+		report(w, "error", "standard input needs a name (use -R)");
+		free(realinputfile);
+		return -1;
+	}
 
 	if (newname != NULL)
 		renamedname = newname;
@@ -162,6 +761,16 @@ static void do_torrent(const char *inputfile)
 			renamedname++;
 			assert(renamedname[0] != '\0');
 		}
+
+		// The torrent of foo.tar is foo.torrent, though what it's
+		// called inside is up to what the archive holds.
+		len = strlen(renamedname);
+		if (topts.tar && len > 4
+			&& strcmp(renamedname + len - 4, ".tar") == 0)
+		{
+			realinputfile[renamedname - realinputfile + len - 4]
+				= '\0';
+		}
 	}
 
 	if (outpath == NULL)
@@ -170,7 +779,8 @@ static void do_torrent(const char *inputfile)
 		strcpy(outfile, renamedname);
 		strcat(outfile, ".torrent");
 	}
-	else if (num_input_files == 1 && (stat(outpath, &info) == -1
+	else if (num_input_files == 1 && watch_dir == NULL
+		&& (stat(outpath, &info) == -1
 		|| S_ISREG(info.st_mode)))
 	{
 		// One input file, and outpath is either nonexistent thus far,
@@ -199,33 +809,531 @@ static void do_torrent(const char *inputfile)
 	}
 
 	if (!quiet)
-		fprintf(stderr, "%s:\n", outfile);
+		fprintf(w->log, "%s:\n", outfile);
 
-	create_torrent(outfile, inputfile, renamedname, piecesize, mark_private,
-		quiet, sort_by_ext,
-		num_tracker_urls, (const char *const *)tracker_urls,
-		num_ignore_patterns, (const char *const *)ignore_patterns);
+	sumsfile = NULL;
+	w->manifest = NULL;
+	if (manifest)
+	{
+		sumsfile = manifest_name(outfile);
+		w->manifest = fopen(sumsfile, "w");
+		if (w->manifest == NULL)
+		{
+			report(w, "error", "cannot create %s: %s", sumsfile,
+				strerror(errno));
+			free(sumsfile);
+			free(outfile);
+			free(realinputfile);
+			return -1;
+		}
+	}
+
+	if (strcmp(realinputfile, "-") == 0)
+	{
+		ret = torrent_create_stream(w->t, STDIN_FILENO, tee_fd,
+			renamedname, outfile);
+	}
+	else
+	{
+		// Leave naming a tar archive's contents, or data on a
+		// server, to torrent_create().
+		ret = torrent_create(w->t, inputfile, topts.tar
+			|| strncmp(inputfile, TORRENT_REMOTE,
+			strlen(TORRENT_REMOTE)) == 0 ? newname : renamedname,
+			outfile);
+	}
+	if (ret == -1)
+		report(w, "error", "%s", torrent_error(w->t));
+
+	if (stats_path != NULL)
+	{
+		pthread_mutex_lock(&batch_lock);
+		add_stats(inputfile, outfile, ret, torrent_stats(w->t));
+		pthread_mutex_unlock(&batch_lock);
+	}
+
+	if (w->manifest != NULL)
+	{
+		if (fclose(w->manifest) != 0 && ret == 0)
+		{
+			report(w, "error", "error writing to %s: %s",
+				sumsfile, strerror(errno));
+			ret = -1;
+		}
+		if (ret == -1)
+			remove(sumsfile);
+		w->manifest = NULL;
+		free(sumsfile);
+	}
 
 	free(outfile);
 	free(realinputfile);
+	return ret;
+}
+
+static void size_str(char *buf, size_t len, double bytes)
+{
+	static const char *const units[] = { "B", "KB", "MB", "GB", "TB" };
+	int ix = 0;
+
+	while (bytes >= 1024 && ix < 4)
+	{
+		bytes /= 1024;
+		ix++;
+	}
+	snprintf(buf, len, ix == 0 ? "%.0f %s" : "%.1f %s", bytes, units[ix]);
+}
+
+static void eta_str(char *buf, size_t len, double secs)
+{
+	long s = secs + 0.5;
+
+	if (secs < 0)
+		snprintf(buf, len, "--:--");
+	else if (s >= 3600)
+	{
+		snprintf(buf, len, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60,
+			s % 60);
+	}
+	else
+		snprintf(buf, len, "%ld:%02ld", s / 60, s % 60);
+}
+
+// Redraw the progress line, cut to fit the terminal. batch_lock must be
+// held.
+static void draw_progress(int width, long long total, long long done,
+	double rate, double file_rate, double eta)
+{
+	char line[256];
+	char donebuf[32], totalbuf[32], ratebuf[32], etabuf[32];
+	int len = 0;
+
+	if (num_input_files > 1)
+	{
+		len += snprintf(line, sizeof line, "[%d/%d] ", num_done,
+			num_input_files);
+	}
+	else if (watch_dir != NULL)
+		len += snprintf(line, sizeof line, "[%d done] ", num_done);
+
+	size_str(donebuf, sizeof donebuf, done);
+	size_str(totalbuf, sizeof totalbuf, total);
+	size_str(ratebuf, sizeof ratebuf, rate);
+	eta_str(etabuf, sizeof etabuf, eta);
+	if (total > 0)
+	{
+		len += snprintf(line + len, sizeof line - len,
+			"%s of %s (%d%%), ", donebuf, totalbuf,
+			(int)(done * 100 / total));
+	}
+	else
+		len += snprintf(line + len, sizeof line - len, "%s, ", donebuf);
+	snprintf(line + len, sizeof line - len, "%s/s, %.0f files/s, ETA %s",
+		ratebuf, file_rate, etabuf);
+
+	if (width < (int)sizeof line)
+		line[width - 1] = '\0';
+	fprintf(stderr, "\r%s\033[K", line);
+	shown = 1;
+}
+
+// Look in on the workers every so often until told to stop, adding up
+// their progress.
+static void *run_progress(void *arg)
+{
+	struct torrent_progress p;
+	struct winsize ws;
+	struct timespec ts;
+	long long total, done, all, files;
+	long long last_all = 0, last_files = 0;
+	double now, last;
+	double rate = 0, file_rate = 0;
+	double eta;
+	double a;
+	int interval;
+	int width = 80;
+	int ix;
+
+	(void)arg;
+	interval = live ? PROGRESS_MS : PROGRESS_LOG_MS;
+	if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		width = ws.ws_col;
+
+	// Rates are smoothed on a terminal, so they don't jump about from
+	// one redraw to the next.
+	a = live ? 0.3 : 1;
+
+	last = wall_time();
+	pthread_mutex_lock(&batch_lock);
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval / 1000;
+		ts.tv_nsec += interval % 1000 * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!stopping && pthread_cond_timedwait(&progress_stop,
+			&batch_lock, &ts) != ETIMEDOUT)
+		{
+		}
+		if (stopping)
+			break;
+
+		total = done = all = files = 0;
+		for (ix = 0; ix < jobs; ix++)
+		{
+			torrent_progress(workers[ix].t, &p);
+			total += p.total_bytes;
+			done += p.done_bytes;
+			all += p.all_bytes;
+			files += p.all_files;
+		}
+
+		now = wall_time();
+		rate = a * (all - last_all) / (now - last) + (1 - a) * rate;
+		file_rate = a * (files - last_files) / (now - last)
+			+ (1 - a) * file_rate;
+		last = now;
+		last_all = all;
+		last_files = files;
+		eta = total > 0 && rate > 0 ? (total - done) / rate : -1;
+
+		if (live)
+			draw_progress(width, total, done, rate, file_rate, eta);
+		else
+		{
+			fprintf(stderr, "progress torrents=%d/%d "
+				"bytes=%lld/%lld files=%lld rate=%.0f "
+				"files_rate=%.1f eta=%.0f\n", num_done,
+				num_input_files, done, total, files, rate,
+				file_rate, eta);
+		}
+	}
+	hide_progress();
+	pthread_mutex_unlock(&batch_lock);
+	return NULL;
+}
+
+static void start_progress(void)
+{
+	if (pthread_create(&progress_thread, NULL, run_progress, NULL) != 0)
+		errx(1, "cannot create progress thread");
+}
+
+// Stop the progress thread, if it was started, leaving nothing on the
+// screen.
+static void stop_progress(void)
+{
+	if (!live && !progress_log)
+		return;
+	pthread_mutex_lock(&batch_lock);
+	stopping = 1;
+	pthread_cond_signal(&progress_stop);
+	pthread_mutex_unlock(&batch_lock);
+	pthread_join(progress_thread, NULL);
+}
+
+// Take the next input to work on, or NULL once there are no more. After
+// the ones given, watch mode waits for more to be put in the directory.
+static char *take_input(void)
+{
+	char *inputfile = NULL;
+
+	pthread_mutex_lock(&input_lock);
+	if (next_input < num_input_files)
+		inputfile = xsd(input_files[next_input++]);
+	else if (watcher != NULL)
+	{
+		inputfile = watch_next(watcher);
+		if (inputfile == NULL)
+			errx(1, "%s", watch_diag.msg);
+	}
+	pthread_mutex_unlock(&input_lock);
+	return inputfile;
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	char *inputfile;
+	int ret;
+
+	while ((inputfile = take_input()) != NULL)
+	{
+		if (!buffered && printed)
+			putc('\n', stderr);
+
+		if (buffered)
+		{
+			w->log = open_memstream(&w->logbuf, &w->loglen);
+			if (w->log == NULL)
+				err(1, "cannot buffer output");
+		}
+
+		ret = edit ? do_edit(w, inputfile)
+			: do_torrent(w, inputfile);
+		free(inputfile);
+
+		pthread_mutex_lock(&batch_lock);
+		if (ret == -1)
+			num_failed++;
+		num_done++;
+		if (buffered)
+		{
+			fclose(w->log);
+			if (w->loglen > 0)
+			{
+				hide_progress();
+				if (printed)
+					putc('\n', stderr);
+				fwrite(w->logbuf, 1, w->loglen, stderr);
+				printed = 1;
+			}
+			free(w->logbuf);
+		}
+		else
+			printed = 1;
+		pthread_mutex_unlock(&batch_lock);
+
+		// Without a batch, stop at the first failure as always.
+		if (ret == -1 && jobs == 1 && input_list == NULL
+			&& watch_dir == NULL)
+		{
+			stop_progress();
+			if (stats_path != NULL)
+				write_stats();
+			exit(1);
+		}
+	}
+
+	return NULL;
+}
+
+static void show_match(void *arg, const struct torrent_index_match *m)
+{
+	const char *query = arg;
+
+	if (m->piece >= 0)
+	{
+		printf("%s: %s %s piece %d %s\n", query, m->torrent,
+			m->info_hash, m->piece, m->file);
+	}
+	else
+		printf("%s: %s %s %s\n", query, m->torrent, m->info_hash,
+			m->file);
+}
+
+// With -L, find each input, a piece digest or a file, in the index
+// instead of making torrents. Returns how many weren't found.
+static int lookup_all(void)
+{
+	struct torrent_index *ix;
+	int missing = 0;
+	int ret;
+	int n;
+
+	ix = torrent_index_open(index_path, 0);
+	if (ix == NULL)
+		err(1, "cannot open index %s", index_path);
+	for (n = 0; n < num_input_files; n++)
+	{
+		ret = torrent_index_lookup(ix, input_files[n], show_match,
+			input_files[n]);
+		if (ret == -1)
+			warn("cannot read %s", input_files[n]);
+		else if (ret == 0)
+			warnx("%s: not in the index", input_files[n]);
+		if (ret <= 0)
+			missing++;
+	}
+	torrent_index_close(ix);
+	return missing;
 }
 
 int main(int argc, char *argv[])
 {
+	struct torrent_pool *pool = NULL;
+	struct torrent_throttle *throttle = NULL;
+	struct torrent_tuning *tuning = NULL;
+	struct torrent_index *index = NULL;
+	FILE *fp;
 	int ix;
 
 	if (argc == 1)
 		usage();
+	start_time = wall_time();
 
+	torrent_defaults(&topts);
 	read_options(argc, argv);
 	read_args(argc, argv);
+	if (input_list != NULL)
+		read_input_list(input_list);
+	if (lookup)
+	{
+		if (index_path == NULL)
+			errx(1, "-L needs an index (-X)");
+		return lookup_all() > 0;
+	}
+	if (jobs > num_input_files && watch_dir == NULL)
+		jobs = num_input_files;
 
-	for (ix = 0; ix < num_input_files; ix++)
+	if (tee_path != NULL)
 	{
-		do_torrent(input_files[ix]);
-		if (ix < num_input_files - 1)
-			putc('\n', stderr);
+		for (ix = 0; ix < num_input_files; ix++)
+		{
+			if (strcmp(input_files[ix], "-") == 0)
+				break;
+		}
+		if (ix == num_input_files)
+			errx(1, "-T only applies to standard input (-)");
+		tee_fd = open(tee_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (tee_fd == -1)
+			err(1, "cannot create %s", tee_path);
 	}
 
+	topts.tracker_urls = (const char *const *)tracker_urls;
+	topts.num_tracker_urls = num_tracker_urls;
+	topts.ignore_patterns = (const char *const *)ignore_patterns;
+	topts.num_ignore_patterns = num_ignore_patterns;
+	topts.warning = show_warning;
+	topts.info = show_info;
+	topts.checksum = show_checksum;
+
+	topts.private = private_flag == 1;
+	if (edit && (watch_dir != NULL || tee_path != NULL))
+		errx(1, "-e can't be used with -w or -T");
+	if (topts.tar && (edit || tee_path != NULL))
+		errx(1, "-a can't be used with -e or -T");
+
+	if (topts.resume && topts.checkpoint == 0)
+		topts.checkpoint = DEFAULT_CHECKPOINT_SECS;
+
+	if ((topts.checksums & TORRENT_SHA256) && !manifest)
+		errx(1, "SHA-256 checksums only go in a manifest (use -M)");
+	if (manifest && topts.checksums == 0)
+		errx(1, "-M needs at least one checksum (-s)");
+	if (topts.nshards > 0 && topts.merge > 0)
+		errx(1, "-k and -K can't be used together");
+	if ((topts.nshards > 0 || topts.merge > 0) && topts.checksums)
+		errx(1, "per-file checksums (-s) can't be sharded");
+	if (topts.reuse && index_path == NULL)
+		errx(1, "-x needs an index (-X)");
+
+	if (numa_layout != NULL && torrent_numa(numa_layout) == -1)
+		errx(1, "impossible NUMA layout: %s", numa_layout);
+
+	// All the jobs share one set of hashing threads, unless tuning,
+	// which changes how many of each job's own threads hash.
+	if (jobs > 1 && topts.hash_threads > 0 && !auto_tune)
+	{
+		pool = torrent_pool_new(topts.hash_threads);
+		if (pool == NULL)
+			errx(1, "cannot create hashing threads");
+		topts.pool = pool;
+	}
+
+	// As do their readers, so the limits apply to them all together.
+	if (max_read_rate > 0 || max_iops > 0 || cpu_share > 0 || adaptive_io)
+	{
+		throttle = torrent_throttle_new(max_read_rate * 1024 * 1024,
+			max_iops, cpu_share, adaptive_io);
+		topts.throttle = throttle;
+	}
+
+	// And what tuning has found out about each device.
+	if (auto_tune)
+	{
+		tuning = torrent_tuning_new(tuning_cache);
+		topts.tuning = tuning;
+	}
+
+	// And the index they're all added to.
+	if (index_path != NULL)
+	{
+		index = torrent_index_open(index_path, 1);
+		if (index == NULL)
+			err(1, "cannot open index %s", index_path);
+		topts.index = index;
+	}
+
+	if (watch_dir != NULL)
+	{
+		diag_init(&watch_diag, show_watch_warning, NULL);
+		watcher = watch_new(watch_dir, WATCH_SETTLE_MS, &watch_diag);
+		if (watcher == NULL)
+			errx(1, "%s", watch_diag.msg);
+
+		// Each torrent's figures are added as it's made.
+		if (stats_path != NULL)
+		{
+			if ((fp = fopen(stats_path, "w")) == NULL)
+				err(1, "cannot create %s", stats_path);
+			fclose(fp);
+		}
+	}
+
+	live = !quiet && !progress_log && isatty(STDERR_FILENO);
+	buffered = jobs > 1 || live || progress_log;
+
+	workers = xm(sizeof workers[0], jobs);
+	for (ix = 0; ix < jobs; ix++)
+	{
+		topts.cbarg = &workers[ix];
+		workers[ix].t = torrent_new(&topts);
+		workers[ix].log = stderr;
+	}
+	if (live || progress_log)
+		start_progress();
+
+	if (jobs == 1)
+		run_worker(&workers[0]);
+	else
+	{
+		for (ix = 0; ix < jobs; ix++)
+		{
+			if (pthread_create(&workers[ix].thread, NULL,
+				run_worker, &workers[ix]) != 0)
+			{
+				errx(1, "cannot create worker thread");
+			}
+		}
+		for (ix = 0; ix < jobs; ix++)
+			pthread_join(workers[ix].thread, NULL);
+	}
+	stop_progress();
+
+	if (stats_path != NULL && watch_dir == NULL)
+		write_stats();
+	for (ix = 0; ix < num_stats_entries; ix++)
+		free(stats_entries[ix]);
+	free(stats_entries);
+
+	for (ix = 0; ix < jobs; ix++)
+		torrent_free(workers[ix].t);
+	free(workers);
+	if (pool != NULL)
+		torrent_pool_free(pool);
+	if (throttle != NULL)
+		torrent_throttle_free(throttle);
+	if (tuning != NULL)
+	{
+		if (torrent_tuning_save(tuning) == -1)
+			warn("cannot save tuning to %s", tuning_cache);
+		torrent_tuning_free(tuning);
+	}
+	if (index != NULL)
+		torrent_index_close(index);
+	if (tee_fd != -1 && close(tee_fd) == -1)
+		err(1, "error writing to %s", tee_path);
+
+	if (num_failed > 0)
+	{
+		warnx("%d of %d torrents failed", num_failed,
+			num_input_files);
+		return 1;
+	}
 	return 0;
 }
@@ -0,0 +1,17 @@
+// MD5, as described in RFC 1321.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MD5_DIGEST_LENGTH 16
+
+struct md5_ctx
+{
+	uint32_t state[4];
+	uint64_t count;		// bytes hashed so far
+	unsigned char buffer[64];
+};
+
+void md5_init(struct md5_ctx *ctx);
+void md5_update(struct md5_ctx *ctx, const unsigned char *data, size_t len);
+void md5_final(unsigned char digest[MD5_DIGEST_LENGTH], struct md5_ctx *ctx);
@@ -0,0 +1,305 @@
+#ifdef __linux__
+#define _GNU_SOURCE		// for sched_getcpu() and CPU affinity
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#include "xm.h"
+#include "numa.h"
+
+#ifdef __linux__
+
+#define NODE_DIR "/sys/devices/system/node"
+
+// Longest line of a sysfs file taken in.
+#define LINE_LEN 4096
+
+static pthread_mutex_t layout_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct numa *layout;	// NULL with one node
+static int decided;		// whether layout has been worked out
+
+struct node
+{
+	int id;			// its number, to ask for its memory
+	cpu_set_t cpus;
+};
+
+struct numa
+{
+	struct node *nodes;
+	int nnodes, snodes;
+
+	// The node each CPU is on, or 0 for ones on none.
+	int node_of[CPU_SETSIZE];
+
+	// Where the process could run to begin with.
+	cpu_set_t all;
+};
+
+// Make sense of a list of numbers like "0-3,8,10-11", ending at the end
+// of the string or a newline, into set. Returns -1 if it isn't one, or
+// has numbers too big for a cpu_set_t.
+static int parse_list(const char *s, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*s != '\0' && *s != '\n')
+	{
+		if (*s < '0' || *s > '9')
+			return -1;
+		lo = hi = strtol(s, &end, 10);
+		if (*end == '-')
+		{
+			s = end + 1;
+			if (*s < '0' || *s > '9')
+				return -1;
+			hi = strtol(s, &end, 10);
+		}
+		if (hi < lo || hi >= CPU_SETSIZE)
+			return -1;
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+	return 0;
+}
+
+static int read_line(const char *path, char *line, int len)
+{
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(line, len, fp) == NULL)
+		ret = -1;
+	fclose(fp);
+	return ret;
+}
+
+static struct numa *new_layout(void)
+{
+	struct numa *nu;
+
+	nu = xm(sizeof *nu, 1);
+	nu->nodes = NULL;
+	nu->nnodes = nu->snodes = 0;
+	memset(nu->node_of, 0, sizeof nu->node_of);
+	if (sched_getaffinity(0, sizeof nu->all, &nu->all) == -1)
+	{
+		CPU_ZERO(&nu->all);
+		CPU_SET(0, &nu->all);
+	}
+	return nu;
+}
+
+static void free_layout(struct numa *nu)
+{
+	free(nu->nodes);
+	free(nu);
+}
+
+static void add_node(struct numa *nu, int id, const cpu_set_t *cpus)
+{
+	int cpu;
+
+	XPND(nu->nodes, nu->nnodes, nu->snodes);
+	nu->nodes[nu->nnodes].id = id;
+	nu->nodes[nu->nnodes].cpus = *cpus;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, cpus))
+			nu->node_of[cpu] = nu->nnodes;
+	}
+	nu->nnodes++;
+}
+
+// Find the nodes from sysfs. Only CPUs the process may run on count, so
+// nodes without any, such as ones that are only memory, are left out.
+static struct numa *detect(void)
+{
+	struct numa *nu;
+	cpu_set_t online, cpus;
+	char path[64];
+	char line[LINE_LEN];
+	int id;
+
+	if (read_line(NODE_DIR "/online", line, sizeof line) == -1
+		|| parse_list(line, &online) == -1)
+	{
+		return NULL;
+	}
+
+	nu = new_layout();
+	for (id = 0; id < CPU_SETSIZE; id++)
+	{
+		if (!CPU_ISSET(id, &online))
+			continue;
+		snprintf(path, sizeof path, NODE_DIR "/node%d/cpulist", id);
+		if (read_line(path, line, sizeof line) == -1
+			|| parse_list(line, &cpus) == -1)
+		{
+			free_layout(nu);
+			return NULL;
+		}
+		CPU_AND(&cpus, &cpus, &nu->all);
+		if (CPU_COUNT(&cpus) > 0)
+			add_node(nu, id, &cpus);
+	}
+	return nu;
+}
+
+int numa_set(const char *spec)
+{
+	struct numa *nu = NULL;
+	cpu_set_t cpus;
+	char *copy;
+	char *part;
+	char *save;
+
+	if (strcmp(spec, "off") != 0)
+	{
+		nu = new_layout();
+		copy = xsd(spec);
+		for (part = strtok_r(copy, "/", &save); part != NULL;
+			part = strtok_r(NULL, "/", &save))
+		{
+			if (parse_list(part, &cpus) == -1
+				|| CPU_COUNT(&cpus) == 0)
+			{
+				break;
+			}
+			add_node(nu, nu->nnodes, &cpus);
+		}
+		free(copy);
+		if (part != NULL || nu->nnodes == 0)
+		{
+			free_layout(nu);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&layout_lock);
+	if (layout != NULL)
+		free_layout(layout);
+	layout = nu;
+	decided = 1;
+	pthread_mutex_unlock(&layout_lock);
+	return 0;
+}
+
+const struct numa *numa_get(void)
+{
+	const struct numa *nu;
+
+	pthread_mutex_lock(&layout_lock);
+	if (!decided)
+	{
+		layout = detect();
+		decided = 1;
+	}
+	nu = layout != NULL && layout->nnodes > 1 ? layout : NULL;
+	pthread_mutex_unlock(&layout_lock);
+	return nu;
+}
+
+int numa_nodes(const struct numa *nu)
+{
+	return nu != NULL ? nu->nnodes : 1;
+}
+
+int numa_current(const struct numa *nu)
+{
+	int cpu;
+
+	if (nu == NULL)
+		return 0;
+	cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? nu->node_of[cpu] : 0;
+}
+
+// Failing to place a thread or memory isn't worth stopping for, since
+// everything still works, just more slowly; a cpuset may not allow it, or
+// the kernel may be built without NUMA support.
+void numa_bind_thread(const struct numa *nu, int node)
+{
+	if (nu == NULL)
+		return;
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+		node == -1 ? &nu->all : &nu->nodes[node].cpus);
+}
+
+void numa_bind_memory(const struct numa *nu, void *p, size_t len, int node)
+{
+	unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+	int bits = 8 * sizeof mask[0];
+	int id;
+
+	if (nu == NULL)
+		return;
+	id = nu->nodes[node].id;
+	memset(mask, 0, sizeof mask);
+	mask[id / bits] |= 1UL << id % bits;
+
+	// Pages already touched, as memory reused from the heap may be, are
+	// moved over.
+	syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, 8 * sizeof mask,
+		MPOL_MF_MOVE);
+}
+
+#else
+
+struct numa
+{
+	int nnodes;
+};
+
+int numa_set(const char *spec)
+{
+	return strcmp(spec, "off") == 0 ? 0 : -1;
+}
+
+const struct numa *numa_get(void)
+{
+	return NULL;
+}
+
+int numa_nodes(const struct numa *nu)
+{
+	return nu != NULL ? nu->nnodes : 1;
+}
+
+int numa_current(const struct numa *nu)
+{
+	(void)nu;
+	return 0;
+}
+
+void numa_bind_thread(const struct numa *nu, int node)
+{
+	(void)nu;
+	(void)node;
+}
+
+void numa_bind_memory(const struct numa *nu, void *p, size_t len, int node)
+{
+	(void)nu;
+	(void)p;
+	(void)len;
+	(void)node;
+}
+
+#endif
@@ -0,0 +1,31 @@
+// Placing threads and memory on the nodes of a NUMA machine, so that a
+// piece buffer is read into and hashed by CPUs of the node whose memory
+// holds it, rather than having its contents cross between sockets twice.
+// The layout comes from /sys/devices/system/node unless numa_set() says
+// otherwise. With one node, or on systems other than Linux, there's
+// nothing to place, and everything here does nothing given a NULL layout.
+
+struct numa;
+
+// Use spec in place of what the system says: "off" for one node, or the
+// CPUs of each node as lists like "0-7,16-23", separated by slashes, the
+// Nth list being node N. Must come before the first numa_get(). Returns
+// -1 if spec makes no sense, or can't be used here.
+int numa_set(const char *spec);
+
+// The layout, worked out the first time through, or NULL with one node.
+const struct numa *numa_get(void);
+
+int numa_nodes(const struct numa *nu);
+
+// Which node the calling thread is running on.
+int numa_current(const struct numa *nu);
+
+// Keep the calling thread to node's CPUs, or with node == -1, let it run
+// wherever it could to begin with.
+void numa_bind_thread(const struct numa *nu, int node);
+
+// Have the pages of len bytes at p come from node's memory. p must be
+// page-aligned. This is a preference, not a promise: where node is short
+// of memory, the pages come from elsewhere.
+void numa_bind_memory(const struct numa *nu, void *p, size_t len, int node);
@@ -0,0 +1,79 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "physaddr.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#ifdef __linux__
+// Ask the filesystem where the first extent of the file lives.
+static int fiemap_address(int fd, unsigned long long *addr)
+{
+	union
+	{
+		struct fiemap fm;
+		char space[sizeof (struct fiemap)
+			+ sizeof (struct fiemap_extent)];
+	} u;
+
+	memset(&u, 0, sizeof u);
+	u.fm.fm_start = 0;
+	u.fm.fm_length = ~0ULL;
+	u.fm.fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) == -1
+		|| u.fm.fm_mapped_extents == 0)
+	{
+		return -1;
+	}
+
+	*addr = u.fm.fm_extents[0].fe_physical;
+	return 0;
+}
+
+// Older interface; usually needs root, but works on filesystems without
+// FIEMAP support.
+static int fibmap_address(int fd, const struct stat *sb,
+	unsigned long long *addr)
+{
+	int block = 0;
+
+	if (ioctl(fd, FIBMAP, &block) == -1 || block == 0)
+		return -1;
+
+	*addr = (unsigned long long)block * sb->st_blksize;
+	return 0;
+}
+#endif
+
+unsigned long long physical_address(const char *filename,
+	const struct stat *sb)
+{
+#ifdef __linux__
+	unsigned long long addr;
+	int fd;
+	int ret;
+
+	if (sb->st_size > 0 && (fd = open(filename, O_RDONLY)) != -1)
+	{
+		ret = fiemap_address(fd, &addr);
+		if (ret == -1)
+			ret = fibmap_address(fd, sb, &addr);
+		close(fd);
+		if (ret == 0)
+			return addr;
+	}
+#else
+	(void)filename;
+#endif
+
+	// Inode numbers are usually allocated close to the data they
+	// describe, which makes them a fair stand-in.
+	return (unsigned long long)sb->st_ino;
+}
@@ -0,0 +1,5 @@
+// Return a sort key approximating where a file's data starts on disk.
+// Reading files in ascending order of this key, among files on the same
+// device, avoids most of the seeking that path order causes.
+unsigned long long physical_address(const char *filename,
+	const struct stat *sb);
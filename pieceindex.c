@@ -0,0 +1,718 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "xm.h"
+#include "io.h"
+#include "sha1lib.h"
+#include "pieceindex.h"
+
+#define MAGIC "TZINDEX1"
+#define MAGIC_LEN 8
+
+// Numbers are big-endian. A record starts with its length (not counting
+// the length itself), then the info-hash, piece size, number of pieces,
+// number of files and length of the torrent's path...
+#define RECORD_HEAD (4 + SHA1_DIGEST_LENGTH + 4 * 4)
+
+// ... followed by the path, the piece digests, and each file: its offset,
+// length, whether it has a fingerprint, the fingerprint (or zeros), and
+// the length of its name, then the name. Lengths of strings count their
+// terminating NULs, which are there so strings can be used in place.
+#define FILE_HEAD (8 + 8 + 1 + PI_FINGERPRINT_LENGTH + 4)
+
+// Where to find the parts of a torrent's record in the map.
+struct torrent_rec
+{
+	off_t hash;
+	int piece_bytes, npieces, nfiles;
+	off_t path;
+	off_t digests;
+	off_t files;
+};
+
+// A file whose whole pieces could be reused, in a hash table by
+// fingerprint.
+struct known
+{
+	long long length;
+	int piece_bytes;
+	off_t fp;
+	off_t digests;		// from its first piece
+	int next;		// in the same bucket, or -1
+};
+
+// A piece, in a hash table by digest. It's only built once pieces are
+// looked up, since making torrents never needs it.
+struct piece_ref
+{
+	int torrent;		// in pi->torrents
+	int piece;
+	int next;		// in the same bucket, or -1
+};
+
+// Buckets to start with, doubled as the table fills up.
+#define MIN_BUCKETS 1024
+
+struct pieceindex
+{
+	int fd;
+	pthread_mutex_t lock;
+
+	// The file is mapped as far as it had got last time it was looked
+	// at, and end is where the last whole record in that ends.
+	unsigned char *map;
+	off_t maplen;
+	off_t end;
+
+	struct torrent_rec *torrents;
+	int ntorrents, storrents;
+
+	struct known *known;
+	int nknown, sknown;
+	int *buckets;
+	int nbuckets;
+
+	// The pieces of the first nindexed torrents, by digest.
+	struct piece_ref *pieces;
+	int npieces, spieces;
+	int *piece_buckets;
+	int npiece_buckets;
+	int nindexed;
+};
+
+struct pi_entry
+{
+	int piece_bytes, npieces;
+	unsigned char *digests;
+
+	// The files, encoded as they go in the record.
+	unsigned char *files;
+	size_t len, size;
+	int nfiles;
+};
+
+static unsigned long long get(const unsigned char *p, int n)
+{
+	unsigned long long v = 0;
+
+	while (n-- > 0)
+		v = v << 8 | *p++;
+	return v;
+}
+
+static void put(unsigned char *p, unsigned long long v, int n)
+{
+	while (n-- > 0)
+	{
+		p[n] = v;
+		v >>= 8;
+	}
+}
+
+// Where the ix'th sampled block of a long file starts.
+static long long sample_offset(long long length, int ix)
+{
+	return (length - PI_SAMPLE_BYTES) * ix / (PI_SAMPLES - 1);
+}
+
+void pi_fp_init(struct pi_fpsum *fs, long long length)
+{
+	unsigned char buf[8];
+
+	SHA1Init(&fs->ctx);
+	put(buf, length, 8);
+	SHA1Update(&fs->ctx, buf, 8);
+	fs->length = length;
+	fs->pos = 0;
+	fs->sample = 0;
+}
+
+void pi_fp_update(struct pi_fpsum *fs, const unsigned char *buf, int len)
+{
+	long long end = fs->pos + len;
+	long long from, to;
+
+	if (fs->length <= PI_WHOLE_LENGTH)
+	{
+		SHA1Update(&fs->ctx, buf, len);
+		fs->pos = end;
+		return;
+	}
+
+	// Take whatever parts of the sampled blocks go by, which never
+	// overlap.
+	for (; fs->sample < PI_SAMPLES; fs->sample++)
+	{
+		from = sample_offset(fs->length, fs->sample);
+		to = from + PI_SAMPLE_BYTES;
+		if (from >= end)
+			break;
+		if (from < fs->pos)
+			from = fs->pos;
+		SHA1Update(&fs->ctx, buf + (from - fs->pos),
+			(to < end ? to : end) - from);
+		if (to > end)
+			break;
+	}
+	fs->pos = end;
+}
+
+void pi_fp_final(struct pi_fpsum *fs, unsigned char *fp)
+{
+	SHA1Final(fp, &fs->ctx);
+}
+
+int pi_fingerprint(int fd, long long length, unsigned char *fp)
+{
+	struct pi_fpsum fs;
+	unsigned char *buf;
+	long long offset;
+	int ix, n;
+	int ret = 0;
+
+	buf = xm(1, PI_SAMPLE_BYTES);
+	pi_fp_init(&fs, length);
+	if (length <= PI_WHOLE_LENGTH)
+	{
+		for (offset = 0; offset < length && ret == 0; offset += n)
+		{
+			n = length - offset < PI_SAMPLE_BYTES
+				? length - offset : PI_SAMPLE_BYTES;
+			ret = pread_fully(fd, buf, n, offset);
+			pi_fp_update(&fs, buf, n);
+		}
+	}
+	else
+	{
+		// Only the sampled blocks, which pi_fp_update() takes as
+		// if everything in between had gone by.
+		for (ix = 0; ix < PI_SAMPLES && ret == 0; ix++)
+		{
+			offset = sample_offset(length, ix);
+			ret = pread_fully(fd, buf, PI_SAMPLE_BYTES, offset);
+			fs.pos = offset;
+			pi_fp_update(&fs, buf, PI_SAMPLE_BYTES);
+		}
+	}
+	pi_fp_final(&fs, fp);
+	free(buf);
+	return ret;
+}
+
+// Put the file at p, in torrent tr's record, in the hash table if its
+// pieces could be reused.
+static void add_known(struct pieceindex *pi, const struct torrent_rec *tr,
+	off_t p)
+{
+	const unsigned char *f = pi->map + p;
+	struct known *k;
+	long long offset, length;
+	int *old;
+	int ix, b;
+
+	offset = get(f, 8);
+	length = get(f + 8, 8);
+	if (!f[16] || offset % tr->piece_bytes != 0
+		|| length < tr->piece_bytes || offset / tr->piece_bytes
+		+ length / tr->piece_bytes > tr->npieces)
+	{
+		return;
+	}
+
+	XPND(pi->known, pi->nknown, pi->sknown);
+	k = &pi->known[pi->nknown];
+	k->length = length;
+	k->piece_bytes = tr->piece_bytes;
+	k->fp = p + 17;
+	k->digests = tr->digests + offset / tr->piece_bytes
+		* SHA1_DIGEST_LENGTH;
+	b = get(f + 17, 4) & (pi->nbuckets - 1);
+	k->next = pi->buckets[b];
+	pi->buckets[b] = pi->nknown++;
+
+	if (pi->nknown <= 2 * pi->nbuckets)
+		return;
+
+	// Spread them over twice as many buckets.
+	old = pi->buckets;
+	pi->nbuckets *= 2;
+	pi->buckets = xm(sizeof pi->buckets[0], pi->nbuckets);
+	for (b = 0; b < pi->nbuckets; b++)
+		pi->buckets[b] = -1;
+	for (ix = 0; ix < pi->nknown; ix++)
+	{
+		k = &pi->known[ix];
+		b = get(pi->map + k->fp, 4) & (pi->nbuckets - 1);
+		k->next = pi->buckets[b];
+		pi->buckets[b] = ix;
+	}
+	free(old);
+}
+
+// Make sense of the record at pi->end, returning how long it is, or 0 if
+// it isn't a whole, sound one.
+static off_t read_record(struct pieceindex *pi)
+{
+	const unsigned char *r = pi->map + pi->end;
+	struct torrent_rec tr;
+	off_t left = pi->maplen - pi->end;
+	off_t len, p, end;
+	unsigned long long pathlen, namelen;
+	int ix;
+
+	if (left < RECORD_HEAD)
+		return 0;
+	len = get(r, 4) + 4;
+	if (len < RECORD_HEAD || len > left)
+		return 0;
+	end = pi->end + len;
+
+	tr.hash = pi->end + 4;
+	tr.piece_bytes = get(r + 4 + SHA1_DIGEST_LENGTH, 4);
+	tr.npieces = get(r + 8 + SHA1_DIGEST_LENGTH, 4);
+	tr.nfiles = get(r + 12 + SHA1_DIGEST_LENGTH, 4);
+	pathlen = get(r + 16 + SHA1_DIGEST_LENGTH, 4);
+	tr.path = pi->end + RECORD_HEAD;
+	tr.digests = tr.path + pathlen;
+	tr.files = tr.digests + (off_t)tr.npieces * SHA1_DIGEST_LENGTH;
+	if (tr.piece_bytes <= 0 || tr.npieces < 0 || tr.nfiles < 0
+		|| pathlen < 1 || pathlen > (unsigned long long)len
+		|| tr.files > end || pi->map[tr.digests - 1] != '\0')
+	{
+		return 0;
+	}
+
+	p = tr.files;
+	for (ix = 0; ix < tr.nfiles; ix++)
+	{
+		if (end - p < FILE_HEAD)
+			return 0;
+		namelen = get(pi->map + p + FILE_HEAD - 4, 4);
+		if (namelen < 1 || namelen > (unsigned long long)(end - p
+			- FILE_HEAD) || pi->map[p + FILE_HEAD + namelen - 1]
+			!= '\0')
+		{
+			return 0;
+		}
+		p += FILE_HEAD + namelen;
+	}
+	if (p != end)
+		return 0;
+
+	p = tr.files;
+	for (ix = 0; ix < tr.nfiles; ix++)
+	{
+		add_known(pi, &tr, p);
+		p += FILE_HEAD + get(pi->map + p + FILE_HEAD - 4, 4);
+	}
+	XPND(pi->torrents, pi->ntorrents, pi->storrents);
+	pi->torrents[pi->ntorrents++] = tr;
+	return len;
+}
+
+// Map whatever has been added to the file since it was last looked at,
+// and take in its records. Returns -1 with errno set on error.
+static int catch_up(struct pieceindex *pi)
+{
+	struct stat sb;
+	void *map;
+	off_t len;
+
+	if (fstat(pi->fd, &sb) == -1)
+		return -1;
+	if (sb.st_size == pi->maplen)
+		return 0;
+	if (sb.st_size < pi->end)
+	{
+		errno = EINVAL;		// cut short by something else
+		return -1;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, pi->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	if (pi->map != NULL)
+		munmap(pi->map, pi->maplen);
+	pi->map = map;
+	pi->maplen = sb.st_size;
+
+	while ((len = read_record(pi)) > 0)
+		pi->end += len;
+	return 0;
+}
+
+struct pieceindex *pi_open(const char *path, int create)
+{
+	struct pieceindex *pi;
+	unsigned char magic[MAGIC_LEN];
+	int saved;
+	int ix;
+
+	pi = xm(sizeof *pi, 1);
+	pi->fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+	if (pi->fd == -1)
+	{
+		free(pi);
+		return NULL;
+	}
+	pi->map = NULL;
+	pi->maplen = 0;
+	pi->end = MAGIC_LEN;
+	pi->torrents = NULL;
+	pi->ntorrents = pi->storrents = 0;
+	pi->known = NULL;
+	pi->nknown = pi->sknown = 0;
+	pi->nbuckets = MIN_BUCKETS;
+	pi->buckets = xm(sizeof pi->buckets[0], pi->nbuckets);
+	for (ix = 0; ix < pi->nbuckets; ix++)
+		pi->buckets[ix] = -1;
+	pi->pieces = NULL;
+	pi->npieces = pi->spieces = 0;
+	pi->piece_buckets = NULL;
+	pi->npiece_buckets = 0;
+	pi->nindexed = 0;
+	pthread_mutex_init(&pi->lock, NULL);
+
+	// Whoever gets there first writes the header.
+	if (create && (flock(pi->fd, LOCK_EX) == -1
+		|| (lseek(pi->fd, 0, SEEK_END) == 0 && pwrite_fully(pi->fd,
+		MAGIC, MAGIC_LEN, 0) == -1)))
+	{
+		goto fail;
+	}
+	if (pread_fully(pi->fd, magic, MAGIC_LEN, 0) == -1
+		|| memcmp(magic, MAGIC, MAGIC_LEN) != 0)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+	if (catch_up(pi) == -1)
+		goto fail;
+	if (create)
+		flock(pi->fd, LOCK_UN);
+	return pi;
+
+fail:
+	saved = errno;
+	pi_close(pi);
+	errno = saved;
+	return NULL;
+}
+
+void pi_close(struct pieceindex *pi)
+{
+	if (pi->map != NULL)
+		munmap(pi->map, pi->maplen);
+	close(pi->fd);
+	pthread_mutex_destroy(&pi->lock);
+	free(pi->torrents);
+	free(pi->known);
+	free(pi->buckets);
+	free(pi->pieces);
+	free(pi->piece_buckets);
+	free(pi);
+}
+
+struct pi_entry *pi_entry_new(int piece_bytes, int npieces,
+	const unsigned char *digests)
+{
+	struct pi_entry *e;
+
+	e = xm(sizeof *e, 1);
+	e->piece_bytes = piece_bytes;
+	e->npieces = npieces;
+	e->digests = xm(SHA1_DIGEST_LENGTH, npieces + 1);
+	memcpy(e->digests, digests, (size_t)npieces * SHA1_DIGEST_LENGTH);
+	e->files = NULL;
+	e->len = e->size = 0;
+	e->nfiles = 0;
+	return e;
+}
+
+void pi_entry_free(struct pi_entry *e)
+{
+	if (e == NULL)
+		return;
+	free(e->digests);
+	free(e->files);
+	free(e);
+}
+
+void pi_entry_file(struct pi_entry *e, const char *dir, const char *name,
+	long long offset, long long length, const unsigned char *fp)
+{
+	unsigned char *f;
+	size_t dirlen = dir != NULL ? strlen(dir) + 1 : 0;
+	size_t namelen = dirlen + strlen(name) + 1;
+
+	if (e->len + FILE_HEAD + namelen > e->size)
+	{
+		e->size = (e->len + FILE_HEAD + namelen) * 2;
+		e->files = xr(e->files, 1, e->size);
+	}
+	f = e->files + e->len;
+	put(f, offset, 8);
+	put(f + 8, length, 8);
+	f[16] = fp != NULL;
+	if (fp != NULL)
+		memcpy(f + 17, fp, PI_FINGERPRINT_LENGTH);
+	else
+		memset(f + 17, 0, PI_FINGERPRINT_LENGTH);
+	put(f + FILE_HEAD - 4, namelen, 4);
+	f += FILE_HEAD;
+	if (dir != NULL)
+	{
+		memcpy(f, dir, dirlen - 1);
+		f[dirlen - 1] = '/';
+	}
+	strcpy((char *)f + dirlen, name);
+	e->len += FILE_HEAD + namelen;
+	e->nfiles++;
+}
+
+// Is the torrent at path with info_hash in the index? Returns 0 if so,
+// or -1 if not.
+static int find_torrent(struct pieceindex *pi, const char *path,
+	const unsigned char *info_hash)
+{
+	const struct torrent_rec *tr;
+	int ix;
+
+	for (ix = 0; ix < pi->ntorrents; ix++)
+	{
+		tr = &pi->torrents[ix];
+		if (memcmp(pi->map + tr->hash, info_hash,
+			SHA1_DIGEST_LENGTH) == 0
+			&& strcmp((const char *)pi->map + tr->path, path) == 0)
+		{
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int pi_add(struct pieceindex *pi, const struct pi_entry *e,
+	const char *path, const unsigned char *info_hash)
+{
+	unsigned char *r;
+	size_t pathlen = strlen(path) + 1;
+	size_t len;
+	int saved;
+	int ret = -1;
+
+	len = RECORD_HEAD + pathlen
+		+ (size_t)e->npieces * SHA1_DIGEST_LENGTH + e->len;
+	if (len - 4 > 0xffffffffUL)
+	{
+		errno = EFBIG;
+		return -1;
+	}
+	r = xm(1, len);
+	put(r, len - 4, 4);
+	memcpy(r + 4, info_hash, SHA1_DIGEST_LENGTH);
+	put(r + 4 + SHA1_DIGEST_LENGTH, e->piece_bytes, 4);
+	put(r + 8 + SHA1_DIGEST_LENGTH, e->npieces, 4);
+	put(r + 12 + SHA1_DIGEST_LENGTH, e->nfiles, 4);
+	put(r + 16 + SHA1_DIGEST_LENGTH, pathlen, 4);
+	memcpy(r + RECORD_HEAD, path, pathlen);
+	memcpy(r + RECORD_HEAD + pathlen, e->digests,
+		(size_t)e->npieces * SHA1_DIGEST_LENGTH);
+	memcpy(r + len - e->len, e->files, e->len);
+
+	// Other processes may have added records since; take them in, so
+	// that this one goes after the last of them, over anything left
+	// by one that didn't finish.
+	// A torrent already there, made again, is left as it is.
+	pthread_mutex_lock(&pi->lock);
+	if (flock(pi->fd, LOCK_EX) == 0)
+	{
+		if (catch_up(pi) == 0 && (ret = find_torrent(pi, path,
+			info_hash)) == -1 && (pi->maplen == pi->end
+			|| ftruncate(pi->fd, pi->end) == 0)
+			&& pwrite_fully(pi->fd, r, len, pi->end) == 0)
+		{
+			ret = catch_up(pi);
+		}
+		saved = errno;
+		flock(pi->fd, LOCK_UN);
+		errno = saved;
+	}
+	pthread_mutex_unlock(&pi->lock);
+	free(r);
+	return ret;
+}
+
+int pi_find_file(struct pieceindex *pi, int piece_bytes, long long length,
+	const unsigned char *fp, unsigned char *digests)
+{
+	const struct known *k;
+	int ix;
+	int ret = -1;
+
+	pthread_mutex_lock(&pi->lock);
+	ix = pi->buckets[get(fp, 4) & (pi->nbuckets - 1)];
+	for (; ix != -1; ix = k->next)
+	{
+		k = &pi->known[ix];
+		if (k->length == length && k->piece_bytes == piece_bytes
+			&& memcmp(pi->map + k->fp, fp,
+			PI_FINGERPRINT_LENGTH) == 0)
+		{
+			memcpy(digests, pi->map + k->digests, length
+				/ piece_bytes * SHA1_DIGEST_LENGTH);
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pi->lock);
+	return ret;
+}
+
+// Fill in a match for torrent tr's file at p.
+static void match(struct pieceindex *pi, const struct torrent_rec *tr,
+	off_t p, int piece, struct pi_match *m)
+{
+	m->torrent = (const char *)pi->map + tr->path;
+	m->info_hash = pi->map + tr->hash;
+	m->file = (const char *)pi->map + p + FILE_HEAD;
+	m->piece = piece;
+}
+
+// Report each file of tr that the piece overlaps.
+static int piece_files(struct pieceindex *pi, const struct torrent_rec *tr,
+	int piece, pi_found_fn found, void *arg)
+{
+	struct pi_match m;
+	long long start = (long long)piece * tr->piece_bytes;
+	long long end = start + tr->piece_bytes;
+	long long offset, length;
+	off_t p = tr->files;
+	int ix;
+	int n = 0;
+
+	for (ix = 0; ix < tr->nfiles; ix++)
+	{
+		offset = get(pi->map + p, 8);
+		length = get(pi->map + p + 8, 8);
+		if (length > 0 && offset < end && offset + length > start)
+		{
+			match(pi, tr, p, piece, &m);
+			found(arg, &m);
+			n++;
+		}
+		p += FILE_HEAD + get(pi->map + p + FILE_HEAD - 4, 4);
+	}
+	return n;
+}
+
+static const unsigned char *piece_digest(const struct pieceindex *pi,
+	const struct piece_ref *r)
+{
+	return pi->map + pi->torrents[r->torrent].digests
+		+ (off_t)r->piece * SHA1_DIGEST_LENGTH;
+}
+
+// Bring the table of pieces by digest up to date with the torrents read
+// so far. Its chains are linked afresh, last piece first, so that each
+// runs in the order the torrents were added.
+static void index_pieces(struct pieceindex *pi)
+{
+	const struct torrent_rec *tr;
+	struct piece_ref *r;
+	int ix, piece, b;
+
+	if (pi->piece_buckets != NULL && pi->nindexed == pi->ntorrents)
+		return;
+	for (; pi->nindexed < pi->ntorrents; pi->nindexed++)
+	{
+		tr = &pi->torrents[pi->nindexed];
+		for (piece = 0; piece < tr->npieces; piece++)
+		{
+			XPND(pi->pieces, pi->npieces, pi->spieces);
+			r = &pi->pieces[pi->npieces++];
+			r->torrent = pi->nindexed;
+			r->piece = piece;
+		}
+	}
+
+	if (pi->npiece_buckets < MIN_BUCKETS)
+		pi->npiece_buckets = MIN_BUCKETS;
+	while (pi->npieces > 2 * pi->npiece_buckets)
+		pi->npiece_buckets *= 2;
+	free(pi->piece_buckets);
+	pi->piece_buckets = xm(sizeof pi->piece_buckets[0],
+		pi->npiece_buckets);
+	for (b = 0; b < pi->npiece_buckets; b++)
+		pi->piece_buckets[b] = -1;
+	for (ix = pi->npieces - 1; ix >= 0; ix--)
+	{
+		r = &pi->pieces[ix];
+		b = get(piece_digest(pi, r), 4) & (pi->npiece_buckets - 1);
+		r->next = pi->piece_buckets[b];
+		pi->piece_buckets[b] = ix;
+	}
+}
+
+int pi_lookup_piece(struct pieceindex *pi, const unsigned char *digest,
+	pi_found_fn found, void *arg)
+{
+	const struct piece_ref *r;
+	int ix;
+	int n = 0;
+
+	pthread_mutex_lock(&pi->lock);
+	index_pieces(pi);
+	ix = pi->piece_buckets[get(digest, 4) & (pi->npiece_buckets - 1)];
+	for (; ix != -1; ix = r->next)
+	{
+		r = &pi->pieces[ix];
+		if (memcmp(piece_digest(pi, r), digest,
+			SHA1_DIGEST_LENGTH) == 0)
+		{
+			n += piece_files(pi, &pi->torrents[r->torrent],
+				r->piece, found, arg);
+		}
+	}
+	pthread_mutex_unlock(&pi->lock);
+	return n;
+}
+
+int pi_lookup_file(struct pieceindex *pi, long long length,
+	const unsigned char *fp, pi_found_fn found, void *arg)
+{
+	const struct torrent_rec *tr;
+	struct pi_match m;
+	const unsigned char *f;
+	off_t p;
+	int ix, file;
+	int n = 0;
+
+	pthread_mutex_lock(&pi->lock);
+	for (ix = 0; ix < pi->ntorrents; ix++)
+	{
+		tr = &pi->torrents[ix];
+		p = tr->files;
+		for (file = 0; file < tr->nfiles; file++)
+		{
+			f = pi->map + p;
+			if (f[16] && (long long)get(f + 8, 8) == length
+				&& memcmp(f + 17, fp,
+				PI_FINGERPRINT_LENGTH) == 0)
+			{
+				match(pi, tr, p, -1, &m);
+				found(arg, &m);
+				n++;
+			}
+			p += FILE_HEAD + get(f + FILE_HEAD - 4, 4);
+		}
+	}
+	pthread_mutex_unlock(&pi->lock);
+	return n;
+}
@@ -0,0 +1,97 @@
+// An index of the pieces and files of every torrent made, so that among
+// many thousands of torrents, the ones holding a piece or a file's content
+// can be found, and files hashed for one torrent can be checked against
+// it when they're hashed for the next.
+//
+// It's kept in a file that only ever grows: a header, then a record for
+// each torrent with its piece digests and files, appended whole under an
+// flock() so that several processes can add to it at once. A record left
+// half written by a crash is cut off when the next one is added. The file
+// is memory-mapped for reading.
+//
+// Files are known by their length and a fingerprint, the SHA-1 of the
+// length and of the whole file if it's small, or of blocks spread through
+// it if not. A file changed in place without its length or the sampled
+// blocks changing keeps its fingerprint, so a match only makes a file a
+// candidate, whose digests have to be checked against its data.
+
+#include "sha1lib.h"
+
+#define PI_FINGERPRINT_LENGTH 20
+
+// Files up to PI_WHOLE_LENGTH bytes are fingerprinted whole; longer ones
+// by PI_SAMPLES blocks of PI_SAMPLE_BYTES, the first at the start and the
+// last at the end.
+#define PI_WHOLE_LENGTH (1024 * 1024)
+#define PI_SAMPLES 16
+#define PI_SAMPLE_BYTES 4096
+
+struct pieceindex;
+
+// Open the index at path, creating it if it doesn't exist and create is
+// set. Without create, the index is only looked things up in. Returns
+// NULL with errno set on error, or EINVAL for a file that isn't an index.
+// May be shared by any number of threads.
+struct pieceindex *pi_open(const char *path, int create);
+void pi_close(struct pieceindex *pi);
+
+// Work out the fingerprint of a file of length bytes open as fd. Returns
+// -1 with errno set if it can't be read, or EIO if it's shorter.
+int pi_fingerprint(int fd, long long length, unsigned char *fp);
+
+// Work out the same fingerprint from a file's data as it's read in, from
+// start to end with nothing left out, so it needn't be read again.
+struct pi_fpsum
+{
+	SHA1_CTX ctx;
+	long long length;
+	long long pos;		// how much has gone by
+	int sample;		// the next block to take from a long file
+};
+
+void pi_fp_init(struct pi_fpsum *fs, long long length);
+void pi_fp_update(struct pi_fpsum *fs, const unsigned char *buf, int len);
+void pi_fp_final(struct pi_fpsum *fs, unsigned char *fp);
+
+// A torrent, gathered up to be added once it's been written. Digests are
+// copied.
+struct pi_entry *pi_entry_new(int piece_bytes, int npieces,
+	const unsigned char *digests);
+void pi_entry_free(struct pi_entry *e);
+
+// Add a file, named dir/name in the torrent (or name, if dir is NULL),
+// starting offset bytes into its data. fp is the fingerprint, or NULL
+// if it's not known.
+void pi_entry_file(struct pi_entry *e, const char *dir, const char *name,
+	long long offset, long long length, const unsigned char *fp);
+
+// Add e, the torrent written to path with info_hash, to the index.
+// Returns -1 with errno set on error.
+int pi_add(struct pieceindex *pi, const struct pi_entry *e,
+	const char *path, const unsigned char *info_hash);
+
+// Look for a file with the given length and fingerprint that started at a
+// piece boundary in a torrent with pieces of piece_bytes, copying the
+// digests of its length / piece_bytes whole pieces to digests. Returns -1
+// if there isn't one.
+int pi_find_file(struct pieceindex *pi, int piece_bytes, long long length,
+	const unsigned char *fp, unsigned char *digests);
+
+struct pi_match
+{
+	const char *torrent;	// the path it was written to
+	const unsigned char *info_hash;
+	const char *file;	// within the torrent, after its name
+	int piece;		// for pieces, which one; otherwise -1
+};
+
+typedef void (*pi_found_fn)(void *arg, const struct pi_match *m);
+
+// Call found for each file in each torrent that the piece with digest
+// overlaps, or that has the given length and fingerprint, returning how
+// many times it was called. Pieces are found through a hash table by
+// digest, made on the first piece lookup.
+int pi_lookup_piece(struct pieceindex *pi, const unsigned char *digest,
+	pi_found_fn found, void *arg);
+int pi_lookup_file(struct pieceindex *pi, long long length,
+	const unsigned char *fp, pi_found_fn found, void *arg);
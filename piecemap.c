@@ -0,0 +1,482 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "xm.h"
+#include "sha1lib.h"
+#include "hashq.h"
+#include "timing.h"
+#include "bufpool.h"
+#include "piecemap.h"
+
+// A piece that has had some, but not all, of its bytes filled in.
+struct pending
+{
+	int index;		// piece number, or -1 if the slot is empty
+	int filled;		// bytes committed so far
+	unsigned char *buf;
+};
+
+struct piecemap
+{
+	int piece_bytes;
+	long long total_bytes;
+	int npieces;
+
+	unsigned char *digests;	// npieces * SHA1_DIGEST_LENGTH
+	unsigned char *done;	// bitmap of pieces with digests
+	int maxpieces;		// room in digests and done
+
+	// Completed pieces are handed off here to be hashed.
+	struct hashq *hq;
+
+	// Several readers may fill in pieces at once. The lock only
+	// covers the table and pool; the bytes in a pending piece's buffer
+	// are written without it, since each range has only one reader.
+	pthread_mutex_t lock;
+
+	// Piece buffers come from here, borrowed from the caller. When it
+	// runs dry, readers wait for the hashing stage to give some back.
+	struct bufpool *pool;
+	pthread_cond_t returned;
+	int inflight;		// pieces handed to the hashing stage
+	int nreaders;		// readers still running
+	int nwaiting;		// ... of which, waiting for a buffer
+	int overcommitted;
+	int nhashed;		// pieces the hashing stage is done with
+
+	// Open-addressed hash table of pending pieces, keyed by piece
+	// number. When reading in torrent order there is only ever one
+	// pending piece, but reading in some other order can leave a
+	// piece at each file boundary waiting for its other parts.
+	struct pending *tab;
+	int ntab, stab;		// used, allocated (always a power of 2)
+
+	struct pm_stats stats;
+};
+
+struct piecemap *pm_new(int piece_bytes, long long total_bytes,
+	struct hashq *hq, struct bufpool *pool)
+{
+	struct piecemap *pm;
+	int ix;
+
+	assert(piece_bytes > 0);
+
+	pm = xm(sizeof *pm, 1);
+	pm->piece_bytes = piece_bytes;
+	pm->total_bytes = total_bytes;
+	pm->npieces = (total_bytes + piece_bytes - 1) / piece_bytes;
+	pm->maxpieces = pm->npieces + 1;
+	pm->digests = xm(SHA1_DIGEST_LENGTH, pm->maxpieces);
+	pm->done = xm(1, (pm->maxpieces + 7) / 8);
+	memset(pm->done, 0, (pm->maxpieces + 7) / 8);
+	pm->hq = hq;
+	pthread_mutex_init(&pm->lock, NULL);
+
+	pm->pool = pool;
+	pthread_cond_init(&pm->returned, NULL);
+	pm->inflight = 0;
+	pm->nreaders = 1;
+	pm->nwaiting = 0;
+	pm->overcommitted = 0;
+	pm->nhashed = 0;
+	memset(&pm->stats, 0, sizeof pm->stats);
+
+	pm->ntab = 0;
+	pm->stab = 16;
+	pm->tab = xm(sizeof pm->tab[0], pm->stab);
+	for (ix = 0; ix < pm->stab; ix++)
+	{
+		pm->tab[ix].index = -1;
+		pm->tab[ix].buf = NULL;
+	}
+
+	return pm;
+}
+
+void pm_free(struct piecemap *pm)
+{
+	int ix;
+
+	assert(pm->inflight == 0);
+	for (ix = 0; ix < pm->stab; ix++)
+	{
+		if (pm->tab[ix].buf != NULL)
+			bp_put(pm->pool, pm->tab[ix].buf);
+	}
+	free(pm->tab);
+	free(pm->digests);
+	free(pm->done);
+	pthread_cond_destroy(&pm->returned);
+	pthread_mutex_destroy(&pm->lock);
+	free(pm);
+}
+
+static int piece_len(const struct piecemap *pm, int index)
+{
+	if (index == pm->npieces - 1)
+		return pm->total_bytes - (long long)index * pm->piece_bytes;
+	return pm->piece_bytes;
+}
+
+// Find the table slot for a piece, which may be empty.
+static struct pending *lookup(const struct piecemap *pm, int index)
+{
+	unsigned int h;
+	unsigned int mask = pm->stab - 1;
+
+	h = ((unsigned int)index * 2654435761U) & mask;
+	while (pm->tab[h].index != -1 && pm->tab[h].index != index)
+		h = (h + 1) & mask;
+	return &pm->tab[h];
+}
+
+static void grow(struct piecemap *pm)
+{
+	struct pending *old = pm->tab;
+	int sold = pm->stab;
+	int ix;
+
+	pm->stab *= 2;
+	pm->tab = xm(sizeof pm->tab[0], pm->stab);
+	for (ix = 0; ix < pm->stab; ix++)
+	{
+		pm->tab[ix].index = -1;
+		pm->tab[ix].buf = NULL;
+	}
+
+	for (ix = 0; ix < sold; ix++)
+	{
+		if (old[ix].index != -1)
+			*lookup(pm, old[ix].index) = old[ix];
+	}
+	free(old);
+}
+
+// Remove an entry, shifting back later entries in its probe run so that
+// lookups never stop early at the hole.
+static void remove_pending(struct piecemap *pm, struct pending *p)
+{
+	unsigned int mask = pm->stab - 1;
+	unsigned int hole = p - pm->tab;
+	unsigned int ix = hole;
+	unsigned int home;
+
+	for (;;)
+	{
+		ix = (ix + 1) & mask;
+		if (pm->tab[ix].index == -1)
+			break;
+		home = ((unsigned int)pm->tab[ix].index * 2654435761U)
+			& mask;
+		// Move the entry into the hole unless its home slot lies
+		// cyclically within (hole, ix].
+		if (((ix - home) & mask) >= ((ix - hole) & mask))
+		{
+			pm->tab[hole] = pm->tab[ix];
+			hole = ix;
+		}
+	}
+	pm->tab[hole].index = -1;
+	pm->tab[hole].buf = NULL;
+	pm->ntab--;
+}
+
+void pm_readers(struct piecemap *pm, int nreaders)
+{
+	pthread_mutex_lock(&pm->lock);
+	pm->nreaders = nreaders;
+	pthread_mutex_unlock(&pm->lock);
+}
+
+void pm_reader_exit(struct piecemap *pm)
+{
+	pthread_mutex_lock(&pm->lock);
+	pm->nreaders--;
+	pthread_cond_broadcast(&pm->returned);
+	pthread_mutex_unlock(&pm->lock);
+}
+
+void pm_reader_resume(struct piecemap *pm)
+{
+	pthread_mutex_lock(&pm->lock);
+	pm->nreaders++;
+	pthread_mutex_unlock(&pm->lock);
+}
+
+// Get a piece buffer from the pool, waiting for one to come back if the
+// memory limit has been reached. The lock must be held.
+//
+// If nothing is being hashed and every other reader is waiting too, the
+// buffers are all tied up in partly filled pieces that will never be
+// completed, so go over the limit rather than deadlock.
+static unsigned char *get_buffer(struct piecemap *pm)
+{
+	unsigned char *buf;
+	double start = 0;
+
+	while ((buf = bp_get(pm->pool)) == NULL)
+	{
+		if (pm->inflight == 0 && pm->nwaiting + 1 >= pm->nreaders)
+		{
+			pm->overcommitted = 1;
+			buf = bp_force(pm->pool);
+			break;
+		}
+		if (start == 0)
+			start = wall_time();
+		pm->nwaiting++;
+		pthread_cond_wait(&pm->returned, &pm->lock);
+		pm->nwaiting--;
+	}
+	if (start != 0)
+		pm->stats.buffer_stall += wall_time() - start;
+	return buf;
+}
+
+void pm_resize(struct piecemap *pm, long long total_bytes)
+{
+	int npieces;
+	int oldbytes;
+	int ix;
+
+	npieces = (total_bytes + pm->piece_bytes - 1) / pm->piece_bytes;
+
+	pthread_mutex_lock(&pm->lock);
+	if (npieces > pm->maxpieces)
+	{
+		// The hashing stage writes straight into the digests, so
+		// it has to be finished with them before they can move.
+		while (pm->inflight > 0)
+			pthread_cond_wait(&pm->returned, &pm->lock);
+		oldbytes = (pm->maxpieces + 7) / 8;
+		pm->maxpieces *= 2;
+		if (pm->maxpieces < npieces)
+			pm->maxpieces = npieces;
+		pm->digests = xr(pm->digests, SHA1_DIGEST_LENGTH,
+			pm->maxpieces);
+		pm->done = xr(pm->done, 1, (pm->maxpieces + 7) / 8);
+		memset(pm->done + oldbytes, 0,
+			(pm->maxpieces + 7) / 8 - oldbytes);
+	}
+
+	// Drop any pieces started past the new end.
+	for (ix = 0; ix < pm->stab; ix++)
+	{
+		while (pm->tab[ix].index >= npieces)
+		{
+			bp_put(pm->pool, pm->tab[ix].buf);
+			remove_pending(pm, &pm->tab[ix]);
+		}
+	}
+
+	pm->total_bytes = total_bytes;
+	pm->npieces = npieces;
+	pthread_mutex_unlock(&pm->lock);
+}
+
+unsigned char *pm_slot(struct piecemap *pm, long long offset, int *len)
+{
+	struct pending *p;
+	unsigned char *buf;
+	int index;
+	int pos;
+	int plen;
+
+	assert(offset >= 0 && offset < pm->total_bytes);
+
+	index = offset / pm->piece_bytes;
+	pos = offset % pm->piece_bytes;
+	plen = piece_len(pm, index);
+
+	if (*len > plen - pos)
+		*len = plen - pos;
+
+	pthread_mutex_lock(&pm->lock);
+	p = lookup(pm, index);
+	if (p->index == -1)
+	{
+		buf = get_buffer(pm);
+
+		// Another reader may have started the piece while we
+		// waited; either way the table may have changed.
+		p = lookup(pm, index);
+		if (p->index != -1)
+			bp_put(pm->pool, buf);
+		else
+		{
+			if ((pm->ntab + 1) * 2 > pm->stab)
+			{
+				grow(pm);
+				p = lookup(pm, index);
+			}
+			p->index = index;
+			p->filled = 0;
+			p->buf = buf;
+			pm->ntab++;
+			if (pm->ntab > pm->stats.max_pending)
+				pm->stats.max_pending = pm->ntab;
+			if (pm->ntab + pm->inflight > pm->stats.max_buffers)
+			{
+				pm->stats.max_buffers = pm->ntab
+					+ pm->inflight;
+			}
+		}
+	}
+	buf = p->buf;
+	pthread_mutex_unlock(&pm->lock);
+
+	return &buf[pos];
+}
+
+// Called by the hashing stage when it's done with a piece.
+static void return_piece(void *arg, unsigned char *buf,
+	unsigned char *digest, double cpu)
+{
+	struct piecemap *pm = arg;
+	int index;
+
+	pthread_mutex_lock(&pm->lock);
+	index = (digest - pm->digests) / SHA1_DIGEST_LENGTH;
+	pm->done[index / 8] |= 1 << index % 8;
+	bp_put(pm->pool, buf);
+	pm->stats.hash_cpu += cpu;
+	pm->nhashed++;
+	pm->inflight--;
+	pthread_cond_broadcast(&pm->returned);
+	pthread_mutex_unlock(&pm->lock);
+}
+
+void pm_commit(struct piecemap *pm, long long offset, int len)
+{
+	struct pending *p;
+	unsigned char *buf = NULL;
+	double stall = 0;
+	int index;
+	int plen;
+	int depth;
+
+	index = offset / pm->piece_bytes;
+	plen = piece_len(pm, index);
+
+	pthread_mutex_lock(&pm->lock);
+	p = lookup(pm, index);
+	assert(p->index == index);
+
+	p->filled += len;
+	assert(p->filled <= plen);
+
+	if (p->filled == plen)
+	{
+		buf = p->buf;
+		remove_pending(pm, p);
+		pm->inflight++;
+		pm->stats.pieces++;
+		pm->stats.hash_bytes += plen;
+	}
+	pthread_mutex_unlock(&pm->lock);
+
+	if (buf != NULL)
+	{
+		depth = hq_submit(pm->hq, buf, plen,
+			&pm->digests[(size_t)index * SHA1_DIGEST_LENGTH],
+			return_piece, pm, &stall);
+
+		pthread_mutex_lock(&pm->lock);
+		pm->stats.queue_stall += stall;
+		if (depth > pm->stats.max_queue)
+			pm->stats.max_queue = depth;
+		pthread_mutex_unlock(&pm->lock);
+	}
+}
+
+void pm_wait(struct piecemap *pm)
+{
+	pthread_mutex_lock(&pm->lock);
+	while (pm->inflight > 0)
+		pthread_cond_wait(&pm->returned, &pm->lock);
+	pthread_mutex_unlock(&pm->lock);
+}
+
+int pm_npieces(const struct piecemap *pm)
+{
+	return pm->npieces;
+}
+
+// Pieces are all the same length except the last, so this is exact
+// unless the last piece is done before some others.
+long long pm_hashed(struct piecemap *pm)
+{
+	long long ret;
+
+	pthread_mutex_lock(&pm->lock);
+	ret = (long long)pm->nhashed * pm->piece_bytes;
+	if (ret > pm->total_bytes)
+		ret = pm->total_bytes;
+	pthread_mutex_unlock(&pm->lock);
+	return ret;
+}
+
+void pm_preset(struct piecemap *pm, int index, const unsigned char *digest)
+{
+	pthread_mutex_lock(&pm->lock);
+	memcpy(&pm->digests[(size_t)index * SHA1_DIGEST_LENGTH], digest,
+		SHA1_DIGEST_LENGTH);
+	pm->done[index / 8] |= 1 << index % 8;
+	pthread_mutex_unlock(&pm->lock);
+}
+
+int pm_done(struct piecemap *pm, int index)
+{
+	int ret;
+
+	pthread_mutex_lock(&pm->lock);
+	ret = pm->done[index / 8] >> index % 8 & 1;
+	pthread_mutex_unlock(&pm->lock);
+	return ret;
+}
+
+void pm_done_map(struct piecemap *pm, unsigned char *map)
+{
+	pthread_mutex_lock(&pm->lock);
+	memcpy(map, pm->done, (pm->npieces + 7) / 8);
+	pthread_mutex_unlock(&pm->lock);
+}
+
+int pm_pending(struct piecemap *pm)
+{
+	int ret;
+
+	pthread_mutex_lock(&pm->lock);
+	ret = pm->ntab;
+	pthread_mutex_unlock(&pm->lock);
+	return ret;
+}
+
+const unsigned char *pm_digests(const struct piecemap *pm)
+{
+	return pm->digests;
+}
+
+const char *pm_buffer_mode(const struct piecemap *pm)
+{
+	return bp_mode(pm->pool);
+}
+
+int pm_overcommitted(struct piecemap *pm)
+{
+	int ret;
+
+	pthread_mutex_lock(&pm->lock);
+	ret = pm->overcommitted;
+	pthread_mutex_unlock(&pm->lock);
+	return ret;
+}
+
+void pm_stats(struct piecemap *pm, struct pm_stats *st)
+{
+	pthread_mutex_lock(&pm->lock);
+	*st = pm->stats;
+	pthread_mutex_unlock(&pm->lock);
+}
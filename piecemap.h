@@ -0,0 +1,83 @@
+// A piece map collects torrent data that may arrive in any order
+// and hands each piece to the hashing stage once all of its bytes are
+// present. Pieces may be filled in from several threads at once.
+
+struct piecemap;
+struct hashq;
+struct bufpool;
+
+// Piece buffers come from pool, which must have buffers of at least
+// piece_bytes. It belongs to the caller, who may keep it for reuse.
+struct piecemap *pm_new(int piece_bytes, long long total_bytes,
+	struct hashq *hq, struct bufpool *pool);
+void pm_free(struct piecemap *pm);
+
+// Tell the piece map how many reader threads are filling it in, and when
+// each one finishes, so it can tell when waiting for a buffer would never
+// end. A reader pausing for a while counts as finished, then calls
+// pm_reader_resume() when it carries on.
+void pm_readers(struct piecemap *pm, int nreaders);
+void pm_reader_exit(struct piecemap *pm);
+void pm_reader_resume(struct piecemap *pm);
+
+// Change the length of the data, for input whose length isn't known
+// ahead of time. Any pieces started past the new end are dropped. Must not
+// be called while a reader is between pm_slot() and pm_commit().
+void pm_resize(struct piecemap *pm, long long total_bytes);
+
+// Get a pointer to where the data at offset should be stored. *len is the
+// number of bytes wanted on entry, and is reduced so the range does not
+// cross a piece boundary. May block until a piece buffer is free.
+unsigned char *pm_slot(struct piecemap *pm, long long offset, int *len);
+
+// Mark len bytes at offset as filled in, after writing them via pm_slot().
+void pm_commit(struct piecemap *pm, long long offset, int len);
+
+// Wait for the hashing stage to finish with every completed piece. The
+// hashing stage may be shared with other piece maps, so this only waits
+// for this one's pieces.
+void pm_wait(struct piecemap *pm);
+
+int pm_npieces(const struct piecemap *pm);
+
+// How many bytes the hashing stage has finished with so far. Safe to call
+// from any thread.
+long long pm_hashed(struct piecemap *pm);
+
+// Fill in the digest of a piece hashed some other time, such as before an
+// interrupted run was resumed. Readers should then skip its data.
+void pm_preset(struct piecemap *pm, int index, const unsigned char *digest);
+
+// Does a piece have its digest yet?
+int pm_done(struct piecemap *pm, int index);
+
+// Copy out a bitmap of the pieces with digests, piece 0 being the lowest
+// bit of the first byte, in (pm_npieces() + 7) / 8 bytes.
+void pm_done_map(struct piecemap *pm, unsigned char *map);
+int pm_pending(struct piecemap *pm);
+
+// The SHA-1 digests of all pieces, in order. Only valid once every byte
+// has been committed and the hashing stage has finished.
+const unsigned char *pm_digests(const struct piecemap *pm);
+
+// Describe what kind of pages the piece buffers were allocated from.
+const char *pm_buffer_mode(const struct piecemap *pm);
+
+// Did the buffer limit have to be exceeded to avoid deadlock?
+int pm_overcommitted(struct piecemap *pm);
+
+// Counters kept as the piece map is filled in. Stall times are summed
+// over the readers, and hashing time over the hashing threads.
+struct pm_stats
+{
+	double buffer_stall;	// readers waiting for a free piece buffer
+	double queue_stall;	// ... for room in the hashing queue
+	double hash_cpu;	// CPU time spent hashing pieces
+	long long hash_bytes;
+	int pieces;		// handed to the hashing stage
+	int max_queue;		// most pieces queued for hashing at once
+	int max_pending;	// most partly filled pieces at once
+	int max_buffers;	// most piece buffers in use at once
+};
+
+void pm_stats(struct piecemap *pm, struct pm_stats *st);
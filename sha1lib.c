@@ -73,7 +73,9 @@ A million repetitions of "a"
   34AA973C D4C4DAA4 F61EEB2B DBAD2731 6534016F
 */
 
-/* #define SHA1HANDSOFF  */
+/* The input must be left alone: the same piece buffers feed the per-file
+   checksums too. */
+#define SHA1HANDSOFF
 
 #include <stdio.h>
 #include <string.h>
@@ -129,8 +131,8 @@ void SHA1Transform(uint32 state[5], const unsigned char buffer[64])
   } CHAR64LONG16;
   CHAR64LONG16* block;
 #ifdef SHA1HANDSOFF
-  static unsigned char workspace[64];
-  block = (CHAR64LONG16*)workspace;
+  CHAR64LONG16 workspace;  /* not static: several threads hash at once */
+  block = &workspace;
   memcpy(block, buffer, 64);
 #else
   block = (CHAR64LONG16*)buffer;
@@ -218,19 +220,26 @@ void SHA1Update(SHA1_CTX *context, const unsigned char *data, uint32 len)	/* JHB
 /* Add padding and return the message digest. */
 
 void SHA1Final(unsigned char digest[SHA1_DIGEST_LENGTH], SHA1_CTX *context) {
-  uint32 i;	/* JHB */
+  uint32 i, j;	/* JHB */
   unsigned char finalcount[8];
   
   for (i = 0; i < 8; i++) {
 	finalcount[i] = (unsigned char)((context->count[(i >= 4 ? 0 : 1)]
 									 >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
   }
-  SHA1Update(context, (unsigned char *)"\200", 1);
-  while ((context->count[0] & 504) != 448) {
-	SHA1Update(context, (unsigned char *)"\0", 1);
+  /* Pad in place in the buffer, rather than a byte at a time through
+     SHA1Update(): 0x80, zeros up to the last 8 bytes of a block (taking
+     another block if there isn't room), then the bit count. */
+  j = (context->count[0] >> 3) & 63;
+  context->buffer[j++] = 0x80;
+  if (j > 56) {
+	memset(&context->buffer[j], 0, 64 - j);
+	SHA1Transform(context->state, context->buffer);
+	j = 0;
   }
-  SHA1Update(context, finalcount, 8);  /* Should cause a SHA1Transform()
-										*/
+  memset(&context->buffer[j], 0, 56 - j);
+  memcpy(&context->buffer[56], finalcount, 8);
+  SHA1Transform(context->state, context->buffer);
   for (i = 0; i < SHA1_DIGEST_LENGTH; i++) {
 	digest[i] = (unsigned char)
 	  ((context->state[i>>2] >> ((3-(i & 3)) * 8) ) & 255);
@@ -241,19 +250,37 @@ void SHA1Final(unsigned char digest[SHA1_DIGEST_LENGTH], SHA1_CTX *context) {
   memset(context->state, 0, 20);
   memset(context->count, 0, 8);
   memset(finalcount, 0, 8);	/* SWR */
-#ifdef SHA1HANDSOFF  /* make SHA1Transform overwrite it's own static vars */
-  SHA1Transform(context->state, context->buffer);
-#endif
 }
 
 void SHA1Data(unsigned char digest[SHA1_DIGEST_LENGTH],
 	const unsigned char *data, uint32 len)
 {
 	SHA1_CTX context;
+	uint32 whole = len & ~(uint32)63;
+	uint32 i;
 
+	// All in one go: whole blocks are hashed where they lie, and only the
+	// tail is copied, for SHA1Final() to pad.
 	SHA1Init(&context);
-	SHA1Update(&context, data, len);
-	return SHA1Final(digest, &context);
+	for (i = 0; i < whole; i += 64)
+		SHA1Transform(context.state, &data[i]);
+	context.count[0] = len << 3;
+	context.count[1] = len >> 29;
+	memcpy(context.buffer, &data[whole], len - whole);
+	SHA1Final(digest, &context);
+}
+
+void SHA1UpdateLarge(SHA1_CTX *context, const unsigned char *data,
+	unsigned long len)
+{
+	uint32 n;
+
+	// SHA1Update() counts in 32 bits, so feed it a gigabyte at a time.
+	for (; len > 0; data += n, len -= n)
+	{
+		n = len < (1UL << 30) ? (uint32)len : (uint32)1 << 30;
+		SHA1Update(context, data, n);
+	}
 }
 
 /*************************************************************/
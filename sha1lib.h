@@ -26,7 +26,11 @@ typedef struct {
 
 void SHA1Init(SHA1_CTX *context);
 void SHA1Update(SHA1_CTX *context, const unsigned char *data, uint32 len);	/* JHB */
+/* SHA1Update() for any amount at once, such as a whole torrent. */
+void SHA1UpdateLarge(SHA1_CTX *context, const unsigned char *data,
+	unsigned long len);
 void SHA1Final(unsigned char digest[SHA1_DIGEST_LENGTH], SHA1_CTX *context);
+/* The digest of len bytes all in memory at once, such as a whole piece. */
 void SHA1Data(unsigned char digest[SHA1_DIGEST_LENGTH],
 	const unsigned char *data, uint32 len);
 
@@ -0,0 +1,145 @@
+#include <string.h>
+#include "sha256.h"
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define s1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static const uint32_t K[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16
+		| (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void transform(uint32_t state[8], const unsigned char block[64])
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	uint32_t t1, t2;
+	int ix;
+
+	for (ix = 0; ix < 16; ix++)
+		w[ix] = get_be32(block + 4 * ix);
+	for (; ix < 64; ix++)
+		w[ix] = s1(w[ix - 2]) + w[ix - 7] + s0(w[ix - 15]) + w[ix - 16];
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (ix = 0; ix < 64; ix++)
+	{
+		t1 = h + S1(e) + CH(e, f, g) + K[ix] + w[ix];
+		t2 = S0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const unsigned char *data,
+	size_t len)
+{
+	size_t used = ctx->count % 64;
+	size_t n;
+
+	ctx->count += len;
+
+	if (used > 0)
+	{
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buffer + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		transform(ctx->state, ctx->buffer);
+	}
+
+	for (; len >= 64; data += 64, len -= 64)
+		transform(ctx->state, data);
+	memcpy(ctx->buffer, data, len);
+}
+
+void sha256_final(unsigned char digest[SHA256_DIGEST_LENGTH],
+	struct sha256_ctx *ctx)
+{
+	static const unsigned char pad[64] = { 0x80 };
+	unsigned char bits[8];
+	uint64_t nbits = ctx->count * 8;
+	size_t used = ctx->count % 64;
+	int ix;
+
+	put_be32(bits, nbits >> 32);
+	put_be32(bits + 4, nbits);
+	sha256_update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+	sha256_update(ctx, bits, 8);
+
+	for (ix = 0; ix < 8; ix++)
+		put_be32(digest + 4 * ix, ctx->state[ix]);
+}
@@ -0,0 +1,19 @@
+// SHA-256, as described in FIPS 180-4.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+struct sha256_ctx
+{
+	uint32_t state[8];
+	uint64_t count;		// bytes hashed so far
+	unsigned char buffer[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const unsigned char *data,
+	size_t len);
+void sha256_final(unsigned char digest[SHA256_DIGEST_LENGTH],
+	struct sha256_ctx *ctx);
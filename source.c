@@ -0,0 +1,75 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "xm.h"
+#include "diag.h"
+#include "source.h"
+
+struct file_handle
+{
+	char *path;		// the file open, or NULL
+	int fd;
+};
+
+static void *file_open(void *arg, struct diag *d)
+{
+	struct file_handle *fh;
+
+	(void)arg;
+	(void)d;
+	fh = xm(sizeof *fh, 1);
+	fh->path = NULL;
+	fh->fd = -1;
+	return fh;
+}
+
+static int file_read(void *handle, const char *path, long long offset,
+	unsigned char *buf, int len, struct diag *d)
+{
+	struct file_handle *fh = handle;
+	ssize_t ret;
+
+	if (fh->path == NULL || strcmp(fh->path, path) != 0)
+	{
+		if (fh->path != NULL)
+		{
+			close(fh->fd);
+			free(fh->path);
+			fh->path = NULL;
+		}
+		fh->fd = open(path, O_RDONLY);
+		if (fh->fd == -1)
+			return diag_err(d, "cannot open %s", path);
+		fh->path = xsd(path);
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fh->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+
+	do
+		ret = pread(fh->fd, buf, len, offset);
+	while (ret == -1 && errno == EINTR);
+	if (ret == -1)
+		return diag_err(d, "error reading %s", path);
+	return ret;
+}
+
+static void file_close(void *handle)
+{
+	struct file_handle *fh = handle;
+
+	if (fh->path != NULL)
+	{
+		close(fh->fd);
+		free(fh->path);
+	}
+	free(fh);
+}
+
+const struct source file_source =
+{
+	NULL, NULL, file_open, file_read, file_close
+};
@@ -0,0 +1,26 @@
+// Where a torrent's data is read from, when it isn't files to be opened by
+// name one after another: any part of any file can be read, by several
+// reader threads at once, each with a handle of its own.
+
+struct diag;
+
+struct source
+{
+	void *arg;
+	const char *name;	// where it reads from, or NULL for files
+
+	// A handle for one reader to read with, or NULL with an error in
+	// d.
+	void *(*open)(void *arg, struct diag *d);
+
+	// Read up to len bytes from offset in the file at path, returning
+	// how many, 0 if it ends first, or -1 with an error in d.
+	int (*read)(void *handle, const char *path, long long offset,
+		unsigned char *buf, int len, struct diag *d);
+
+	void (*close)(void *handle);
+};
+
+// Local files, with each handle keeping the last one it read open, for
+// reading parts of one big file such as an archive.
+extern const struct source file_source;
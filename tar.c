@@ -0,0 +1,547 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "xm.h"
+#include "diag.h"
+#include "ignore.h"
+#include "filelist.h"
+#include "tar.h"
+
+#define BLOCK 512
+
+// The biggest GNU long name or pax extended header that will be read.
+#define MAX_META (1024 * 1024)
+
+// Where things are in a header.
+#define NAME_FIELD 0
+#define NAME_LEN 100
+#define SIZE_FIELD 124
+#define MTIME_FIELD 136
+#define NUM_LEN 12
+#define CHKSUM_FIELD 148
+#define CHKSUM_LEN 8
+#define TYPE_FIELD 156
+#define LINK_FIELD 157
+#define LINK_LEN 100
+#define MAGIC_FIELD 257
+#define PREFIX_FIELD 345
+#define PREFIX_LEN 155
+
+struct reader
+{
+	struct tarlist *tl;
+	const char *path;
+	FILE *fp;
+	long long size;		// of the whole archive
+	long long pos;		// of the header being looked at
+
+	// What the entries before this header (GNU long names or a pax
+	// extended header) say about it, or NULL and -1 for nothing.
+	char *name, *link;
+	long long length, mtime;
+};
+
+// Read a number field: octal digits, padded with spaces or NULs, or for
+// ones too big for that, a binary number after a byte with the top bit
+// set. Returns -1 if it's neither.
+static long long number(const unsigned char *p, int len)
+{
+	long long v = 0;
+	int ix = 0;
+
+	if (p[0] & 0x80)
+	{
+		// Negative numbers mean nothing here.
+		if (p[0] & 0x40)
+			return -1;
+		v = p[0] & 0x3f;
+		for (ix = 1; ix < len; ix++)
+		{
+			if (v > LLONG_MAX >> 8)
+				return -1;
+			v = v << 8 | p[ix];
+		}
+		return v;
+	}
+
+	while (ix < len && p[ix] == ' ')
+		ix++;
+	for (; ix < len && p[ix] >= '0' && p[ix] <= '7'; ix++)
+	{
+		if (v > LLONG_MAX >> 3)
+			return -1;
+		v = v << 3 | (p[ix] - '0');
+	}
+	if (ix < len && p[ix] != ' ' && p[ix] != '\0')
+		return -1;
+	return v;
+}
+
+// The checksum is of the header with the checksum field taken as spaces,
+// its bytes summed as unsigned, or as signed by some old tars.
+static int checksum_ok(const unsigned char *h)
+{
+	long long want;
+	long long sum = 0, ssum = 0;
+	int ix;
+
+	want = number(h + CHKSUM_FIELD, CHKSUM_LEN);
+	for (ix = 0; ix < BLOCK; ix++)
+	{
+		if (ix >= CHKSUM_FIELD && ix < CHKSUM_FIELD + CHKSUM_LEN)
+		{
+			sum += ' ';
+			ssum += ' ';
+		}
+		else
+		{
+			sum += h[ix];
+			ssum += (signed char)h[ix];
+		}
+	}
+	return want == sum || want == ssum;
+}
+
+// Copy a field, which is NUL-terminated unless it fills all len bytes.
+static char *field(const unsigned char *p, int len)
+{
+	char *s;
+	int n = 0;
+
+	while (n < len && p[n] != '\0')
+		n++;
+	s = xm(1, n + 1);
+	memcpy(s, p, n);
+	s[n] = '\0';
+	return s;
+}
+
+// The member's name as a path within the archive, without "." or empty
+// components. Returns NULL for a name going up with "..", which
+// extracting it shouldn't allow.
+static char *tidy(const char *name)
+{
+	char *out;
+	const char *p, *end;
+	size_t len = 0;
+
+	out = xm(1, strlen(name) + 1);
+	for (p = name; *p != '\0'; p = *end == '\0' ? end : end + 1)
+	{
+		end = strchr(p, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		if (end == p || (end - p == 1 && p[0] == '.'))
+			continue;
+		if (end - p == 2 && p[0] == '.' && p[1] == '.')
+		{
+			free(out);
+			return NULL;
+		}
+		if (len > 0)
+			out[len++] = '/';
+		memcpy(out + len, p, end - p);
+		len += end - p;
+	}
+	out[len] = '\0';
+	return out;
+}
+
+// Read the len bytes of data following the current header.
+static char *read_meta(struct reader *r, long long len)
+{
+	char *buf;
+
+	if (len > MAX_META)
+	{
+		diag_errx(r->tl->diag, "%s has a header too big to read at "
+			"offset %lld", r->path, r->pos);
+		return NULL;
+	}
+	buf = xm(1, len + 1);
+	r->tl->nreads++;
+	if (fread(buf, 1, len, r->fp) != (size_t)len)
+	{
+		diag_err(r->tl->diag, "error reading %s", r->path);
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+// Take the path, size and modification time from a pax extended header,
+// made of records like "30 path=some/long/file/name\n".
+static int read_pax(struct reader *r, long long len)
+{
+	char *buf;
+	char *p, *end, *key, *value, *eq;
+	long long n;
+
+	buf = read_meta(r, len);
+	if (buf == NULL)
+		return -1;
+
+	for (p = buf; p < buf + len; p += n)
+	{
+		n = strtoll(p, &key, 10);
+		if (n <= 0 || n > buf + len - p || *key != ' '
+			|| p[n - 1] != '\n')
+		{
+			free(buf);
+			return diag_errx(r->tl->diag, "%s has a bad pax "
+				"header at offset %lld", r->path, r->pos);
+		}
+		key++;
+		end = p + n - 1;
+		eq = memchr(key, '=', end - key);
+		if (eq == NULL)
+			continue;
+		*eq = '\0';
+		*end = '\0';
+		value = eq + 1;
+
+		if (strcmp(key, "path") == 0)
+		{
+			free(r->name);
+			r->name = xsd(value);
+		}
+		else if (strcmp(key, "linkpath") == 0)
+		{
+			free(r->link);
+			r->link = xsd(value);
+		}
+		else if (strcmp(key, "size") == 0)
+			r->length = strtoll(value, NULL, 10);
+		else if (strcmp(key, "mtime") == 0)
+			r->mtime = strtoll(value, NULL, 10);
+	}
+	free(buf);
+	return 0;
+}
+
+// Add the file the current header is for, whose data is length bytes at
+// start.
+static void add_member(struct reader *r, const unsigned char *h,
+	long long start, long long length, long long mtime)
+{
+	struct tarlist *tl = r->tl;
+	struct tar_member *m;
+	char *raw, *name;
+	char *prefix;
+
+	if (r->name != NULL)
+		raw = xsd(r->name);
+	else
+	{
+		raw = field(h + NAME_FIELD, NAME_LEN);
+
+		// POSIX ustar puts long names' directories in the prefix.
+		if (memcmp(h + MAGIC_FIELD, "ustar", 6) == 0
+			&& h[PREFIX_FIELD] != '\0')
+		{
+			prefix = field(h + PREFIX_FIELD, PREFIX_LEN);
+			name = xm(1, strlen(prefix) + 1 + strlen(raw) + 1);
+			sprintf(name, "%s/%s", prefix, raw);
+			free(prefix);
+			free(raw);
+			raw = name;
+		}
+	}
+
+	name = tidy(raw);
+	if (name == NULL)
+	{
+		diag_warnx(tl->diag, "skipping %s in %s, which would be "
+			"extracted outside of it", raw, r->path);
+	}
+	else if (name[0] == '\0')
+		free(name);
+	else
+	{
+		XPND(tl->members, tl->n, tl->s);
+		m = &tl->members[tl->n++];
+		m->name = name;
+		m->length = length;
+		m->start = start;
+		m->mtime = mtime;
+		m->header = r->pos;
+	}
+	free(raw);
+}
+
+// A hard link is extracted as a copy of the file it links to, which must
+// have come before it.
+static void add_link(struct reader *r, const unsigned char *h,
+	long long mtime)
+{
+	struct tarlist *tl = r->tl;
+	char *raw, *target;
+	int ix = -1;
+
+	raw = r->link != NULL ? xsd(r->link) : field(h + LINK_FIELD, LINK_LEN);
+	target = tidy(raw);
+	if (target != NULL)
+	{
+		for (ix = tl->n - 1; ix >= 0; ix--)
+		{
+			if (strcmp(tl->members[ix].name, target) == 0)
+				break;
+		}
+	}
+
+	if (ix == -1)
+	{
+		diag_warnx(tl->diag, "skipping a hard link to %s in %s, "
+			"which isn't one of the files in it", raw, r->path);
+	}
+	else
+	{
+		add_member(r, h, tl->members[ix].start,
+			tl->members[ix].length, mtime);
+	}
+	free(target);
+	free(raw);
+}
+
+// Look at the header at r->pos, moving r->pos past the entry. Returns 1 at
+// the end of the archive.
+static int read_entry(struct reader *r)
+{
+	struct tarlist *tl = r->tl;
+	unsigned char h[BLOCK];
+	long long length, mtime;
+	long long next;
+	size_t got;
+	int type;
+	char *name;
+	int meta = 0;
+	int ix;
+
+	tl->nreads += 2;
+	if (fseeko(r->fp, r->pos, SEEK_SET) == -1)
+		return diag_err(tl->diag, "cannot seek in %s", r->path);
+	got = fread(h, 1, BLOCK, r->fp);
+	if (got < BLOCK && ferror(r->fp))
+		return diag_err(tl->diag, "error reading %s", r->path);
+
+	// It should end with two blocks of zeros, but some tars leave
+	// them off.
+	if (got == 0)
+		return 1;
+	if (got < BLOCK)
+		return diag_errx(tl->diag, "%s is cut short", r->path);
+	for (ix = 0; ix < BLOCK && h[ix] == 0; ix++)
+		;
+	if (ix == BLOCK)
+		return 1;
+
+	tl->nheaders++;
+	if (!checksum_ok(h))
+	{
+		return diag_errx(tl->diag, "%s isn't a tar archive, or is "
+			"damaged at offset %lld", r->path, r->pos);
+	}
+
+	type = h[TYPE_FIELD];
+	length = r->length != -1 ? r->length
+		: number(h + SIZE_FIELD, NUM_LEN);
+	mtime = r->mtime != -1 ? r->mtime : number(h + MTIME_FIELD, NUM_LEN);
+	if (length < 0 || mtime < 0)
+	{
+		return diag_errx(tl->diag, "%s has a bad header at offset "
+			"%lld", r->path, r->pos);
+	}
+
+	// Directories and links have no data of their own, whatever
+	// their size says.
+	if (type == '1' || type == '2' || type == '5')
+		length = 0;
+	if (length > r->size - r->pos - BLOCK)
+		return diag_errx(tl->diag, "%s is cut short", r->path);
+	next = r->pos + BLOCK + (length + BLOCK - 1) / BLOCK * BLOCK;
+
+	if (type == 'L')	// GNU long name of the next entry
+	{
+		free(r->name);
+		r->name = read_meta(r, length);
+		if (r->name == NULL)
+			return -1;
+		meta = 1;
+	}
+	else if (type == 'x')	// pax extended header for the next entry
+	{
+		if (read_pax(r, length) == -1)
+			return -1;
+		meta = 1;
+	}
+	else if (type == 'K')	// GNU long link name of the next entry
+	{
+		free(r->link);
+		r->link = read_meta(r, length);
+		if (r->link == NULL)
+			return -1;
+		meta = 1;
+	}
+	else if (type == 'g')	// global pax header
+		meta = 1;
+	else if (type == '0' || type == '\0' || type == '7')
+		add_member(r, h, r->pos + BLOCK, length, mtime);
+	else if (type == '1')
+		add_link(r, h, mtime);
+	else if (type != '5')
+	{
+		name = r->name != NULL ? xsd(r->name)
+			: field(h + NAME_FIELD, NAME_LEN);
+		diag_warnx(tl->diag, "skipping %s in %s, which isn't a "
+			"regular file (type %c)", name, r->path, type);
+		free(name);
+	}
+
+	if (!meta)
+	{
+		free(r->name);
+		free(r->link);
+		r->name = r->link = NULL;
+		r->length = r->mtime = -1;
+	}
+	r->pos = next;
+	return 0;
+}
+
+// Find the directory every member is in, if there is one.
+static int top_dir(const struct tarlist *tl)
+{
+	const char *slash;
+	int len;
+	int ix;
+
+	if (tl->n == 0)
+		return 0;
+	slash = strchr(tl->members[0].name, '/');
+	if (slash == NULL)
+		return 0;
+	len = slash - tl->members[0].name;
+	for (ix = 1; ix < tl->n; ix++)
+	{
+		if (strncmp(tl->members[ix].name, tl->members[0].name,
+			len + 1) != 0)
+		{
+			return 0;
+		}
+	}
+	return len;
+}
+
+static int membercmp(const struct tar_member *m1, const struct tar_member *m2,
+	int (*cmp)(const void *, const void *))
+{
+	int ret;
+
+	ret = cmp(&m1->name, &m2->name);
+	if (ret != 0)
+		return ret;
+	return m1->header < m2->header ? -1 : m1->header > m2->header;
+}
+
+static int namecmp(const void *one, const void *two)
+{
+	return membercmp(one, two, mystrcmp);
+}
+
+static int extcmp(const void *one, const void *two)
+{
+	return membercmp(one, two, extstrcmp);
+}
+
+int gettarlist(struct tarlist *tl, const char *path, int sort_by_ext,
+	const struct ignore *ig, struct diag *d)
+{
+	struct reader r;
+	struct stat sb;
+	int ix, n;
+	int ret;
+
+	tl->members = NULL;
+	tl->n = tl->s = 0;
+	tl->toplen = 0;
+	tl->nheaders = tl->nreads = 0;
+	tl->diag = d;
+
+	r.tl = tl;
+	r.path = path;
+	r.pos = 0;
+	r.name = r.link = NULL;
+	r.length = r.mtime = -1;
+	r.fp = fopen(path, "rb");
+	tl->nreads++;
+	if (r.fp == NULL)
+		return diag_err(d, "cannot open %s", path);
+	if (fstat(fileno(r.fp), &sb) == -1 || !S_ISREG(sb.st_mode))
+	{
+		fclose(r.fp);
+		return diag_errx(d, "%s isn't a tar archive", path);
+	}
+	r.size = sb.st_size;
+
+	while ((ret = read_entry(&r)) == 0)
+		;
+	free(r.name);
+	free(r.link);
+	fclose(r.fp);
+	if (ret == -1)
+	{
+		freetarlist(tl);
+		return -1;
+	}
+
+	// Patterns are matched from the top of what would be torrentized.
+	tl->toplen = top_dir(tl);
+	n = 0;
+	for (ix = 0; ix < tl->n; ix++)
+	{
+		if (ig != NULL && ignore_path(ig, tl->members[ix].name
+			+ (tl->toplen > 0 ? tl->toplen + 1 : 0)))
+		{
+			free(tl->members[ix].name);
+			continue;
+		}
+		tl->members[n++] = tl->members[ix];
+	}
+	tl->n = n;
+
+	if (tl->n == 0)
+		return 0;
+	qsort(tl->members, tl->n, sizeof tl->members[0],
+		sort_by_ext ? extcmp : namecmp);
+
+	// Where a name comes up more than once, the later copy is the one
+	// extracting the archive would leave.
+	n = 0;
+	for (ix = 0; ix < tl->n; ix++)
+	{
+		if (ix + 1 < tl->n && strcmp(tl->members[ix].name,
+			tl->members[ix + 1].name) == 0)
+		{
+			free(tl->members[ix].name);
+			continue;
+		}
+		tl->members[n++] = tl->members[ix];
+	}
+	tl->n = n;
+	return 0;
+}
+
+void freetarlist(struct tarlist *tl)
+{
+	int ix;
+
+	for (ix = 0; ix < tl->n; ix++)
+		free(tl->members[ix].name);
+	free(tl->members);
+	tl->members = NULL;
+	tl->n = tl->s = 0;
+}
@@ -0,0 +1,44 @@
+// Listing the files in a tar archive, so a torrent can be made of what it
+// holds without extracting it. Only the headers are read; each member's
+// data is left in the archive, at the offset given.
+
+struct diag;
+struct ignore;
+
+struct tar_member
+{
+	char *name;		// path within the archive, tidied up
+	long long length;
+	long long start;	// of its data within the archive
+	long long mtime;
+	long long header;	// where it's listed in the archive
+};
+
+// The regular files in an archive, in the order getfilelist() would put
+// them in once extracted.
+struct tarlist
+{
+	struct tar_member *members;
+	int n, s;
+
+	// If every member is in one directory, the length of its name,
+	// or else 0.
+	int toplen;
+
+	// What it took to find them.
+	long long nheaders;	// headers looked at
+	long long nreads;	// read and seek calls
+
+	struct diag *diag;
+};
+
+// Understands POSIX ustar and pax archives and GNU tar's long names.
+// Entries matching ig are left out, along with everything in ignored
+// directories, with paths matched from within the top directory, if
+// there is one, as getfilelist() on it would. A name that appears more
+// than once is taken from the last copy, and a hard link as a copy of the
+// file it links to, as extracting the archive would leave them. Symbolic
+// links and the like are skipped with a warning.
+int gettarlist(struct tarlist *tl, const char *path, int sort_by_ext,
+	const struct ignore *ig, struct diag *d);
+void freetarlist(struct tarlist *tl);
@@ -0,0 +1,39 @@
+#!/bin/sh
+# A file changed in place since it was indexed, without its length or the
+# blocks sampled for its fingerprint changing, still matches the index.
+# With -x, the torrent made from it must have the digests of what's on
+# disk now, the same as one made without the index, and it must be warned
+# about. Run by "./build test".
+set -e
+tz=${TORRENTIZE:-./torrentize}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Four megabytes, so its fingerprint is of sampled blocks, none of them
+# anywhere near the 100000th byte.
+head -c 4194304 /dev/urandom >"$dir/data"
+"$tz" -q -b 256 -X "$dir/index" -o "$dir/before.torrent" http://tr/a \
+	"$dir/data"
+
+printf 'changed' | dd of="$dir/data" bs=1 seek=100000 conv=notrunc \
+	2>/dev/null
+"$tz" -q -b 256 -o "$dir/fresh.torrent" http://tr/a "$dir/data"
+"$tz" -q -b 256 -X "$dir/index" -x -o "$dir/reused.torrent" http://tr/a \
+	"$dir/data" 2>"$dir/log"
+
+if cmp -s "$dir/before.torrent" "$dir/fresh.torrent"
+then
+	echo "reuse: the change didn't change the torrent" >&2
+	exit 1
+fi
+if ! cmp -s "$dir/fresh.torrent" "$dir/reused.torrent"
+then
+	echo "reuse: -x kept digests of the old data" >&2
+	exit 1
+fi
+if ! grep -q 'has changed since it was indexed' "$dir/log"
+then
+	echo "reuse: no warning about the changed file" >&2
+	exit 1
+fi
+echo "reuse: ok"
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "xm.h"
+#include "timing.h"
+#include "throttle.h"
+
+// How far ahead of the limits reading may get after a lull, in seconds.
+#define BURST_SECS 0.1
+
+// CPU use is judged over at least this many seconds.
+#define CPU_WINDOW_SECS 1.0
+
+// How often adaptive mode decides whether to back off, in seconds.
+#define ADAPT_SECS 1.0
+
+// Reads taking this many times longer than usual may mean contention...
+#define LATENCY_BUSY 3.0
+
+// ... if tasks were also waiting on I/O for this share of the time.
+#define PRESSURE_BUSY 0.1
+
+// Weights for the recent and long-run averages of read times.
+#define LATENCY_RECENT 0.2
+#define LATENCY_USUAL 0.01
+
+// Never back off below this many bytes a second.
+#define MIN_ADAPT_RATE (1024 * 1024)
+
+#define PRESSURE_FILE "/proc/pressure/io"
+
+struct throttle
+{
+	pthread_mutex_t lock;
+
+	// The limits, with max_rate and max_iops as seconds per byte and
+	// per read, and cpu_share as a fraction of one CPU (0 for none).
+	double byte_cost, op_cost;
+	double cpu_share;
+	int adaptive;
+
+	// When the next read can go ahead, by each bucket.
+	double byte_next, op_next;
+
+	// CPU used since the start of the current window.
+	double cpu_start, cpu_used;
+
+	// Adaptive mode: the byte rate backed off to (0 for none), and
+	// what's been seen since the last check.
+	double adapt_rate;
+	double adapt_start;
+	long long adapt_bytes;
+	double recent, usual;	// seconds per read
+	double stalled;		// I/O wait from PRESSURE_FILE, in us
+	int pressure;		// PRESSURE_FILE can be read
+};
+
+// Read the total microseconds that some task has spent waiting on I/O.
+static int read_pressure(double *total)
+{
+	FILE *fp;
+	char line[256];
+	char *p;
+	int ret = -1;
+
+	fp = fopen(PRESSURE_FILE, "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		if (strncmp(line, "some ", 5) != 0)
+			continue;
+		p = strstr(line, "total=");
+		if (p != NULL)
+		{
+			*total = strtod(p + 6, NULL);
+			ret = 0;
+		}
+		break;
+	}
+	fclose(fp);
+	return ret;
+}
+
+struct throttle *throttle_new(long long max_rate, int max_iops,
+	int cpu_share, int adaptive)
+{
+	struct throttle *th;
+	double now = wall_time();
+
+	th = xm(sizeof *th, 1);
+	pthread_mutex_init(&th->lock, NULL);
+	th->byte_cost = max_rate > 0 ? 1.0 / max_rate : 0;
+	th->op_cost = max_iops > 0 ? 1.0 / max_iops : 0;
+	th->cpu_share = cpu_share / 100.0;
+	th->adaptive = adaptive;
+	th->byte_next = th->op_next = now;
+	th->cpu_start = now;
+	th->cpu_used = cpu_share > 0 ? process_cpu_time() : 0;
+	th->adapt_rate = 0;
+	th->adapt_start = now;
+	th->adapt_bytes = 0;
+	th->recent = th->usual = 0;
+	th->pressure = adaptive && read_pressure(&th->stalled) == 0;
+	return th;
+}
+
+void throttle_free(struct throttle *th)
+{
+	pthread_mutex_destroy(&th->lock);
+	free(th);
+}
+
+// Take a read costing cost seconds out of a bucket, returning how long it
+// has to wait first.
+static double take(double *next, double now, double cost)
+{
+	double wait = *next - now;
+
+	if (*next < now - BURST_SECS)
+		*next = now - BURST_SECS;
+	*next += cost;
+	return wait > 0 ? wait : 0;
+}
+
+// Back off if the disk seems busy, or speed up again if not. th->lock must
+// be held.
+static void adapt(struct throttle *th, double now)
+{
+	double rate;
+	double stalled;
+	int busy;
+
+	rate = th->adapt_bytes / (now - th->adapt_start);
+	busy = th->usual > 0 && th->recent > LATENCY_BUSY * th->usual;
+	if (th->pressure && read_pressure(&stalled) == 0)
+	{
+		if (stalled - th->stalled
+			< PRESSURE_BUSY * (now - th->adapt_start) * 1e6)
+		{
+			busy = 0;
+		}
+		th->stalled = stalled;
+	}
+
+	if (busy)
+	{
+		if (th->adapt_rate == 0 || rate < th->adapt_rate)
+			th->adapt_rate = rate;
+		th->adapt_rate /= 2;
+		if (th->adapt_rate < MIN_ADAPT_RATE)
+			th->adapt_rate = MIN_ADAPT_RATE;
+	}
+	else if (th->adapt_rate > 0)
+	{
+		// Once reading can't keep up with the rate allowed,
+		// something else is holding it back, so stop limiting it.
+		th->adapt_rate *= 1.25;
+		if (th->adapt_rate > 4 * rate || (th->byte_cost > 0
+			&& th->adapt_rate * th->byte_cost >= 1))
+		{
+			th->adapt_rate = 0;
+		}
+	}
+
+	th->adapt_start = now;
+	th->adapt_bytes = 0;
+}
+
+double throttle_start(struct throttle *th, long long len, double *waited)
+{
+	double now = wall_time();
+	double wait = 0;
+	double cost;
+	double w;
+	double cpu;
+
+	pthread_mutex_lock(&th->lock);
+
+	if (th->adaptive)
+	{
+		if (now - th->adapt_start >= ADAPT_SECS)
+			adapt(th, now);
+		th->adapt_bytes += len;
+	}
+
+	cost = th->byte_cost;
+	if (th->adapt_rate > 0 && (cost == 0 || 1 / th->adapt_rate > cost))
+		cost = 1 / th->adapt_rate;
+	if (cost > 0 && len > 0)
+		wait = take(&th->byte_next, now, len * cost);
+	if (th->op_cost > 0)
+	{
+		w = take(&th->op_next, now, th->op_cost);
+		if (w > wait)
+			wait = w;
+	}
+
+	// Wait until the CPU used over the window is back within its
+	// share, starting a new window once it is.
+	if (th->cpu_share > 0)
+	{
+		cpu = process_cpu_time();
+		w = (cpu - th->cpu_used) / th->cpu_share
+			- (now - th->cpu_start);
+		if (w > wait)
+			wait = w;
+		else if (w <= 0 && now - th->cpu_start >= CPU_WINDOW_SECS)
+		{
+			th->cpu_start = now;
+			th->cpu_used = cpu;
+		}
+	}
+
+	pthread_mutex_unlock(&th->lock);
+
+	sleep_for(wait);
+	*waited = wait;
+	return now + wait;
+}
+
+void throttle_done(struct throttle *th, double start)
+{
+	double took;
+
+	if (!th->adaptive)
+		return;
+	took = wall_time() - start;
+
+	pthread_mutex_lock(&th->lock);
+	if (th->usual == 0)
+		th->recent = th->usual = took;
+	th->recent += LATENCY_RECENT * (took - th->recent);
+	th->usual += LATENCY_USUAL * (took - th->usual);
+	pthread_mutex_unlock(&th->lock);
+}
@@ -0,0 +1,30 @@
+// Holding back the readers, so that making a torrent can share a machine
+// with other work. Limits on bytes and reads per second are token buckets:
+// each read is let through once the bucket has room, then its cost taken
+// out, so big reads don't need a big bucket. A limit on CPU use holds
+// reads back while the process has used more than its share recently.
+//
+// In adaptive mode, the time each read takes is watched, along with the
+// time tasks spent waiting on I/O from /proc/pressure/io where there is
+// one. When reads take much longer than they have been, and the system is
+// waiting on I/O, the byte rate is halved, then raised again bit by bit
+// once things settle.
+//
+// One throttle may be used by any number of threads at once.
+
+struct throttle;
+
+// max_rate is in bytes a second, max_iops in reads a second, and
+// cpu_share in percent of one CPU; 0 means no limit.
+struct throttle *throttle_new(long long max_rate, int max_iops,
+	int cpu_share, int adaptive);
+void throttle_free(struct throttle *th);
+
+// Wait until a read of len bytes may go ahead. len is 0 for opening a
+// file, which only counts against max_iops. Returns the time (from
+// wall_time()) that the read starts, and sets *waited to how long it was
+// held back.
+double throttle_start(struct throttle *th, long long len, double *waited);
+
+// Note that the read that throttle_start() returned start for is done.
+void throttle_done(struct throttle *th, double start);
@@ -0,0 +1,48 @@
+#include <time.h>
+#include <errno.h>
+#include "timing.h"
+
+static double seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) == -1)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double wall_time(void)
+{
+	return seconds(CLOCK_MONOTONIC);
+}
+
+double thread_cpu_time(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	return seconds(CLOCK_THREAD_CPUTIME_ID);
+#else
+	return 0;
+#endif
+}
+
+double process_cpu_time(void)
+{
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+	return seconds(CLOCK_PROCESS_CPUTIME_ID);
+#else
+	return 0;
+#endif
+}
+
+void sleep_for(double secs)
+{
+	struct timespec ts;
+
+	if (secs <= 0)
+		return;
+	ts.tv_sec = secs;
+	ts.tv_nsec = (secs - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+	{
+	}
+}
@@ -0,0 +1,13 @@
+// Clocks for measuring where the time goes, in seconds.
+
+// Elapsed time from some fixed point, unaffected by changes to the date.
+double wall_time(void);
+
+// CPU time, user and system, used by the calling thread so far.
+double thread_cpu_time(void);
+
+// ... and by the whole process.
+double process_cpu_time(void);
+
+// Sleep for secs seconds, if that's more than 0.
+void sleep_for(double secs);
@@ -1,319 +1,3120 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <assert.h>
-#include "err.h"
+#include <pthread.h>
 #include "xm.h"
 #include "sha1lib.h"
+#include "diag.h"
+#include "bencode.h"
 #include "filelist.h"
+#include "hashq.h"
+#include "bufpool.h"
+#include "piecemap.h"
+#include "physaddr.h"
+#include "filesum.h"
+#include "ignore.h"
+#include "timing.h"
+#include "checkpoint.h"
+#include "throttle.h"
+#include "edit.h"
+#include "tar.h"
+#include "source.h"
+#include "http.h"
+#include "tune.h"
+#include "numa.h"
+#include "pieceindex.h"
+#include "torrent.h"
+
+#define DEFAULT_PIECESIZE 256
+
+// Files this size or smaller are read with the small-file fast path:
+// opened ahead of time relative to a cached directory fd, with readahead
+// requested, then read with a single syscall straight into the pieces.
+#define SMALL_FILE_BYTES (64 * 1024)
+
+// How many small files to open ahead of the one being read.
+#define PREFETCH_DEPTH 32
+
+// Most iovecs to pass to a single readv().
+#define MAX_IOV 16
+
+// Requests to have going at once for data on a server, by default.
+#define DEFAULT_CONNECTIONS 8
+
+// With opts.tuning, the most readers to have on one device, or
+// connections to one server.
+#define TUNE_MAX_READERS 16
+#define TUNE_MAX_CONNECTIONS 32
+
+// How often the tuner looks at how things are going, in milliseconds, and
+// how many pieces it waits to see hashed, up to TUNE_MAX_MS, so that it
+// goes by more than a few.
+#define TUNE_MS 500
+#define TUNE_PIECES 32
+#define TUNE_MAX_MS 5000
+
+// Tuning settled on over fewer intervals than this isn't remembered.
+#define TUNE_MIN_STEPS 4
+
+// Taken off the front of TORRENT_REMOTE inputs to leave the URL.
+#define REMOTE_PREFIX "s3+"
+
+// A file making up part of the torrent.
+struct tfile
+{
+	char *path;		// real filename, for reading
+	const char *name;	// name within the torrent, for display
+	long long length;
+	long long offset;	// of its first byte within the torrent data
+	long long start;	// of its data within path, for a tar member
+	dev_t dev;
+	time_t mtime;
+	unsigned long long physaddr;
+	unsigned char *sums;	// FILESUM_LEN bytes, if opts.checksums
+	unsigned char *fp;	// with opts.index, its fingerprint, or NULL
+};
+
+struct torrent
+{
+	struct torrent_opts opts;
+	int piece_bytes;
+	struct ignore *ignore;	// compiled ignore_patterns, or NULL
+
+	struct diag diag;
+
+	// The torrent being written, and its filename for diagnostic
+	// purposes.
+	struct benc out;
+	const char *outname;
+	const char *newname;
+	char *autoname;		// newname, if worked out from the input
+
+	// Where the encoded torrent goes, counted on the way through, and
+	// hashed while hashing_info is set to work out the info-hash.
+	benc_write_fn sink;
+	void *sinkarg;
+	int hashing_info;
+	SHA1_CTX info_ctx;
+	unsigned char info_hash[SHA1_DIGEST_LENGTH];
+
+	// For opts.index, what's to be added to it once the info-hash is
+	// known.
+	struct pi_entry *entry;
+
+	// For opts.fastresume, each file's length and modification time,
+	// kept from the file list.
+	long long *resume_files;
+	int nresume_files;
+	int resume_pieces;
+
+	// For torrent_create_stream(), where the data comes from, and where
+	// to copy it to (or -1).
+	int infd, teefd;
+
+	// Files in the order they appear in the torrent.
+	struct tfile *tfiles;
+	int ntfiles, stfiles;
+
+	// Total length of all files.
+	long long total_bytes;
+
+	// The hashing threads and piece buffers are kept from one torrent
+	// to the next, rather than started and allocated for each.
+	struct hashq *hq;
+	int own_hq;		// hq isn't from a shared pool
+	struct bufpool *bufs;
+	struct piecemap *pm;
+
+	// Where the readers and hashing threads run, and the piece buffers
+	// go, on a NUMA machine, or NULL.
+	const struct numa *numa;
+
+	// Number of reader threads running at once.
+	int nreaders;
+
+	// Where the data is read from, if not files opened by name: a tar
+	// archive, or a server (remote, which is freed afterwards). Readers
+	// of remote data share the pieces out between them, taking the
+	// next one not yet taken, rather than taking a run of files each.
+	const struct source *source;
+	struct source *remote;
+	int next_piece;
+	pthread_mutex_t next_lock;
+
+	// What holds the readers back, from opts.throttle, or NULL.
+	struct throttle *throttle;
+
+	// With opts.tuning, the readers of each device, and the thread
+	// deciding how many of them to let read and how many hashing
+	// threads to use.
+	struct readrun *runs;
+	int nruns;
+	struct tuner *tuner;
+	pthread_t tune_thread;
+	pthread_mutex_t tune_lock;
+	pthread_cond_t tune_stop;
+	int tune_stopping;
+
+	// Where the time went, and when writing out the torrent started.
+	struct torrent_stats stats;
+	double write_start, write_cpu;
+
+	// With opts.nshards, the pieces this shard hashes, from first_piece
+	// up to end_piece, and the file their digests go in.
+	int first_piece, end_piece;
+	char *shardname;
+
+	// Readers pass over some pieces: ones already filled in from a
+	// checkpoint or shard files, or left to other shards.
+	int skipping;
+
+	// With opts.index, readers work out each file's fingerprint, and
+	// with opts.reuse, files are looked up by it once they're hashed.
+	int fingerprints;
+	int reusing;
+	int reused_files;
+
+	// The checkpoint being kept, if any, and the thread saving it.
+	struct checkpoint *ckpt;
+	pthread_t ckpt_thread;
+	pthread_mutex_t ckpt_lock;
+	pthread_cond_t ckpt_stop;
+	int ckpt_stopping;
+
+	// How far along we are, for torrent_progress(). The lock also
+	// covers pm being replaced, and progress.done_bytes and all_bytes
+	// only include the current piece map's pieces once it's freed.
+	pthread_mutex_t progress_lock;
+	struct torrent_progress progress;
+};
+
+struct torrent_pool
+{
+	struct hashq *hq;
+};
+
+struct torrent_throttle
+{
+	struct throttle *th;
+};
+
+struct torrent_tuning
+{
+	struct tuning *tu;
+};
+
+struct torrent_index
+{
+	struct pieceindex *pi;
+};
+
+// With opts.tuning, the files on one device, or a server's pieces, shared
+// out a batch at a time between several readers. Only active of them are
+// let take more at once; the rest wait, and meanwhile don't count as
+// readers to the piece map.
+struct readrun
+{
+	struct tfile **files;
+	int nfiles;
+	int next;		// first file not yet handed out
+	int done;		// nothing more to hand out
+	int nreaders, active;
+	char dev[64];		// for the tuning cache
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+// A run of files all read by the same reader thread, or with tuning, the
+// batch of its run's files it's reading now.
+struct readgroup
+{
+	struct torrent *t;
+	struct tfile **files;
+	int nfiles;
+	pthread_t thread;
+	int node;		// the NUMA node to read on
+	struct readrun *run;	// with tuning, or NULL
+	int slot;		// which of run's readers this is
+
+	// Descriptors of small files opened ahead, indexed by file number
+	// modulo PREFETCH_DEPTH, or -1 for files not using the fast path.
+	int ahead[PREFETCH_DEPTH];
+	int nopened;
+
+	// Directory that small files were last opened relative to.
+	char *dirname;
+	int dirfd;
+
+	// For reading from t->source, once opened, or NULL.
+	void *handle;
+
+	// This reader's share of the reading stage.
+	struct torrent_stage read;
+};
+
+static void hex(char *out, const unsigned char *digest, int len)
+{
+	int ix;
+
+	for (ix = 0; ix < len; ix++)
+		sprintf(out + 2 * ix, "%02x", digest[ix]);
+}
+
+void torrent_defaults(struct torrent_opts *opts)
+{
+	memset(opts, 0, sizeof *opts);
+	opts->piece_kb = DEFAULT_PIECESIZE;
+}
+
+int torrent_numa(const char *layout)
+{
+	return numa_set(layout);
+}
+
+struct torrent_pool *torrent_pool_new(int nthreads)
+{
+	struct torrent_pool *pool;
+
+	pool = xm(sizeof *pool, 1);
+	pool->hq = hq_new(nthreads, numa_get());
+	if (pool->hq == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void torrent_pool_free(struct torrent_pool *pool)
+{
+	hq_free(pool->hq);
+	free(pool);
+}
+
+struct torrent_throttle *torrent_throttle_new(long long max_rate,
+	int max_iops, int cpu_share, int adaptive)
+{
+	struct torrent_throttle *th;
+
+	th = xm(sizeof *th, 1);
+	th->th = throttle_new(max_rate, max_iops, cpu_share, adaptive);
+	return th;
+}
+
+void torrent_throttle_free(struct torrent_throttle *th)
+{
+	throttle_free(th->th);
+	free(th);
+}
+
+struct torrent_tuning *torrent_tuning_new(const char *cache_path)
+{
+	struct torrent_tuning *tu;
+
+	tu = xm(sizeof *tu, 1);
+	tu->tu = tuning_new(cache_path);
+	return tu;
+}
+
+int torrent_tuning_save(struct torrent_tuning *tu)
+{
+	return tuning_save(tu->tu);
+}
+
+void torrent_tuning_free(struct torrent_tuning *tu)
+{
+	tuning_free(tu->tu);
+	free(tu);
+}
+
+struct torrent_index *torrent_index_open(const char *path, int create)
+{
+	struct torrent_index *ix;
+	struct pieceindex *pi;
+
+	pi = pi_open(path, create);
+	if (pi == NULL)
+		return NULL;
+	ix = xm(sizeof *ix, 1);
+	ix->pi = pi;
+	return ix;
+}
+
+void torrent_index_close(struct torrent_index *ix)
+{
+	pi_close(ix->pi);
+	free(ix);
+}
+
+// Pass a match on from the index, with its info-hash in hex.
+struct lookup
+{
+	void (*found)(void *arg, const struct torrent_index_match *m);
+	void *arg;
+};
+
+static void found_match(void *arg, const struct pi_match *pm)
+{
+	struct lookup *l = arg;
+	struct torrent_index_match m;
+	char buf[2 * SHA1_DIGEST_LENGTH + 1];
+
+	hex(buf, pm->info_hash, SHA1_DIGEST_LENGTH);
+	m.torrent = pm->torrent;
+	m.info_hash = buf;
+	m.file = pm->file;
+	m.piece = pm->piece;
+	l->found(l->arg, &m);
+}
+
+int torrent_index_lookup(struct torrent_index *ix, const char *query,
+	void (*found)(void *arg, const struct torrent_index_match *m),
+	void *arg)
+{
+	unsigned char digest[SHA1_DIGEST_LENGTH];
+	unsigned char fp[PI_FINGERPRINT_LENGTH];
+	struct lookup l;
+	struct stat sb;
+	int saved;
+	int fd;
+	int n;
+
+	l.found = found;
+	l.arg = arg;
+	if (strlen(query) == 2 * SHA1_DIGEST_LENGTH
+		&& strspn(query, "0123456789abcdefABCDEF")
+		== 2 * SHA1_DIGEST_LENGTH)
+	{
+		for (n = 0; n < SHA1_DIGEST_LENGTH; n++)
+			sscanf(query + 2 * n, "%2hhx", &digest[n]);
+		return pi_lookup_piece(ix->pi, digest, found_match, &l);
+	}
+
+	fd = open(query, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 || pi_fingerprint(fd, sb.st_size, fp) == -1)
+	{
+		saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	close(fd);
+	return pi_lookup_file(ix->pi, sb.st_size, fp, found_match, &l);
+}
+
+struct torrent *torrent_new(const struct torrent_opts *opts)
+{
+	struct torrent *t;
+
+	t = xm(sizeof *t, 1);
+	t->opts = *opts;
+	t->piece_bytes = opts->piece_kb * 1024;
+	t->ignore = opts->num_ignore_patterns > 0
+		? ignore_new(opts->ignore_patterns, opts->num_ignore_patterns)
+		: NULL;
+	diag_init(&t->diag, opts->warning, opts->cbarg);
+	t->tfiles = NULL;
+	t->ntfiles = t->stfiles = 0;
+	t->total_bytes = 0;
+	t->hq = opts->pool != NULL ? opts->pool->hq : NULL;
+	t->throttle = opts->throttle != NULL ? opts->throttle->th : NULL;
+	t->own_hq = 0;
+	t->bufs = NULL;
+	t->pm = NULL;
+	t->numa = numa_get();
+	pthread_mutex_init(&t->progress_lock, NULL);
+	pthread_mutex_init(&t->next_lock, NULL);
+	memset(&t->progress, 0, sizeof t->progress);
+	t->entry = NULL;
+	t->resume_files = NULL;
+	t->nresume_files = 0;
+	t->ckpt = NULL;
+	pthread_mutex_init(&t->ckpt_lock, NULL);
+	pthread_cond_init(&t->ckpt_stop, NULL);
+	t->runs = NULL;
+	t->nruns = 0;
+	t->tuner = NULL;
+	pthread_mutex_init(&t->tune_lock, NULL);
+	pthread_cond_init(&t->tune_stop, NULL);
+	return t;
+}
 
-static unsigned char **pieces;
-static int npieces, spieces;
+void torrent_free(struct torrent *t)
+{
+	if (t->own_hq)
+		hq_free(t->hq);
+	if (t->bufs != NULL)
+		bp_free(t->bufs);
+	if (t->ignore != NULL)
+		ignore_free(t->ignore);
+	free(t->resume_files);
+	pthread_mutex_destroy(&t->progress_lock);
+	pthread_mutex_destroy(&t->next_lock);
+	pthread_mutex_destroy(&t->ckpt_lock);
+	pthread_cond_destroy(&t->ckpt_stop);
+	pthread_mutex_destroy(&t->tune_lock);
+	pthread_cond_destroy(&t->tune_stop);
+	free(t);
+}
 
-static FILE *out;
+const char *torrent_error(const struct torrent *t)
+{
+	return t->diag.msg;
+}
 
-// Macros for writing strings and ints, bencoded, into the output file.
-#define fbenc_str(s) fprintf(out, "%d:%s", (int)strlen(s), s)
-#define fbenc_int(ll) fprintf(out, "i%llde", (long long)ll)
+const struct torrent_stats *torrent_stats(const struct torrent *t)
+{
+	return &t->stats;
+}
 
-// For raw writing into the output file.
-#define fwr(s) fputs(s, out)
+void torrent_progress(struct torrent *t, struct torrent_progress *p)
+{
+	long long hashed;
 
-// Start a list; start a dictionary; end a list or dictionary.
-#define fbenc_list fwr("l")
-#define fbenc_dict fwr("d")
-#define fbenc_end fwr("e")
+	pthread_mutex_lock(&t->progress_lock);
+	*p = t->progress;
+	if (t->pm != NULL)
+	{
+		hashed = pm_hashed(t->pm);
+		p->done_bytes = hashed;
+		p->all_bytes += hashed;
+	}
+	pthread_mutex_unlock(&t->progress_lock);
+}
 
-// The filename of the torrent we're currently writing,
-// for diagnostic purposes.
-static const char *activeoutfile;
+static void file_done(struct torrent *t)
+{
+	pthread_mutex_lock(&t->progress_lock);
+	t->progress.done_files++;
+	t->progress.all_files++;
+	pthread_mutex_unlock(&t->progress_lock);
+}
 
-static int mark_private;
-static int be_quiet;
-static int sort_by_ext;
-static int piece_bytes;
-static const char *newname;
+static void info(struct torrent *t, const char *fmt, ...)
+{
+	char buf[DIAG_LEN];
+	va_list argptr;
 
-// Length so far of the piece being constructed.
-static int thispiece_len;
+	if (!t->opts.verbose || t->opts.info == NULL)
+		return;
 
-// Piece being constructed so far.
-// Can be NULL if thispiece_len == 0.
-static unsigned char *thispiece;
+	va_start(argptr, fmt);
+	vsnprintf(buf, sizeof buf, fmt, argptr);
+	va_end(argptr);
+	t->opts.info(t->opts.cbarg, buf);
+}
 
-// Write a path as a list of the components.
-static void fbenc_path(const char *path)
+// Add a file to the list of files making up the torrent.
+static void add_tfile(struct torrent *t, char *path, const char *name,
+	const struct stat *sb)
 {
-	char *copy;
-	char *next;
-	char *p;
+	struct tfile *tf;
+
+	XPND(t->tfiles, t->ntfiles, t->stfiles);
+	tf = &t->tfiles[t->ntfiles++];
+	tf->path = path;
+	tf->name = name;
+	tf->length = sb->st_size;
+	tf->offset = t->total_bytes;
+	tf->start = 0;
+	tf->dev = sb->st_dev;
+	tf->mtime = sb->st_mtime;
+	tf->physaddr = t->opts.physical_order && t->source == NULL
+		? physical_address(path, sb) : 0;
+	tf->sums = t->opts.checksums ? xm(FILESUM_LEN, 1) : NULL;
+	tf->fp = NULL;
+
+	t->total_bytes += tf->length;
+}
 
-	p = copy = xsd(path);
+static void free_tfiles(struct torrent *t)
+{
+	int ix;
 
-	fbenc_list;
-	while ((next = strchr(p, '/')) != NULL)
+	for (ix = 0; ix < t->ntfiles; ix++)
 	{
-		*next = '\0';
-		fbenc_str(p);
-		p = next + 1;
+		free(t->tfiles[ix].path);
+		free(t->tfiles[ix].sums);
+		free(t->tfiles[ix].fp);
 	}
-	fbenc_str(p);
-	fbenc_end;
+	free(t->tfiles);
+	t->tfiles = NULL;
+	t->ntfiles = t->stfiles = 0;
+	t->total_bytes = 0;
+}
+
+static void show_adding(struct torrent *t, const struct tfile *tf)
+{
+	if (t->opts.progress != NULL)
+		t->opts.progress(t->opts.cbarg, tf->name);
+}
+
+// Wait for the throttle, if any, before a read of len bytes, or before
+// opening a file if len is 0. Returns when the read started, for
+// read_done().
+static double read_start(struct torrent *t, long long len,
+	struct torrent_stage *st)
+{
+	double waited;
+	double start;
+
+	if (t->throttle == NULL)
+		return 0;
+	start = throttle_start(t->throttle, len, &waited);
+	st->throttled += waited;
+	return start;
+}
+
+static void read_done(struct torrent *t, double start)
+{
+	if (t->throttle != NULL)
+		throttle_done(t->throttle, start);
+}
 
-	free(copy);
+// Should readers pass over a piece? Only meaningful if t->skipping.
+static int skip_piece(struct torrent *t, int index)
+{
+	return index < t->first_piece || index >= t->end_piece
+		|| pm_done(t->pm, index);
+}
+
+// Find how many of the pieces a file's data falls in are to be passed
+// over, setting *npieces to how many it falls in.
+static int pieces_done(struct torrent *t, const struct tfile *tf,
+	int *npieces)
+{
+	int first, last;
+	int ix;
+	int done = 0;
+
+	*npieces = 0;
+	if (tf->length == 0)
+		return 0;
+	first = tf->offset / t->piece_bytes;
+	last = (tf->offset + tf->length - 1) / t->piece_bytes;
+	for (ix = first; ix <= last; ix++)
+		done += skip_piece(t, ix);
+	*npieces = last - first + 1;
+	return done;
 }
 
-// Add hash of the piece being constructed in memory.
-static void add_this_piece(void)
+// Read all of len bytes from fd unless the data ends first, returning how
+// many were read, or -1 on error. The read() calls are added to *calls.
+static int read_fully(int fd, unsigned char *buf, int len, long long *calls)
 {
-	unsigned char *digest;
+	int got = 0;
+	ssize_t ret;
+
+	while (got < len)
+	{
+		ret = read(fd, buf + got, len - got);
+		(*calls)++;
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			break;
+		got += ret;
+	}
+	return got;
+}
 
-	XPND(pieces, npieces, spieces);
-	digest = xm(1, SHA1_DIGEST_LENGTH);
-	SHA1Data(digest, thispiece, thispiece_len);
-	pieces[npieces++] = digest;
+// Work out the fingerprint of a file open as fd where not all of its data
+// is read in to work it out from, as when pieces are passed over. Only the
+// sampled blocks of a long file are read. One that can't be read is left
+// without a fingerprint.
+static void read_fingerprint(struct torrent *t, struct tfile *tf, int fd,
+	struct torrent_stage *st)
+{
+	long long len = tf->length;
+	double start;
+
+	if (len > PI_WHOLE_LENGTH)
+		len = PI_SAMPLES * PI_SAMPLE_BYTES;
+	start = read_start(t, len, st);
+	tf->fp = xm(1, PI_FINGERPRINT_LENGTH);
+	if (pi_fingerprint(fd, tf->length, tf->fp) == -1)
+	{
+		free(tf->fp);
+		tf->fp = NULL;
+	}
+	read_done(t, start);
+	st->bytes += len;
+	st->calls += (len + PI_SAMPLE_BYTES - 1) / PI_SAMPLE_BYTES;
 }
 
-// Add pieces from a file.
-// The second filename is only for display purposes.
-static void add_pieces_from_file(const char *filename,
-	const char *displayfilename)
+// Read a file's data into its place in the piece map, working out its
+// checksums, and its fingerprint for opts.index, along the way, and
+// counting the work in st.
+static int add_pieces_from_file(struct torrent *t, struct tfile *tf,
+	struct torrent_stage *st)
 {
-	FILE *infp;
+	int fd;
+	struct filesum fs;
+	struct pi_fpsum fps;
+	int streaming;		// working out tf->fp from what's read
+	unsigned char *p;
+	long long offset;
+	long long left;
+	double start;
 	int wantedbytes;
 	int ret;
+	int done = 0;
+	int n = 0;
+
+	if (t->skipping)
+		done = pieces_done(t, tf, &n);
+	if (t->skipping && done == n && !t->fingerprints)
+		return 0;
+
+	read_start(t, 0, st);
+	fd = open(tf->path, O_RDONLY);
+	st->calls++;
+	if (fd == -1)
+		return diag_err(&t->diag, "cannot open %s", tf->path);
+
+	streaming = t->fingerprints && tf->fp == NULL && tf->length > 0;
+	if (streaming && done > 0)
+	{
+		read_fingerprint(t, tf, fd, st);
+		streaming = 0;
+	}
+	if (t->skipping && done == n)
+	{
+		close(fd);
+		st->calls++;
+		return 0;
+	}
 
-	if (thispiece == NULL)
+	show_adding(t, tf);
+	fsum_init(&fs, t->opts.checksums);
+	if (streaming)
+		pi_fp_init(&fps, tf->length);
+
+	offset = tf->offset;
+	left = tf->length;
+	while (left > 0)
+	{
+		// Pass over pieces already hashed or left to other shards.
+		if (t->skipping && skip_piece(t, offset / t->piece_bytes))
+		{
+			wantedbytes = t->piece_bytes
+				- offset % t->piece_bytes;
+			if (wantedbytes > left)
+				wantedbytes = left;
+			if (lseek(fd, wantedbytes, SEEK_CUR) == -1)
+			{
+				diag_err(&t->diag, "cannot seek in %s",
+					tf->path);
+				close(fd);
+				return -1;
+			}
+			offset += wantedbytes;
+			left -= wantedbytes;
+			continue;
+		}
+
+		// Straight into the piece buffer, with no stdio buffer in
+		// between.
+		wantedbytes = left > INT_MAX ? INT_MAX : left;
+		p = pm_slot(t->pm, offset, &wantedbytes);
+		start = read_start(t, wantedbytes, st);
+		ret = read_fully(fd, p, wantedbytes, &st->calls);
+		read_done(t, start);
+		if (ret == -1)
+		{
+			diag_err(&t->diag, "error reading %s", tf->path);
+			close(fd);
+			return -1;
+		}
+		if (ret > 0)
+		{
+			st->bytes += ret;
+			fsum_update(&fs, p, ret);
+			if (streaming)
+				pi_fp_update(&fps, p, ret);
+			pm_commit(t->pm, offset, ret);
+		}
+		if (ret < wantedbytes)
+		{
+			diag_errx(&t->diag, "%s shrank while reading",
+				tf->path);
+			close(fd);
+			return -1;
+		}
+
+		offset += ret;
+		left -= ret;
+	}
+
+	close(fd);
+	st->calls++;
+	fsum_final(&fs, tf->sums);
+	if (streaming)
 	{
-		assert(thispiece_len == 0);
-		thispiece = xm(1, piece_bytes);
+		tf->fp = xm(1, PI_FINGERPRINT_LENGTH);
+		pi_fp_final(&fps, tf->fp);
 	}
+	return 0;
+}
 
-	infp = fopen(filename, "rb");
-	if (infp == NULL)
-		err(1, "cannot open %s", filename);
+// Read a file's data from t->source, with a handle kept for the rest of
+// the group's files. For a tar archive, the files are read in the order
+// they're in it, so it's read from start to end.
+static int add_pieces_from_source(struct readgroup *g, const struct tfile *tf)
+{
+	struct torrent *t = g->t;
+	struct torrent_stage *st = &g->read;
+	struct filesum fs;
+	unsigned char *p;
+	long long offset;
+	long long left;
+	double start;
+	int wantedbytes;
+	int ret;
+	int n;
 
-	if (!be_quiet)
-		fprintf(stderr, "  adding: %s", displayfilename);
+	if (t->skipping && pieces_done(t, tf, &n) == n)
+		return 0;
 
-	wantedbytes = piece_bytes - thispiece_len;
-	while ((ret = fread(&thispiece[thispiece_len], 1, wantedbytes, infp))
-		> 0)
+	if (g->handle == NULL)
 	{
-		assert(ret <= wantedbytes);
+		g->handle = t->source->open(t->source->arg, &t->diag);
+		if (g->handle == NULL)
+			return -1;
+	}
+
+	show_adding(t, tf);
+	fsum_init(&fs, t->opts.checksums);
 
-		thispiece_len += ret;
-		wantedbytes -= ret;
+	offset = tf->offset;
+	left = tf->length;
+	while (left > 0)
+	{
+		if (t->skipping && skip_piece(t, offset / t->piece_bytes))
+		{
+			wantedbytes = t->piece_bytes
+				- offset % t->piece_bytes;
+			if (wantedbytes > left)
+				wantedbytes = left;
+			offset += wantedbytes;
+			left -= wantedbytes;
+			continue;
+		}
 
-		if (thispiece_len == piece_bytes)
+		wantedbytes = left > INT_MAX ? INT_MAX : left;
+		p = pm_slot(t->pm, offset, &wantedbytes);
+		start = read_start(t, wantedbytes, st);
+		ret = t->source->read(g->handle, tf->path,
+			tf->start + (offset - tf->offset), p, wantedbytes,
+			&t->diag);
+		read_done(t, start);
+		st->calls++;
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
 		{
-			add_this_piece();
-			thispiece_len = 0;
-			wantedbytes = piece_bytes;
+			return diag_errx(&t->diag, "%s shrank while reading",
+				tf->path);
 		}
+
+		st->bytes += ret;
+		fsum_update(&fs, p, ret);
+		pm_commit(t->pm, offset, ret);
+		offset += ret;
+		left -= ret;
 	}
 
-	if (!be_quiet)
-		putc('\n', stderr);
+	fsum_final(&fs, tf->sums);
+	return 0;
+}
+
+// Find the file holding the byte at offset within the torrent data.
+static const struct tfile *find_tfile(struct torrent *t, long long offset)
+{
+	int lo = 0, hi = t->ntfiles - 1;
+	int mid;
 
-	if (ferror(infp))
-		err(1, "error reading %s", filename);
-	fclose(infp);
+	// The last file starting at or before offset.
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo + 1) / 2;
+		if (t->tfiles[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &t->tfiles[lo];
 }
 
-// Add the final piece, in case the torrent isn't an exact multiple
-// of the piece size.
-static void finalize_pieces(void)
+// Wait while this reader isn't one of its run's active ones, not counting
+// as a reader to the piece map meanwhile. run->lock must be held. Returns
+// 0 once there's nothing more to hand out.
+static int wait_turn(struct readgroup *g)
 {
-	if (thispiece_len > 0)
-		add_this_piece();
-	if (thispiece != NULL)
+	struct readrun *run = g->run;
+
+	while (g->slot >= run->active && !run->done)
 	{
-		free(thispiece);
-		thispiece = NULL;
+		pm_reader_exit(g->t->pm);
+		pthread_cond_wait(&run->wake, &run->lock);
+		pm_reader_resume(g->t->pm);
 	}
-	thispiece_len = 0;
+	return !run->done;
 }
 
-// Write the pieces' hashes to the torrent file.
-static void write_pieces(void)
+static int take_turn(struct readgroup *g)
 {
-	int ix;
-	char buf[50];
+	int ret;
 
-	fbenc_str("pieces");
-	snprintf(buf, sizeof buf, "%lld:", (long long)npieces * 20);
-	fwr(buf);
-	for (ix = 0; ix < npieces; ix++)
+	pthread_mutex_lock(&g->run->lock);
+	ret = wait_turn(g);
+	pthread_mutex_unlock(&g->run->lock);
+	return ret;
+}
+
+// Take the next batch of files from the run when it's this reader's turn:
+// as many as can be opened ahead, up to a piece's worth of data, so that
+// small files go quickly but big ones are still shared out.
+static int take_files(struct readgroup *g)
+{
+	struct readrun *run = g->run;
+	long long bytes = 0;
+	int ret;
+
+	pthread_mutex_lock(&run->lock);
+	ret = wait_turn(g);
+	if (ret)
 	{
-		if (fwrite(pieces[ix], 20, 1, out) < 1)
-			err(1, "error writing to %s", activeoutfile);
+		g->files = &run->files[run->next];
+		g->nfiles = 0;
+		while (run->next < run->nfiles && g->nfiles < PREFETCH_DEPTH
+			&& bytes < g->t->piece_bytes)
+		{
+			bytes += run->files[run->next++]->length;
+			g->nfiles++;
+		}
+		if (run->next == run->nfiles)
+		{
+			run->done = 1;
+			pthread_cond_broadcast(&run->wake);
+		}
 	}
+	pthread_mutex_unlock(&run->lock);
+	return ret;
 }
 
-// Free/reset the pieces.
-static void free_pieces(void)
+// Stop handing out work, once a reader has run out or failed, letting any
+// readers waiting their turn go.
+static void end_run(struct readgroup *g)
 {
-	int ix;
+	pthread_mutex_lock(&g->run->lock);
+	g->run->done = 1;
+	pthread_cond_broadcast(&g->run->wake);
+	pthread_mutex_unlock(&g->run->lock);
+}
 
-	for (ix = 0; ix < npieces; ix++)
-		free(pieces[ix]);
+// Read whole pieces from t->source, taking the next one not yet taken
+// each time, so readers share the work however few and big the files are.
+// Per-file checksums, which need each file read in order, aren't worked
+// out.
+static int add_shared_pieces(struct readgroup *g)
+{
+	struct torrent *t = g->t;
+	struct torrent_stage *st = &g->read;
+	const struct tfile *tf;
+	unsigned char *p;
+	long long offset, end;
+	double start;
+	int index;
+	int wantedbytes;
+	int ret;
 
-	free(pieces);
-	npieces = spieces = 0;
-	pieces = NULL;
+	g->handle = t->source->open(t->source->arg, &t->diag);
+	if (g->handle == NULL)
+		return -1;
+
+	while (!diag_failed(&t->diag) && (g->run == NULL || take_turn(g)))
+	{
+		pthread_mutex_lock(&t->next_lock);
+		index = t->next_piece++;
+		pthread_mutex_unlock(&t->next_lock);
+		if (index >= t->end_piece)
+			break;
+		if (t->skipping && skip_piece(t, index))
+			continue;
+
+		offset = (long long)index * t->piece_bytes;
+		end = offset + t->piece_bytes;
+		if (end > t->total_bytes)
+			end = t->total_bytes;
+		tf = find_tfile(t, offset);
+		while (offset < end)
+		{
+			while (tf->offset + tf->length <= offset)
+				tf++;
+			if (offset == tf->offset)
+				show_adding(t, tf);
+
+			wantedbytes = (tf->offset + tf->length < end
+				? tf->offset + tf->length : end) - offset;
+			p = pm_slot(t->pm, offset, &wantedbytes);
+			start = read_start(t, wantedbytes, st);
+			ret = t->source->read(g->handle, tf->path,
+				tf->start + (offset - tf->offset), p,
+				wantedbytes, &t->diag);
+			read_done(t, start);
+			st->calls++;
+			if (ret == -1)
+				return -1;
+			if (ret == 0)
+			{
+				return diag_errx(&t->diag, "%s shrank while "
+					"reading", tf->path);
+			}
+
+			st->bytes += ret;
+			pm_commit(t->pm, offset, ret);
+			offset += ret;
+			if (offset == tf->offset + tf->length)
+			{
+				st->items++;
+				file_done(t);
+			}
+		}
+	}
+	return 0;
 }
 
-// Write info dictionary for a single file. The struct stat is passed along
-// for convenience.
-static void write_singlefile_info(const char *filename, const struct stat *sb)
+static int physcmp(const void *one, const void *two)
+{
+	const struct tfile *f1 = *(const struct tfile *const *)one;
+	const struct tfile *f2 = *(const struct tfile *const *)two;
+
+	if (f1->dev != f2->dev)
+		return f1->dev < f2->dev ? -1 : 1;
+	if (f1->physaddr != f2->physaddr)
+		return f1->physaddr < f2->physaddr ? -1 : 1;
+	return f1 < f2 ? -1 : f1 > f2;
+}
+
+// Open a small file relative to the directory fd cache. Consecutive files
+// are usually in the same directory, so one entry is enough.
+static int open_small_file(struct readgroup *g, const char *path)
+{
+	const char *slash;
+	const char *base;
+	size_t dirlen;
+	int fd;
+
+	slash = strrchr(path, '/');
+	if (slash == NULL)
+		fd = open(path, O_RDONLY);
+	else
+	{
+		base = slash + 1;
+		dirlen = slash - path;
+		if (g->dirname == NULL || strlen(g->dirname) != dirlen
+			|| strncmp(g->dirname, path, dirlen) != 0)
+		{
+			if (g->dirname != NULL)
+			{
+				close(g->dirfd);
+				free(g->dirname);
+				g->read.calls++;
+			}
+			g->dirname = xm(1, dirlen + 1);
+			memcpy(g->dirname, path, dirlen);
+			g->dirname[dirlen] = '\0';
+			g->dirfd = open(dirlen == 0 ? "/" : g->dirname,
+				O_RDONLY | O_DIRECTORY);
+			g->read.calls++;
+			if (g->dirfd == -1)
+			{
+				diag_err(&g->t->diag,
+					"cannot open directory %s",
+					g->dirname);
+				free(g->dirname);
+				g->dirname = NULL;
+				return -1;
+			}
+		}
+		fd = openat(g->dirfd, base, O_RDONLY);
+	}
+	g->read.calls++;
+
+	if (fd == -1)
+		return diag_err(&g->t->diag, "cannot open %s", path);
+	return fd;
+}
+
+// Open the small files among the next few, and ask the kernel to start
+// reading them in, so several reads are in flight while we hash.
+static int prefetch(struct readgroup *g, int upto)
 {
-	fbenc_dict;
+	const struct tfile *tf;
+	int fd;
+	int n;
+
+	if (upto > g->nfiles)
+		upto = g->nfiles;
 
-	fbenc_str("length");
-	fbenc_int(sb->st_size);
+	for (; g->nopened < upto; g->nopened++)
+	{
+		tf = g->files[g->nopened];
+		fd = -1;
 
-	fbenc_str("name");
-	fbenc_str(newname);
+		// Files with pieces to pass over are left to
+		// add_pieces_from_file(), which skips those parts.
+		if (tf->length <= SMALL_FILE_BYTES && !(g->t->skipping
+			&& pieces_done(g->t, tf, &n) > 0))
+		{
+			read_start(g->t, 0, &g->read);
+			fd = open_small_file(g, tf->path);
+			if (fd == -1)
+				return -1;
+#ifdef POSIX_FADV_WILLNEED
+			if (tf->length > 0)
+			{
+				posix_fadvise(fd, 0, tf->length,
+					POSIX_FADV_WILLNEED);
+				g->read.calls++;
+			}
+#endif
+		}
+		g->ahead[g->nopened % PREFETCH_DEPTH] = fd;
+	}
+	return 0;
+}
 
-	fbenc_str("piece length");
-	fbenc_int(piece_bytes);
+// Read a whole small file, normally with one readv() spanning all the
+// pieces it falls in.
+static int add_pieces_from_small_file(struct torrent *t,
+	struct tfile *tf, int fd, struct torrent_stage *st)
+{
+	struct iovec iov[MAX_IOV];
+	long long offs[MAX_IOV];
+	struct filesum fs;
+	struct pi_fpsum fps;
+	long long offset, o;
+	long long left, l;
+	double start;
+	int niov;
+	int wantedbytes;
+	int ix;
+	ssize_t ret;
+	int n;
 
-	add_pieces_from_file(filename, filename);
-	finalize_pieces();
-	write_pieces();
-	free_pieces();
+	show_adding(t, tf);
+	fsum_init(&fs, t->opts.checksums);
+	if (t->fingerprints)
+		pi_fp_init(&fps, tf->length);
 
-	if (mark_private)
+	offset = tf->offset;
+	left = tf->length;
+	while (left > 0)
 	{
-		fbenc_str("private");
-		fbenc_int(1);
+		o = offset;
+		l = left;
+		for (niov = 0; l > 0 && niov < MAX_IOV; niov++)
+		{
+			wantedbytes = l;
+			iov[niov].iov_base = pm_slot(t->pm, o, &wantedbytes);
+			iov[niov].iov_len = wantedbytes;
+			offs[niov] = o;
+			o += wantedbytes;
+			l -= wantedbytes;
+		}
+
+		start = read_start(t, o - offset, st);
+		ret = readv(fd, iov, niov);
+		read_done(t, start);
+		st->calls++;
+		if (ret > 0)
+			st->bytes += ret;
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return diag_err(&t->diag, "error reading %s", tf->path);
+		if (ret == 0)
+		{
+			return diag_errx(&t->diag, "%s shrank while reading",
+				tf->path);
+		}
+
+		for (ix = 0; ix < niov && ret > 0; ix++)
+		{
+			n = (size_t)ret < iov[ix].iov_len ? (int)ret
+				: (int)iov[ix].iov_len;
+			fsum_update(&fs, iov[ix].iov_base, n);
+			if (t->fingerprints)
+				pi_fp_update(&fps, iov[ix].iov_base, n);
+			pm_commit(t->pm, offs[ix], n);
+			ret -= n;
+			offset += n;
+			left -= n;
+		}
 	}
 
-	fbenc_end;
+	fsum_final(&fs, tf->sums);
+	if (t->fingerprints && tf->length > 0)
+	{
+		tf->fp = xm(1, PI_FINGERPRINT_LENGTH);
+		pi_fp_final(&fps, tf->fp);
+	}
+	return 0;
 }
 
-// Write info dictionary for a multi-file torrent.
-static void write_multifile_info(const char *dirname,
-	int num_ignore_patterns, const char **ignore_patterns)
+// Read the group's files, returning -1 if this or another reader failed.
+static int read_files(struct readgroup *g)
 {
-	const char **files;
-	int numfiles;
+	struct torrent *t = g->t;
+	int fd;
 	int ix;
-	struct stat info;
-	char *fullfilename;
+	int ret = 0;
 
-	getfilelist(&files, &numfiles, dirname, sort_by_ext,
-		ignore_patterns, num_ignore_patterns);
+	g->nopened = 0;
 
-	fbenc_dict;
+	// Stop early if this or another reader has failed.
+	for (ix = 0; ix < g->nfiles && !diag_failed(&t->diag); ix++)
+	{
+		// Tar members all come from the one file, so have nothing
+		// to open ahead.
+		if (t->source != NULL)
+			ret = add_pieces_from_source(g, g->files[ix]);
+		else if (prefetch(g, ix + PREFETCH_DEPTH) == -1)
+			break;
+		else if ((fd = g->ahead[ix % PREFETCH_DEPTH]) != -1)
+		{
+			ret = add_pieces_from_small_file(t, g->files[ix], fd,
+				&g->read);
+			close(fd);
+			g->read.calls++;
+		}
+		else
+		{
+			ret = add_pieces_from_file(t, g->files[ix],
+				&g->read);
+		}
+		g->read.items++;
+		if (ret == -1)
+		{
+			ix++;
+			break;
+		}
+		file_done(t);
+	}
 
-	fbenc_str("files");
-	fbenc_list;
-	for (ix = 0; ix < numfiles; ix++)
+	// Close any small files opened ahead but not read.
+	for (; ix < g->nopened; ix++)
 	{
-		fullfilename = xm(1, strlen(dirname) + 1 + strlen(files[ix])
-			+ 1);
-		strcpy(fullfilename, dirname);
-		strcat(fullfilename, "/");
-		strcat(fullfilename, files[ix]);
+		if (g->ahead[ix % PREFETCH_DEPTH] != -1)
+			close(g->ahead[ix % PREFETCH_DEPTH]);
+	}
+	return diag_failed(&t->diag) ? -1 : 0;
+}
 
-		if (stat(fullfilename, &info) != 0)
-			err(1, "cannot stat %s", fullfilename);
+static void *read_group(void *arg)
+{
+	struct readgroup *g = arg;
+	struct torrent *t = g->t;
+	double start;
+
+	g->dirname = NULL;
+	g->handle = NULL;
+	memset(&g->read, 0, sizeof g->read);
+	numa_bind_thread(t->numa, g->node);
+	start = thread_cpu_time();
+
+	// Readers of remote data have no files of their own, and with
+	// tuning, readers take their files a batch at a time.
+	if (t->remote != NULL)
+		add_shared_pieces(g);
+	else if (g->run == NULL)
+		read_files(g);
+	else
+	{
+		while (take_files(g) && read_files(g) == 0)
+			;
+	}
+	if (g->run != NULL)
+		end_run(g);
 
-		fbenc_dict;
+	if (g->dirname != NULL)
+	{
+		close(g->dirfd);
+		free(g->dirname);
+	}
+	if (g->handle != NULL)
+		t->source->close(g->handle);
+	g->read.cpu = thread_cpu_time() - start;
+	pm_reader_exit(t->pm);
+
+	// A lone reader runs in the calling thread, so let it go again.
+	numa_bind_thread(t->numa, -1);
+	return NULL;
+}
 
-		fbenc_str("length");
-		fbenc_int(info.st_size);
+// Work out how many piece buffers fit in the memory limit, after the file
+// list and the table of digests. Returns 0 for no limit, or -1 if the
+// limit is too small.
+static int buffer_budget(struct torrent *t)
+{
+	long long limit;
+	long long overhead;
+	long long npieces;
+	long long nbufs;
+	int ix;
 
-		fbenc_str("path");
-		fbenc_path(files[ix]);
+	if (t->opts.memory_limit == 0)
+		return 0;
 
-		fbenc_end;
+	limit = (long long)t->opts.memory_limit * 1024 * 1024;
+	npieces = (t->total_bytes + t->piece_bytes - 1) / t->piece_bytes;
+	overhead = npieces * SHA1_DIGEST_LENGTH;
+	for (ix = 0; ix < t->ntfiles; ix++)
+	{
+		overhead += sizeof t->tfiles[0] + sizeof(struct tfile *)
+			+ strlen(t->tfiles[ix].path)
+			+ strlen(t->tfiles[ix].name) + 2;
+		if (t->opts.checksums)
+			overhead += FILESUM_LEN;
+	}
+	if (t->opts.checkpoint > 0)
+		overhead += 2 * ((npieces + 7) / 8);
 
-		add_pieces_from_file(fullfilename, files[ix]);
-		free(fullfilename);
+	nbufs = (limit - overhead) / t->piece_bytes;
+	if (nbufs < 1)
+	{
+		return diag_errx(&t->diag, "memory limit too small: need "
+			"%lld KB for the file list and digests plus %d KB "
+			"per piece buffer",
+			overhead / 1024, t->piece_bytes / 1024);
 	}
-	fbenc_end; // end the list of files
+	return nbufs > INT_MAX ? INT_MAX : nbufs;
+}
 
-	freefilelist();
+// The most hashing threads tuning may use.
+static int max_hashers(struct torrent *t)
+{
+	long n;
 
-	fbenc_str("name");
-	fbenc_str(newname);
+	if (t->opts.hash_threads > 0)
+		return t->opts.hash_threads;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 1 ? n : 1;
+}
 
-	fbenc_str("piece length");
-	fbenc_int(piece_bytes);
+// Set up the piece map for total_bytes of data, starting the hashing
+// threads and piece buffers the first time through.
+static int new_piecemap(struct torrent *t)
+{
+	int maxbufs;
 
-	finalize_pieces();
-	write_pieces();
-	free_pieces();
+	if ((maxbufs = buffer_budget(t)) == -1)
+		return -1;
 
-	if (mark_private)
+	if (t->hq == NULL)
 	{
-		fbenc_str("private");
-		fbenc_int(1);
+		t->hq = hq_new(t->opts.tuning != NULL ? max_hashers(t)
+			: t->opts.hash_threads, t->numa);
+		if (t->hq == NULL)
+		{
+			return diag_errx(&t->diag,
+				"cannot create hashing threads");
+		}
+		t->own_hq = 1;
 	}
-
-	fbenc_end;
+	if (t->bufs == NULL)
+		t->bufs = bp_new(t->piece_bytes, maxbufs, t->numa);
+	else
+		bp_limit(t->bufs, maxbufs);
+
+	pthread_mutex_lock(&t->progress_lock);
+	t->pm = pm_new(t->piece_bytes, t->total_bytes, t->hq, t->bufs);
+	t->progress.total_bytes = t->total_bytes;
+	t->progress.total_files = t->infd != -1 ? 1 : t->ntfiles;
+	pthread_mutex_unlock(&t->progress_lock);
+	return 0;
 }
 
-void create_torrent(const char *filename, const char *inputfile,
-	const char *rename, int piecesize, int private, int quiet,
-	int sortext,
-	int num_tracker_urls, const char **tracker_urls,
-	int num_ignore_patterns, const char **ignore_patterns)
+// Identify the data a checkpoint is for: the piece size, and each file's
+// name, length and modification time, in torrent order.
+static void signature(struct torrent *t, unsigned char *sig)
 {
-	struct stat info;
+	SHA1_CTX ctx;
+	char buf[64];
 	int ix;
 
-	activeoutfile = filename;
-	mark_private = private;
-	be_quiet = quiet;
-	sort_by_ext = sortext;
-	piece_bytes = piecesize * 1024;
-	newname = rename != NULL ? rename : inputfile;
+	SHA1Init(&ctx);
+	snprintf(buf, sizeof buf, "%d\n", t->piece_bytes);
+	SHA1Update(&ctx, (unsigned char *)buf, strlen(buf));
+	for (ix = 0; ix < t->ntfiles; ix++)
+	{
+		SHA1Update(&ctx, (const unsigned char *)t->tfiles[ix].name,
+			strlen(t->tfiles[ix].name) + 1);
+		snprintf(buf, sizeof buf, "%lld %lld\n", t->tfiles[ix].length,
+			(long long)t->tfiles[ix].mtime);
+		SHA1Update(&ctx, (unsigned char *)buf, strlen(buf));
+	}
+	SHA1Final(sig, &ctx);
+}
+
+// Save a checkpoint every so often until told to stop, or until saving
+// fails.
+static void *run_checkpoints(void *arg)
+{
+	struct torrent *t = arg;
+	struct timespec ts;
+	int ret = 0;
+
+	pthread_mutex_lock(&t->ckpt_lock);
+	while (!t->ckpt_stopping && ret == 0)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += t->opts.checkpoint;
+		while (!t->ckpt_stopping && pthread_cond_timedwait(
+			&t->ckpt_stop, &t->ckpt_lock, &ts) != ETIMEDOUT)
+		{
+		}
+		if (t->ckpt_stopping)
+			break;
 
-	out = fopen(filename, "wb");
-	if (out == NULL)
-		err(1, "cannot create %s", filename);
+		pthread_mutex_unlock(&t->ckpt_lock);
+		ret = ckpt_save(t->ckpt, t->pm);
+		pthread_mutex_lock(&t->ckpt_lock);
+	}
+	pthread_mutex_unlock(&t->ckpt_lock);
+	return NULL;
+}
 
-	fbenc_dict;
+// Open the checkpoint, picking up any pieces hashed before if resuming,
+// and start saving it every so often.
+static int start_checkpoints(struct torrent *t)
+{
+	unsigned char sig[CKPT_SIG_LENGTH];
+	const char *base = t->shardname != NULL ? t->shardname : t->outname;
+	char *path;
+	long long skipped;
+	int resume = t->opts.resume;
 
-	fbenc_str("announce");
-	fbenc_str(tracker_urls[0]);
+	path = xm(1, strlen(base) + strlen(".part") + 1);
+	strcpy(path, base);
+	strcat(path, ".part");
 
-	if (num_tracker_urls > 1)
+	if (resume && t->opts.checksums)
 	{
-		// XXX only support each tracker being put in its own tier
-		// for the moment
-
-		fbenc_str("announce-list");
-		fbenc_list;
-		for (ix = 0; ix < num_tracker_urls; ix++)
+		if (access(path, F_OK) == 0)
 		{
-			fbenc_list;
-			fbenc_str(tracker_urls[ix]);
-			fbenc_end;
+			diag_warnx(&t->diag, "per-file checksums need every "
+				"file read, so not resuming from %s", path);
 		}
-		fbenc_end;
+		resume = 0;
 	}
 
-	fbenc_str("info");
+	signature(t, sig);
+	t->ckpt = ckpt_open(path, sig, t->pm, resume, &t->diag);
+	free(path);
+	if (t->ckpt == NULL)
+		return -1;
 
-	if (stat(inputfile, &info) != 0)
-		err(1, "cannot stat %s", inputfile);
+	if (ckpt_restored(t->ckpt) > 0)
+	{
+		t->skipping = 1;
+		info(t, "resuming with %d of %d pieces already hashed",
+			ckpt_restored(t->ckpt), pm_npieces(t->pm));
+
+		// Count progress against what's left to do.
+		skipped = (long long)ckpt_restored(t->ckpt) * t->piece_bytes;
+		pthread_mutex_lock(&t->progress_lock);
+		t->progress.total_bytes -= skipped < t->total_bytes
+			? skipped : t->total_bytes;
+		pthread_mutex_unlock(&t->progress_lock);
+	}
 
-	if (!S_ISDIR(info.st_mode))
-		write_singlefile_info(inputfile, &info);
-	else
+	t->ckpt_stopping = 0;
+	if (pthread_create(&t->ckpt_thread, NULL, run_checkpoints, t) != 0)
 	{
-		write_multifile_info(inputfile, num_ignore_patterns,
-			ignore_patterns);
+		ckpt_close(t->ckpt, 0);
+		t->ckpt = NULL;
+		return diag_errx(&t->diag, "cannot create checkpoint thread");
 	}
+	return 0;
+}
 
-	fbenc_end;
+// Stop saving the checkpoint. If the torrent has failed, save whatever
+// was finished first, for resuming from later.
+static void stop_checkpoints(struct torrent *t)
+{
+	pthread_mutex_lock(&t->ckpt_lock);
+	t->ckpt_stopping = 1;
+	pthread_cond_signal(&t->ckpt_stop);
+	pthread_mutex_unlock(&t->ckpt_lock);
+	pthread_join(t->ckpt_thread, NULL);
+
+	if (diag_failed(&t->diag))
+		ckpt_save(t->ckpt, t->pm);
+}
+
+// Name the file holding the digests of shard number shard of nshards.
+static char *shard_path(struct torrent *t, int shard, int nshards)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(t->outname) + 64;
+	path = xm(1, len);
+	snprintf(path, len, "%s.shard%dof%d", t->outname, shard, nshards);
+	return path;
+}
+
+// Work out which pieces this shard hashes: the shard'th of nshards runs
+// of about the same number of pieces, so every machine working from the
+// same files splits them up the same way.
+static void shard_pieces(struct torrent *t)
+{
+	long long npieces = pm_npieces(t->pm);
+	long long bytes;
+
+	t->first_piece = 0;
+	t->end_piece = npieces;
+	if (t->opts.nshards == 0)
+		return;
+
+	t->first_piece = npieces * (t->opts.shard - 1) / t->opts.nshards;
+	t->end_piece = npieces * t->opts.shard / t->opts.nshards;
+	t->skipping = 1;
+	info(t, "shard %d of %d: pieces %d to %d of %lld", t->opts.shard,
+		t->opts.nshards, t->first_piece, t->end_piece - 1, npieces);
+
+	bytes = (long long)t->end_piece * t->piece_bytes;
+	if (bytes > t->total_bytes)
+		bytes = t->total_bytes;
+	pthread_mutex_lock(&t->progress_lock);
+	t->progress.total_bytes = bytes
+		- (long long)t->first_piece * t->piece_bytes;
+	pthread_mutex_unlock(&t->progress_lock);
+}
+
+// Fill in every piece's digest from the files saved by opts.merge shards,
+// checking that they're for the same data and that between them they
+// have every piece.
+static int load_shards(struct torrent *t)
+{
+	unsigned char sig[CKPT_SIG_LENGTH];
+	unsigned char *map;
+	char *path;
+	int npieces = pm_npieces(t->pm);
+	int ret;
+	int ix;
+
+	signature(t, sig);
+	for (ix = 1; ix <= t->opts.merge; ix++)
+	{
+		path = shard_path(t, ix, t->opts.merge);
+		ret = ckpt_load(path, sig, t->pm, &t->diag);
+		free(path);
+		if (ret == -1)
+			return -1;
+	}
+
+	map = xm(1, (npieces + 7) / 8 + 1);
+	pm_done_map(t->pm, map);
+	for (ix = 0; ix < npieces; ix++)
+	{
+		if (!(map[ix / 8] >> ix % 8 & 1))
+			break;
+	}
+	free(map);
+	if (ix < npieces)
+	{
+		return diag_errx(&t->diag, "none of the %d shards has "
+			"piece %d", t->opts.merge, ix);
+	}
+
+	t->skipping = 1;
+	pthread_mutex_lock(&t->progress_lock);
+	t->progress.total_bytes = 0;
+	pthread_mutex_unlock(&t->progress_lock);
+	return 0;
+}
+
+// Fill in the hashing figures once all the pieces are done, and start
+// timing the writing of the torrent. start is when reading started.
+static void end_hashing(struct torrent *t, double start)
+{
+	struct pm_stats ps;
+
+	pm_stats(t->pm, &ps);
+	t->stats.hash.wall = wall_time() - start;
+	t->stats.hash.cpu = ps.hash_cpu;
+	t->stats.hash.bytes = ps.hash_bytes;
+	t->stats.hash.items = ps.pieces;
+	t->stats.read.stall = ps.buffer_stall + ps.queue_stall;
+	t->stats.max_queue = ps.max_queue;
+	t->stats.max_pending = ps.max_pending;
+	t->stats.max_buffers = ps.max_buffers;
+	t->stats.hashers = hq_threads(t->hq) > 0 ? hq_active(t->hq) : 0;
+	t->stats.queue_limit = hq_depth(t->hq);
+
+	// Without hashing threads, the readers did the hashing.
+	if (hq_threads(t->hq) > 0)
+		t->stats.cpu += ps.hash_cpu;
+	else
+		t->stats.read.cpu -= ps.hash_cpu;
+
+	t->write_start = wall_time();
+	t->write_cpu = thread_cpu_time();
+}
+
+static void add_stage(struct torrent_stage *to,
+	const struct torrent_stage *st)
+{
+	to->wall += st->wall;
+	to->cpu += st->cpu;
+	to->stall += st->stall;
+	to->throttled += st->throttled;
+	to->bytes += st->bytes;
+	to->calls += st->calls;
+	to->items += st->items;
+}
+
+// Set up the readers for tuning: a run for each device's files, which the
+// sort has put next to each other, or for a server's pieces, with as many
+// readers as it might be given. To begin with, as many are let read as
+// were settled on for the device before, or one, and the same goes for
+// the hashing threads.
+static struct readgroup *tuned_groups(struct torrent *t,
+	struct tfile **order, int *ngroups)
+{
+	struct tuning *tu = t->opts.tuning->tu;
+	struct readgroup *groups;
+	struct readrun *run = NULL;	// the one the file before went in
+	int readers, hashers;
+	int maxhashers = 0;
+	int ix, slot;
+	int n = 0;
+
+	t->runs = xm(sizeof t->runs[0], t->ntfiles + 1);
+	t->nruns = 0;
+	if (t->remote != NULL)
+	{
+		run = &t->runs[t->nruns++];
+		run->files = order;
+		run->nfiles = 0;
+		snprintf(run->dev, sizeof run->dev, "%s", t->source->name);
+	}
+	for (ix = 0; ix < t->ntfiles && t->remote == NULL; ix++)
+	{
+		if (ix == 0 || order[ix]->dev != order[ix - 1]->dev)
+		{
+			run = &t->runs[t->nruns++];
+			run->files = &order[ix];
+			run->nfiles = 0;
+			snprintf(run->dev, sizeof run->dev, "%u:%u",
+				major(order[ix]->dev), minor(order[ix]->dev));
+		}
+		run->nfiles++;
+	}
+
+	for (ix = 0; ix < t->nruns; ix++)
+	{
+		run = &t->runs[ix];
+		if (t->remote != NULL)
+		{
+			run->nreaders = t->opts.connections > 0
+				? t->opts.connections : TUNE_MAX_CONNECTIONS;
+		}
+		else if (t->opts.tar)
+			run->nreaders = 1;	// the archive's read in order
+		else if (run->nfiles < TUNE_MAX_READERS)
+			run->nreaders = run->nfiles;
+		else
+			run->nreaders = TUNE_MAX_READERS;
+		run->next = run->done = 0;
+		run->active = 1;
+		if (tuning_get(tu, run->dev, &readers, &hashers) == 0)
+		{
+			run->active = readers < run->nreaders ? readers
+				: run->nreaders;
+			if (hashers > maxhashers)
+				maxhashers = hashers;
+		}
+		pthread_mutex_init(&run->lock, NULL);
+		pthread_cond_init(&run->wake, NULL);
+		n += run->nreaders;
+	}
+
+	groups = xm(sizeof groups[0], n + 1);
+	n = 0;
+	for (ix = 0; ix < t->nruns; ix++)
+	{
+		for (slot = 0; slot < t->runs[ix].nreaders; slot++)
+		{
+			groups[n].t = t;
+			groups[n].files = NULL;
+			groups[n].nfiles = 0;
+			groups[n].run = &t->runs[ix];
+			groups[n].slot = slot;
+			n++;
+		}
+	}
+	*ngroups = n;
+
+	// A shared pool of hashing threads is left alone.
+	if (t->opts.pool == NULL)
+		hq_set_active(t->hq, maxhashers > 0 ? maxhashers : 1);
+	return groups;
+}
+
+// Let the tuner decide from the last interval how many readers each
+// device should have and how many hashing threads to use, and make it so.
+static void tune(struct torrent *t, const struct tune_sample *s,
+	int *readers)
+{
+	struct readrun *run;
+	char buf[DIAG_LEN];
+	size_t len;
+	int hashers;
+	int ix;
+
+	// Only this thread changes run->active.
+	for (ix = 0; ix < t->nruns; ix++)
+		readers[ix] = t->runs[ix].active;
+	hashers = hq_active(t->hq);
+	if (!tuner_step(t->tuner, s, readers, &hashers))
+		return;
+
+	for (ix = 0; ix < t->nruns; ix++)
+	{
+		run = &t->runs[ix];
+		if (readers[ix] == run->active)
+			continue;
+		pthread_mutex_lock(&run->lock);
+		run->active = readers[ix];
+		pthread_cond_broadcast(&run->wake);
+		pthread_mutex_unlock(&run->lock);
+	}
+	if (t->opts.pool == NULL)
+		hq_set_active(t->hq, hashers);
+
+	len = snprintf(buf, sizeof buf, "tuning at %.1f MB/s: %d hashing "
+		"threads, readers", s->bytes / s->secs / (1024 * 1024),
+		hashers);
+	for (ix = 0; ix < t->nruns && len < sizeof buf; ix++)
+	{
+		len += snprintf(buf + len, sizeof buf - len, "%s %d on %s",
+			ix > 0 ? "," : "", readers[ix], t->runs[ix].dev);
+	}
+	info(t, "%s", buf);
+}
+
+// Every so often, once enough pieces have been hashed to go by, see how
+// fast things are going, and tune.
+static void *run_tuner(void *arg)
+{
+	struct torrent *t = arg;
+	struct tune_sample s;
+	struct pm_stats ps, last;
+	struct timespec ts;
+	long long hashed, lasthashed;
+	double now, then;
+	int *readers;
+
+	readers = xm(sizeof readers[0], t->nruns + 1);
+	then = wall_time();
+	lasthashed = pm_hashed(t->pm);
+	pm_stats(t->pm, &last);
+
+	pthread_mutex_lock(&t->tune_lock);
+	while (!t->tune_stopping)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TUNE_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		while (!t->tune_stopping && pthread_cond_timedwait(
+			&t->tune_stop, &t->tune_lock, &ts) != ETIMEDOUT)
+		{
+		}
+		if (t->tune_stopping)
+			break;
+		pthread_mutex_unlock(&t->tune_lock);
+
+		now = wall_time();
+		hashed = pm_hashed(t->pm);
+		if (hashed - lasthashed >= (long long)TUNE_PIECES
+			* t->piece_bytes || now - then >= TUNE_MAX_MS / 1000.0)
+		{
+			pm_stats(t->pm, &ps);
+			s.secs = now - then;
+			s.bytes = hashed - lasthashed;
+			s.queue_stall = ps.queue_stall - last.queue_stall;
+			s.hash_cpu = ps.hash_cpu - last.hash_cpu;
+			tune(t, &s, readers);
+
+			then = now;
+			lasthashed = hashed;
+			last = ps;
+		}
+		pthread_mutex_lock(&t->tune_lock);
+	}
+	pthread_mutex_unlock(&t->tune_lock);
+	free(readers);
+	return NULL;
+}
+
+static int start_tuning(struct torrent *t)
+{
+	int *maxreaders;
+	int ix;
+
+	maxreaders = xm(sizeof maxreaders[0], t->nruns + 1);
+	for (ix = 0; ix < t->nruns; ix++)
+		maxreaders[ix] = t->runs[ix].nreaders;
+	t->tuner = tuner_new(t->nruns, maxreaders,
+		t->opts.pool == NULL ? hq_threads(t->hq) : 0);
+	free(maxreaders);
+
+	t->tune_stopping = 0;
+	if (pthread_create(&t->tune_thread, NULL, run_tuner, t) != 0)
+	{
+		tuner_free(t->tuner);
+		t->tuner = NULL;
+		return diag_errx(&t->diag, "cannot create tuning thread");
+	}
+	return 0;
+}
+
+// Stop tuning, remembering what was settled on for each device if it was
+// tuned for long enough to mean something.
+static void stop_tuning(struct torrent *t, double secs)
+{
+	struct readrun *run;
+	double rate;
+	int hashers;
+	int ix;
+
+	if (t->tuner != NULL)
+	{
+		pthread_mutex_lock(&t->tune_lock);
+		t->tune_stopping = 1;
+		pthread_cond_signal(&t->tune_stop);
+		pthread_mutex_unlock(&t->tune_lock);
+		pthread_join(t->tune_thread, NULL);
+
+		hashers = hq_active(t->hq);
+		rate = secs > 0 ? t->stats.read.bytes / secs : 0;
+		if (tuner_steps(t->tuner) >= TUNE_MIN_STEPS
+			&& !diag_failed(&t->diag))
+		{
+			for (ix = 0; ix < t->nruns; ix++)
+			{
+				tuning_put(t->opts.tuning->tu, t->runs[ix].dev,
+					t->runs[ix].active, hashers, rate);
+			}
+		}
+		tuner_free(t->tuner);
+		t->tuner = NULL;
+	}
+
+	t->stats.readers = 0;
+	for (ix = 0; ix < t->nruns; ix++)
+	{
+		run = &t->runs[ix];
+		t->stats.readers += run->active;
+		pthread_mutex_destroy(&run->lock);
+		pthread_cond_destroy(&run->wake);
+	}
+	free(t->runs);
+	t->runs = NULL;
+	t->nruns = 0;
+}
+
+// With opts.reuse, once every piece is hashed, look the files up in
+// opts.index and check their whole pieces against the digests there. A
+// fingerprint match is only a candidate, so the torrent keeps the digests
+// just worked out, and a file hashing differently gets a warning: it has
+// changed since it was indexed. Only files starting at a piece boundary,
+// here and there, have pieces to compare.
+static void check_index(struct torrent *t)
+{
+	const unsigned char *digests = pm_digests(t->pm);
+	unsigned char *known;
+	const struct tfile *tf;
+	int first, npieces;
+	int same;
+	int ix, p;
+
+	for (ix = 0; ix < t->ntfiles; ix++)
+	{
+		tf = &t->tfiles[ix];
+		if (tf->fp == NULL || tf->length < t->piece_bytes
+			|| tf->offset % t->piece_bytes != 0)
+		{
+			continue;
+		}
+		first = tf->offset / t->piece_bytes;
+		npieces = tf->length / t->piece_bytes;
+		known = xm(SHA1_DIGEST_LENGTH, npieces);
+		if (pi_find_file(t->opts.index->pi, t->piece_bytes,
+			tf->length, tf->fp, known) == 0)
+		{
+			same = 0;
+			for (p = 0; p < npieces; p++)
+			{
+				same += memcmp(known + p * SHA1_DIGEST_LENGTH,
+					digests + (first + p)
+					* SHA1_DIGEST_LENGTH,
+					SHA1_DIGEST_LENGTH) == 0;
+			}
+			if (same < npieces)
+			{
+				diag_warnx(&t->diag, "%s has changed since it "
+					"was indexed", tf->path);
+			}
+			t->stats.reused += same;
+			t->reused_files += same > 0;
+		}
+		free(known);
+	}
+}
+
+// Hash all the files. In physical order mode, files are read in order of
+// their location on disk rather than torrent order, and the piece map puts
+// each piece together once all of its parts have been read. In per-device
+// mode, each device gets its own reader thread, all of them feeding the
+// same hashing stage.
+static int hash_files(struct torrent *t)
+{
+	unsigned char sig[CKPT_SIG_LENGTH];
+	struct tfile **order;
+	struct readgroup *groups;
+	double start;
+	int ngroups;
+	int nstarted;
+	int ix;
+
+	if (new_piecemap(t) == -1)
+		return -1;
+	shard_pieces(t);
+	if (t->opts.merge > 0)
+	{
+		if (load_shards(t) == -1)
+			return -1;
+	}
+	else if (t->opts.checkpoint > 0 && start_checkpoints(t) == -1)
+		return -1;
+
+	order = xm(sizeof order[0], t->ntfiles + 1);
+	for (ix = 0; ix < t->ntfiles; ix++)
+		order[ix] = &t->tfiles[ix];
+	if (t->opts.physical_order || t->opts.per_device || t->opts.tar
+		|| t->opts.tuning != NULL)
+	{
+		qsort(order, t->ntfiles, sizeof order[0], physcmp);
+	}
+
+	// Shards aren't indexed, and data from a source can't be found by
+	// its fingerprint later.
+	t->fingerprints = t->opts.index != NULL && t->source == NULL
+		&& t->opts.nshards == 0 && t->opts.merge == 0;
+	t->reusing = t->fingerprints && t->opts.reuse;
+	t->reused_files = 0;
+
+	if (t->remote != NULL)
+	{
+		t->next_piece = t->first_piece;
+
+		// Empty files have nothing to fetch.
+		for (ix = 0; ix < t->ntfiles; ix++)
+		{
+			if (t->tfiles[ix].length == 0)
+				file_done(t);
+		}
+	}
+
+	if (t->opts.tuning != NULL)
+		groups = tuned_groups(t, order, &ngroups);
+	else if (t->remote != NULL)
+	{
+		// Remote data is read by a reader for each connection,
+		// sharing the pieces out between them.
+		ngroups = t->opts.connections > 0 ? t->opts.connections
+			: DEFAULT_CONNECTIONS;
+		groups = xm(sizeof groups[0], ngroups);
+		for (ix = 0; ix < ngroups; ix++)
+		{
+			groups[ix].t = t;
+			groups[ix].files = order;
+			groups[ix].nfiles = 0;
+			groups[ix].run = NULL;
+		}
+	}
+	else
+	{
+		// Split into runs of files on the same device, which the
+		// sort has put next to each other.
+		groups = xm(sizeof groups[0], t->ntfiles + 1);
+		ngroups = 0;
+		for (ix = 0; ix < t->ntfiles; ix++)
+		{
+			if (ngroups == 0 || (t->opts.per_device
+				&& order[ix]->dev != order[ix - 1]->dev))
+			{
+				groups[ngroups].t = t;
+				groups[ngroups].files = &order[ix];
+				groups[ngroups].nfiles = 0;
+				groups[ngroups].run = NULL;
+				ngroups++;
+			}
+			groups[ngroups - 1].nfiles++;
+		}
+	}
+
+	// Spread the readers over the NUMA nodes.
+	for (ix = 0; ix < ngroups; ix++)
+		groups[ix].node = ix % numa_nodes(t->numa);
+
+	t->nreaders = ngroups;
+	t->stats.readers = ngroups;
+	pm_readers(t->pm, ngroups);
+	start = wall_time();
+	nstarted = 0;
+	if (t->opts.tuning != NULL && ngroups > 0 && start_tuning(t) == -1)
+		ngroups = 0;
+	if (ngroups == 1)
+	{
+		read_group(&groups[0]);
+		nstarted = 1;
+	}
+	else if (ngroups > 1)
+	{
+		for (nstarted = 0; nstarted < ngroups; nstarted++)
+		{
+			if (pthread_create(&groups[nstarted].thread, NULL,
+				read_group, &groups[nstarted]) != 0)
+			{
+				diag_errx(&t->diag,
+					"cannot create reader thread");
+				break;
+			}
+		}
+		for (ix = nstarted; ix < ngroups; ix++)
+			pm_reader_exit(t->pm);
+		for (ix = 0; ix < nstarted; ix++)
+			pthread_join(groups[ix].thread, NULL);
+	}
+
+	t->stats.read.wall = wall_time() - start;
+	for (ix = 0; ix < nstarted; ix++)
+		add_stage(&t->stats.read, &groups[ix].read);
+	if (ngroups > 1)
+		t->stats.cpu += t->stats.read.cpu;
+	if (t->opts.tuning != NULL)
+		stop_tuning(t, t->stats.read.wall);
+
+	pm_wait(t->pm);
+	end_hashing(t, start);
+	if (t->ckpt != NULL)
+		stop_checkpoints(t);
+	free(groups);
+	free(order);
+
+	if (diag_failed(&t->diag))
+		return -1;
+
+	assert(pm_pending(t->pm) == 0);
+	if (t->reusing)
+		check_index(t);
+	if (pm_overcommitted(t->pm))
+	{
+		diag_warnx(&t->diag, "memory limit too small to assemble "
+			"pieces; it was exceeded");
+	}
+	info(t, "piece buffers: %s", pm_buffer_mode(t->pm));
+	if (t->numa != NULL)
+	{
+		info(t, "readers, hashing threads and piece buffers spread "
+			"over %d NUMA nodes", numa_nodes(t->numa));
+	}
+	if (t->stats.reused > 0)
+	{
+		info(t, "%d piece%s of %d file%s hashed the same as in the "
+			"index", t->stats.reused, t->stats.reused == 1
+			? "" : "s", t->reused_files, t->reused_files == 1
+			? "" : "s");
+	}
+
+	if (t->shardname != NULL)
+	{
+		signature(t, sig);
+		return ckpt_write(t->shardname, sig, t->pm, &t->diag);
+	}
+
+	// Keep what the resume data needs before the file list goes.
+	if (t->opts.fastresume)
+	{
+		free(t->resume_files);
+		t->resume_files = xm(2 * sizeof t->resume_files[0],
+			t->ntfiles + 1);
+		for (ix = 0; ix < t->ntfiles; ix++)
+		{
+			t->resume_files[2 * ix] = t->tfiles[ix].length;
+			t->resume_files[2 * ix + 1] = t->tfiles[ix].mtime;
+		}
+		t->nresume_files = t->ntfiles;
+		t->resume_pieces = pm_npieces(t->pm);
+	}
+	return 0;
+}
+
+static int write_fully(int fd, const unsigned char *buf, int len,
+	long long *calls)
+{
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = write(fd, buf, len);
+		(*calls)++;
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+// Hash data of unknown length as it streams in from t->infd, a piece at a
+// time, copying it to t->teefd as we go if there is one. The piece map is
+// grown one piece ahead, then cut back to size at the end. The stream's
+// checksums go in sums.
+static int hash_stream(struct torrent *t, unsigned char *sums)
+{
+	struct torrent_stage *st = &t->stats.read;
+	struct filesum fs;
+	unsigned char *p;
+	long long offset;
+	double start, cpu;
+	int want;
+	int got;
+
+	if (new_piecemap(t) == -1)
+		return -1;
+	if (t->opts.progress != NULL)
+		t->opts.progress(t->opts.cbarg, t->newname);
+	fsum_init(&fs, t->opts.checksums);
+	t->stats.readers = 1;
+	st->items = 1;
+	start = wall_time();
+	cpu = thread_cpu_time();
+
+	offset = 0;
+	do
+	{
+		pm_resize(t->pm, offset + t->piece_bytes);
+		want = t->piece_bytes;
+		p = pm_slot(t->pm, offset, &want);
+		got = read_fully(t->infd, p, want, &st->calls);
+		if (got == -1)
+		{
+			diag_err(&t->diag, "error reading %s", t->newname);
+			break;
+		}
+		if (t->teefd != -1
+			&& write_fully(t->teefd, p, got, &st->calls) == -1)
+		{
+			diag_err(&t->diag, "error copying %s", t->newname);
+			break;
+		}
+
+		if (got < want)
+			pm_resize(t->pm, offset + got);
+		if (got > 0)
+		{
+			fsum_update(&fs, p, got);
+			pm_commit(t->pm, offset, got);
+		}
+		offset += got;
+	} while (got == want);
+
+	st->wall = wall_time() - start;
+	st->cpu = thread_cpu_time() - cpu;
+	st->bytes = offset;
+	pm_wait(t->pm);
+	end_hashing(t, start);
+	if (diag_failed(&t->diag))
+		return -1;
+
+	t->total_bytes = offset;
+	file_done(t);
+	fsum_final(&fs, sums);
+	assert(pm_pending(t->pm) == 0);
+	info(t, "piece buffers: %s", pm_buffer_mode(t->pm));
+	return 0;
+}
+
+// Pass a file's checksums on to the checksum callback.
+static void report_sums(struct torrent *t, const char *name,
+	const unsigned char *sums)
+{
+	char buf[2 * SHA256_DIGEST_LENGTH + 1];
+
+	if (t->opts.checksum == NULL)
+		return;
+	if (t->opts.checksums & TORRENT_SHA1)
+	{
+		hex(buf, sums + FILESUM_SHA1, SHA1_DIGEST_LENGTH);
+		t->opts.checksum(t->opts.cbarg, name, "SHA1", buf);
+	}
+	if (t->opts.checksums & TORRENT_MD5)
+	{
+		hex(buf, sums + FILESUM_MD5, MD5_DIGEST_LENGTH);
+		t->opts.checksum(t->opts.cbarg, name, "MD5", buf);
+	}
+	if (t->opts.checksums & TORRENT_SHA256)
+	{
+		hex(buf, sums + FILESUM_SHA256, SHA256_DIGEST_LENGTH);
+		t->opts.checksum(t->opts.cbarg, name, "SHA256", buf);
+	}
+}
+
+// Write the MD5 sum of a file into a dictionary describing it, if there
+// is one; it goes between "length" and "name" or "path".
+static void write_md5sum(struct torrent *t, const unsigned char *sums)
+{
+	char buf[2 * MD5_DIGEST_LENGTH + 1];
+
+	if (t->opts.checksums & TORRENT_MD5)
+	{
+		hex(buf, sums + FILESUM_MD5, MD5_DIGEST_LENGTH);
+		benc_str(&t->out, "md5sum");
+		benc_str(&t->out, buf);
+	}
+}
+
+// Likewise the SHA-1 sum, which comes last.
+static void write_sha1(struct torrent *t, const unsigned char *sums)
+{
+	if (t->opts.checksums & TORRENT_SHA1)
+	{
+		benc_str(&t->out, "sha1");
+		benc_bytes(&t->out, sums + FILESUM_SHA1, SHA1_DIGEST_LENGTH);
+	}
+}
+
+// Write the pieces' hashes to the torrent file.
+static void write_pieces(struct torrent *t)
+{
+	benc_str(&t->out, "pieces");
+	benc_bytes(&t->out, pm_digests(t->pm),
+		(size_t)pm_npieces(t->pm) * SHA1_DIGEST_LENGTH);
+}
+
+// Free/reset the pieces.
+static void free_pieces(struct torrent *t)
+{
+	long long hashed;
+
+	pthread_mutex_lock(&t->progress_lock);
+	if (t->pm != NULL)
+	{
+		hashed = pm_hashed(t->pm);
+		t->progress.done_bytes = hashed;
+		t->progress.all_bytes += hashed;
+		pm_free(t->pm);
+	}
+	t->pm = NULL;
+	pthread_mutex_unlock(&t->progress_lock);
+}
+
+static void write_private(struct torrent *t)
+{
+	if (t->opts.private)
+	{
+		benc_str(&t->out, "private");
+		benc_int(&t->out, 1);
+	}
+}
+
+// Gather up what's to go in opts.index once the torrent has been written:
+// its digests and its files, named dir/name for a directory, or after the
+// torrent with dir NULL for a single file or a stream.
+static void keep_entry(struct torrent *t, const char *dir)
+{
+	const struct tfile *tf;
+	int ix;
+
+	if (t->opts.index == NULL || t->opts.nshards > 0)
+		return;
+	t->entry = pi_entry_new(t->piece_bytes, pm_npieces(t->pm),
+		pm_digests(t->pm));
+	if (t->ntfiles == 0 && dir == NULL)
+	{
+		pi_entry_file(t->entry, NULL, t->newname, 0, t->total_bytes,
+			NULL);
+	}
+	for (ix = 0; ix < t->ntfiles; ix++)
+	{
+		tf = &t->tfiles[ix];
+		pi_entry_file(t->entry, dir, dir != NULL ? tf->name
+			: t->newname, tf->offset, tf->length, tf->fp);
+	}
+}
+
+// Write info dictionary for a single file of the given length, once its
+// pieces and checksums have been worked out.
+static void write_singlefile_dict(struct torrent *t, long long length,
+	const unsigned char *sums)
+{
+	keep_entry(t, NULL);
+	report_sums(t, t->newname, sums);
+
+	benc_dict(&t->out);
+
+	benc_str(&t->out, "length");
+	benc_int(&t->out, length);
+
+	write_md5sum(t, sums);
+
+	benc_str(&t->out, "name");
+	benc_str(&t->out, t->newname);
+
+	benc_str(&t->out, "piece length");
+	benc_int(&t->out, t->piece_bytes);
+
+	write_pieces(t);
+	write_private(t);
+	write_sha1(t, sums);
+
+	benc_end(&t->out);
+}
+
+// Write info dictionary for a single file. The struct stat is passed along
+// for convenience.
+static int write_singlefile_info(struct torrent *t, const char *filename,
+	const struct stat *sb)
+{
+	add_tfile(t, xsd(filename), filename, sb);
+	if (hash_files(t) == -1)
+		return -1;
+
+	write_singlefile_dict(t, sb->st_size, t->tfiles[0].sums);
+	return 0;
+}
+
+// Write info dictionary for data read from a stream.
+static int write_stream_info(struct torrent *t)
+{
+	unsigned char sums[FILESUM_LEN];
+
+	if (hash_stream(t, sums) == -1)
+		return -1;
+
+	write_singlefile_dict(t, t->total_bytes, sums);
+	return 0;
+}
+
+// Write info dictionary for a multi-file torrent, once its files are
+// listed.
+static int write_multifile_dict(struct torrent *t)
+{
+	char *fullfilename;
+	int ix;
+
+	if (hash_files(t) == -1)
+		return -1;
+	keep_entry(t, t->newname);
+
+	if (t->opts.checksums)
+	{
+		for (ix = 0; ix < t->ntfiles; ix++)
+		{
+			fullfilename = xm(1, strlen(t->newname) + 1
+				+ strlen(t->tfiles[ix].name) + 1);
+			strcpy(fullfilename, t->newname);
+			strcat(fullfilename, "/");
+			strcat(fullfilename, t->tfiles[ix].name);
+			report_sums(t, fullfilename, t->tfiles[ix].sums);
+			free(fullfilename);
+		}
+	}
+
+	benc_dict(&t->out);
+
+	benc_str(&t->out, "files");
+	benc_list(&t->out);
+	for (ix = 0; ix < t->ntfiles; ix++)
+	{
+		benc_dict(&t->out);
+
+		benc_str(&t->out, "length");
+		benc_int(&t->out, t->tfiles[ix].length);
+
+		write_md5sum(t, t->tfiles[ix].sums);
+
+		benc_str(&t->out, "path");
+		benc_path(&t->out, t->tfiles[ix].name);
+
+		write_sha1(t, t->tfiles[ix].sums);
+
+		benc_end(&t->out);
+	}
+	benc_end(&t->out); // end the list of files
+
+	benc_str(&t->out, "name");
+	benc_str(&t->out, t->newname);
+
+	benc_str(&t->out, "piece length");
+	benc_int(&t->out, t->piece_bytes);
+
+	write_pieces(t);
+	write_private(t);
+
+	benc_end(&t->out);
+	return 0;
+}
+
+// Write info dictionary for a directory.
+static int write_multifile_info(struct torrent *t, const char *dirname)
+{
+	struct filelist fl;
+	int ix;
+	struct stat info;
+	char *fullfilename;
+	double start, cpu;
+	int ret = -1;
+
+	start = wall_time();
+	cpu = thread_cpu_time();
+	ret = getfilelist(&fl, dirname, t->opts.sort_by_ext, t->ignore,
+		&t->diag);
+	t->stats.scan.wall = wall_time() - start;
+	t->stats.scan.cpu = thread_cpu_time() - cpu;
+	t->stats.scan.calls = fl.ndirs + fl.nstats;
+	t->stats.scan.items = fl.nentries;
+	if (ret == -1)
+		return -1;
+	ret = -1;
+
+	start = wall_time();
+	cpu = thread_cpu_time();
+	for (ix = 0; ix < fl.n; ix++)
+	{
+		fullfilename = xm(1, strlen(dirname) + 1 + strlen(fl.names[ix])
+			+ 1);
+		strcpy(fullfilename, dirname);
+		strcat(fullfilename, "/");
+		strcat(fullfilename, fl.names[ix]);
+
+		t->stats.stat.calls++;
+		if (stat(fullfilename, &info) != 0)
+		{
+			diag_err(&t->diag, "cannot stat %s", fullfilename);
+			free(fullfilename);
+			goto out;
+		}
+
+		add_tfile(t, fullfilename, fl.names[ix], &info);
+		t->stats.stat.items++;
+	}
+	t->stats.stat.wall += wall_time() - start;
+	t->stats.stat.cpu += thread_cpu_time() - cpu;
+
+	ret = write_multifile_dict(t);
+
+out:
+	// The tfiles' names point into the file list.
+	free_tfiles(t);
+	freefilelist(&fl);
+	return ret;
+}
+
+// Name a torrent made from a tar archive: after the directory everything
+// in it is in, if there is one, or after the single file in it, or else
+// after the archive.
+static void name_tar(struct torrent *t, const char *archive,
+	const struct tarlist *list)
+{
+	const char *slash;
+	size_t len;
+
+	if (t->newname != NULL)
+		return;
+	if (list->toplen > 0)
+	{
+		t->autoname = xm(1, list->toplen + 1);
+		memcpy(t->autoname, list->members[0].name, list->toplen);
+		t->autoname[list->toplen] = '\0';
+	}
+	else if (list->n == 1)
+		t->autoname = xsd(list->members[0].name);
+	else
+	{
+		slash = strrchr(archive, '/');
+		t->autoname = xsd(slash != NULL ? slash + 1 : archive);
+		len = strlen(t->autoname);
+		if (len > 4 && strcmp(t->autoname + len - 4, ".tar") == 0)
+			t->autoname[len - 4] = '\0';
+	}
+	t->newname = t->autoname;
+}
+
+// Write info dictionary for what's in a tar archive, as if it had been
+// extracted.
+static int write_tar_info(struct torrent *t, const char *archive,
+	const struct stat *sb)
+{
+	struct tarlist list;
+	struct tar_member *m;
+	struct tfile *tf;
+	struct stat info;
+	double start, cpu;
+	int ix;
+	int ret;
+
+	start = wall_time();
+	cpu = thread_cpu_time();
+	ret = gettarlist(&list, archive, t->opts.sort_by_ext, t->ignore,
+		&t->diag);
+	t->stats.scan.wall = wall_time() - start;
+	t->stats.scan.cpu = thread_cpu_time() - cpu;
+	t->stats.scan.calls = list.nreads;
+	t->stats.scan.items = list.nheaders;
+	if (ret == -1)
+		return -1;
+
+	name_tar(t, archive, &list);
+	info = *sb;
+	for (ix = 0; ix < list.n; ix++)
+	{
+		m = &list.members[ix];
+		info.st_size = m->length;
+		info.st_mtime = m->mtime;
+		add_tfile(t, xsd(archive), list.toplen > 0
+			? m->name + list.toplen + 1 : m->name, &info);
+		tf = &t->tfiles[t->ntfiles - 1];
+		tf->start = m->start;
+		tf->physaddr = m->start;
+	}
+
+	if (list.n == 1 && list.toplen == 0)
+	{
+		ret = hash_files(t);
+		if (ret == 0)
+		{
+			write_singlefile_dict(t, t->tfiles[0].length,
+				t->tfiles[0].sums);
+		}
+	}
+	else
+		ret = write_multifile_dict(t);
+
+	// The tfiles' names point into the list.
+	free_tfiles(t);
+	freetarlist(&list);
+	return ret;
+}
+
+// Write info dictionary for objects on a server, named as the files they'd
+// be copied to.
+static int write_remote_info(struct torrent *t, const char *url)
+{
+	struct httplist list;
+	struct http_object *o;
+	struct stat info;
+	double start, cpu;
+	int ix;
+	int ret;
+
+	start = wall_time();
+	cpu = thread_cpu_time();
+	ret = gethttplist(&list, url + strlen(REMOTE_PREFIX),
+		t->opts.sort_by_ext, t->ignore, &t->diag);
+	t->stats.scan.wall = wall_time() - start;
+	t->stats.scan.cpu = thread_cpu_time() - cpu;
+	t->stats.scan.calls = list.nrequests;
+	t->stats.scan.items = list.n;
+	if (ret == -1)
+		return -1;
+
+	if (t->newname == NULL)
+	{
+		t->autoname = xsd(list.single ? list.objects[0].name
+			: list.top);
+		t->newname = t->autoname;
+	}
+	memset(&info, 0, sizeof info);
+	for (ix = 0; ix < list.n; ix++)
+	{
+		o = &list.objects[ix];
+		info.st_size = o->length;
+		info.st_mtime = o->mtime;
+		add_tfile(t, xsd(o->path), o->name, &info);
+	}
+
+	if (list.single)
+	{
+		ret = hash_files(t);
+		if (ret == 0)
+		{
+			write_singlefile_dict(t, t->tfiles[0].length,
+				t->tfiles[0].sums);
+		}
+	}
+	else
+		ret = write_multifile_dict(t);
+
+	// The tfiles' names point into the list.
+	free_tfiles(t);
+	freehttplist(&list);
+	return ret;
+}
+
+// Work out the info-hash, once the info dictionary has gone through
+// counted_write().
+static void end_info_hash(struct torrent *t)
+{
+	char buf[2 * SHA1_DIGEST_LENGTH + 1];
+
+	benc_flush(&t->out);
+	t->hashing_info = 0;
+	SHA1Final(t->info_hash, &t->info_ctx);
+	hex(buf, t->info_hash, SHA1_DIGEST_LENGTH);
+	info(t, "info-hash: %s", buf);
+}
+
+static int write_torrent(struct torrent *t, const char *inputfile)
+{
+	struct stat info;
+	double start;
+	int ix;
+	int ret;
+
+	benc_dict(&t->out);
+
+	benc_str(&t->out, "announce");
+	benc_str(&t->out, t->opts.tracker_urls[0]);
+
+	if (t->opts.num_tracker_urls > 1)
+	{
+		// XXX only support each tracker being put in its own tier
+		// for the moment
+
+		benc_str(&t->out, "announce-list");
+		benc_list(&t->out);
+		for (ix = 0; ix < t->opts.num_tracker_urls; ix++)
+		{
+			benc_list(&t->out);
+			benc_str(&t->out, t->opts.tracker_urls[ix]);
+			benc_end(&t->out);
+		}
+		benc_end(&t->out);
+	}
+
+	if (t->opts.comment != NULL)
+	{
+		benc_str(&t->out, "comment");
+		benc_str(&t->out, t->opts.comment);
+	}
+
+	benc_str(&t->out, "info");
+	if (t->opts.fastresume || t->opts.verbose || t->opts.index != NULL)
+	{
+		benc_flush(&t->out);
+		SHA1Init(&t->info_ctx);
+		t->hashing_info = 1;
+	}
+
+	if (inputfile != NULL && t->remote == NULL)
+	{
+		start = wall_time();
+		ret = stat(inputfile, &info);
+		t->stats.stat.wall = wall_time() - start;
+		t->stats.stat.calls = t->stats.stat.items = 1;
+		if (ret != 0)
+			return diag_err(&t->diag, "cannot stat %s", inputfile);
+	}
+
+	if (inputfile == NULL)
+		ret = write_stream_info(t);
+	else if (t->remote != NULL)
+		ret = write_remote_info(t, inputfile);
+	else if (t->opts.tar)
+		ret = write_tar_info(t, inputfile, &info);
+	else if (!S_ISDIR(info.st_mode))
+		ret = write_singlefile_info(t, inputfile, &info);
+	else
+		ret = write_multifile_info(t, inputfile);
+
+	free_tfiles(t);
+	free_pieces(t);
+	if (ret == -1)
+		return -1;
+
+	if (t->hashing_info)
+		end_info_hash(t);
+	benc_end(&t->out);
+
+	if (benc_flush(&t->out) == -1)
+		return diag_err(&t->diag, "error writing to %s", t->outname);
+	return 0;
+}
+
+// Write resume data for libtorrent, the library most clients are built
+// on, saying that every piece is there and the data is in the directory
+// holding inputfile. The files' sizes and modification times are there
+// for it to check that nothing has changed since.
+static int write_fastresume(struct torrent *t, const char *inputfile,
+	const char *outfile)
+{
+	unsigned char ones[4096];
+	char buf[32];
+	struct benc *b;
+	FILE *fp;
+	char *path, *dir;
+	char *slash;
+	const char *name;
+	size_t len;
+	int ret;
+	int ix, n;
+	int chunk;
+
+	dir = realpath(inputfile, NULL);
+	if (dir == NULL)
+		return diag_err(&t->diag, "cannot find %s", inputfile);
+	slash = strrchr(dir, '/');
+	name = slash + 1;
+	if (slash == dir)
+		slash++;
+	if (strcmp(name, t->newname) != 0)
+	{
+		diag_warnx(&t->diag, "the torrent's name isn't %s's, so the "
+			"client will have to be told where the data is",
+			inputfile);
+	}
+
+	len = strlen(outfile);
+	if (len > 8 && strcmp(outfile + len - 8, ".torrent") == 0)
+		len -= 8;
+	path = xm(1, len + strlen(".fastresume") + 1);
+	memcpy(path, outfile, len);
+	strcpy(path + len, ".fastresume");
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+	{
+		diag_err(&t->diag, "cannot create %s", path);
+		free(path);
+		free(dir);
+		return -1;
+	}
+
+	// The data goes by the name it has on disk, and save_path is
+	// where that is.
+	*slash = '\0';
+	b = xm(sizeof *b, 1);
+	benc_init(b, benc_write_file, fp);
+	benc_dict(b);
+	benc_str(b, "file-format");
+	benc_str(b, "libtorrent resume file");
+	benc_str(b, "file-version");
+	benc_int(b, 1);
+	benc_str(b, "file_sizes");
+	benc_list(b);
+	for (ix = 0; ix < t->nresume_files; ix++)
+	{
+		benc_list(b);
+		benc_int(b, t->resume_files[2 * ix]);
+		benc_int(b, t->resume_files[2 * ix + 1]);
+		benc_end(b);
+	}
+	benc_end(b);
+	benc_str(b, "info-hash");
+	benc_bytes(b, t->info_hash, SHA1_DIGEST_LENGTH);
+
+	// One byte per piece, with the lowest bit set if it's there.
+	benc_str(b, "pieces");
+	memset(ones, 1, sizeof ones);
+	snprintf(buf, sizeof buf, "%d:", t->resume_pieces);
+	benc_raw(b, buf, strlen(buf));
+	for (n = t->resume_pieces; n > 0; n -= chunk)
+	{
+		chunk = n < (int)sizeof ones ? n : (int)sizeof ones;
+		benc_raw(b, ones, chunk);
+	}
+	benc_str(b, "save_path");
+	benc_str(b, dir);
+	benc_str(b, "seed_mode");
+	benc_int(b, 1);
+	benc_end(b);
+	ret = benc_flush(b);
+	free(b);
+	free(dir);
+
+	if (fclose(fp) != 0 || ret == -1)
+	{
+		diag_err(&t->diag, "error writing to %s", path);
+		remove(path);
+		free(path);
+		return -1;
+	}
+	free(path);
+	return 0;
+}
+
+// Pass the encoded torrent on to the real sink, timing it.
+static int counted_write(void *arg, const void *buf, size_t len)
+{
+	struct torrent *t = arg;
+	double start;
+	int ret;
+
+	if (t->hashing_info)
+		SHA1UpdateLarge(&t->info_ctx, buf, len);
+	start = wall_time();
+	ret = t->sink(t->sinkarg, buf, len);
+	t->stats.write.stall += wall_time() - start;
+	t->stats.write.bytes += len;
+	t->stats.write.calls++;
+	return ret;
+}
+
+// In place of the torrent, when only a shard's digests are wanted.
+static int discard(void *arg, const void *buf, size_t len)
+{
+	(void)arg;
+	(void)buf;
+	(void)len;
+	return 0;
+}
+
+// Add the torrent just written to opts.index, by its full path so that it
+// can be found from anywhere.
+static int add_to_index(struct torrent *t)
+{
+	char *path;
+	int ret;
+
+	path = realpath(t->outname, NULL);
+	ret = pi_add(t->opts.index->pi, t->entry, path != NULL ? path
+		: t->outname, t->info_hash);
+	free(path);
+	if (ret == -1)
+	{
+		return diag_err(&t->diag, "cannot add %s to the index",
+			t->outname);
+	}
+	return 0;
+}
+
+// Make a torrent from inputfile, or from t->infd if that's NULL.
+static int create(struct torrent *t, const char *inputfile,
+	const char *name, const char *outfile)
+{
+	FILE *outfp = NULL;
+	double start, cpu;
+	int remote;
+	int ret;
+
+	t->outname = outfile != NULL ? outfile : "output";
+	remote = inputfile != NULL && strncmp(inputfile, TORRENT_REMOTE,
+		strlen(TORRENT_REMOTE)) == 0;
+	if (name != NULL)
+		t->newname = name;
+	else if (remote || t->opts.tar)
+		t->newname = NULL;	// worked out from what it holds
+	else
+		t->newname = inputfile;
+	t->autoname = NULL;
+	memset(&t->stats, 0, sizeof t->stats);
+	t->write_start = 0;
+	t->skipping = 0;
+	t->shardname = NULL;
+	t->hashing_info = 0;
+
+	pthread_mutex_lock(&t->progress_lock);
+	t->progress.total_bytes = t->progress.done_bytes = 0;
+	t->progress.total_files = t->progress.done_files = 0;
+	pthread_mutex_unlock(&t->progress_lock);
+
+	if (t->opts.num_tracker_urls < 1)
+		return diag_errx(&t->diag, "no tracker URL given");
+	if ((t->opts.nshards > 0 || t->opts.merge > 0) && t->opts.checksums)
+	{
+		return diag_errx(&t->diag, "per-file checksums need every "
+			"file read, so can't be sharded");
+	}
+	if (remote && t->opts.checksums)
+	{
+		return diag_errx(&t->diag, "per-file checksums need each "
+			"file read in order, so can't be made of data on a "
+			"server");
+	}
+	if (remote && t->opts.tar)
+	{
+		return diag_errx(&t->diag, "a tar archive on a server can't "
+			"be read");
+	}
+
+	t->source = NULL;
+	t->remote = NULL;
+	if (remote)
+	{
+		t->remote = http_source_new(inputfile + strlen(REMOTE_PREFIX),
+			&t->diag);
+		if (t->remote == NULL)
+			return -1;
+		t->source = t->remote;
+	}
+	else if (t->opts.tar && inputfile != NULL)
+		t->source = &file_source;
+
+	if (t->opts.nshards > 0)
+	{
+		t->shardname = shard_path(t, t->opts.shard, t->opts.nshards);
+		t->sink = discard;
+		t->sinkarg = NULL;
+	}
+	else if (t->opts.write != NULL)
+	{
+		t->sink = t->opts.write;
+		t->sinkarg = t->opts.writearg;
+	}
+	else
+	{
+		outfp = fopen(outfile, "wb");
+		if (outfp == NULL)
+		{
+			ret = diag_err(&t->diag, "cannot create %s", outfile);
+			if (t->remote != NULL)
+				http_source_free(t->remote);
+			t->remote = NULL;
+			return ret;
+		}
+		t->sink = benc_write_file;
+		t->sinkarg = outfp;
+	}
+	benc_init(&t->out, counted_write, t);
+
+	start = wall_time();
+	cpu = thread_cpu_time();
+
+	ret = write_torrent(t, inputfile);
+
+	if (outfp != NULL)
+	{
+		if (fclose(outfp) != 0 && ret == 0)
+		{
+			ret = diag_err(&t->diag, "error writing to %s",
+				outfile);
+		}
+		t->stats.write.calls++;
+
+		// Don't leave a half-written torrent lying around.
+		if (ret == -1)
+			remove(outfile);
+	}
+
+	if (ret == 0 && t->opts.fastresume && t->opts.nshards == 0)
+	{
+		if (inputfile == NULL)
+		{
+			diag_warnx(&t->diag, "no resume data for a stream, "
+				"whose data is elsewhere");
+		}
+		else if (t->opts.tar)
+		{
+			diag_warnx(&t->diag, "no resume data for a tar "
+				"archive, whose data is still in it");
+		}
+		else if (t->remote != NULL)
+		{
+			diag_warnx(&t->diag, "no resume data for data on a "
+				"server");
+		}
+		else
+			ret = write_fastresume(t, inputfile, t->outname);
+	}
+
+	if (ret == 0 && t->entry != NULL)
+		ret = add_to_index(t);
+	pi_entry_free(t->entry);
+	t->entry = NULL;
+
+	// Keep the checkpoint unless the torrent was written.
+	if (t->ckpt != NULL)
+	{
+		ckpt_close(t->ckpt, ret == 0);
+		t->ckpt = NULL;
+	}
+	free(t->shardname);
+	t->shardname = NULL;
+	free(t->autoname);
+	t->autoname = NULL;
+	if (t->remote != NULL)
+		http_source_free(t->remote);
+	t->remote = NULL;
+
+	if (t->write_start != 0)
+	{
+		t->stats.write.wall = wall_time() - t->write_start;
+		t->stats.write.cpu = thread_cpu_time() - t->write_cpu;
+	}
+	t->stats.wall = wall_time() - start;
+	t->stats.cpu += thread_cpu_time() - cpu;
+	return ret;
+}
+
+int torrent_create(struct torrent *t, const char *inputfile,
+	const char *name, const char *outfile)
+{
+	diag_init(&t->diag, t->opts.warning, t->opts.cbarg);
+	t->infd = t->teefd = -1;
+	return create(t, inputfile, name, outfile);
+}
+
+int torrent_create_stream(struct torrent *t, int fd, int teefd,
+	const char *name, const char *outfile)
+{
+	diag_init(&t->diag, t->opts.warning, t->opts.cbarg);
+	if (name == NULL)
+		return diag_errx(&t->diag, "a stream needs a name");
+	if (t->opts.nshards > 0 || t->opts.merge > 0)
+		return diag_errx(&t->diag, "a stream can't be sharded");
+
+	// The order of the files isn't known until all of the archive has
+	// gone by.
+	if (t->opts.tar)
+	{
+		return diag_errx(&t->diag, "a tar archive can't be read "
+			"from a stream");
+	}
+	t->infd = fd;
+	t->teefd = teefd;
+	return create(t, NULL, name, outfile);
+}
+
+int torrent_edit(struct torrent *t, const char *inputfile,
+	const struct torrent_changes *c, const char *outfile)
+{
+	unsigned char oldhash[SHA1_DIGEST_LENGTH];
+	unsigned char newhash[SHA1_DIGEST_LENGTH];
+	char oldhex[2 * SHA1_DIGEST_LENGTH + 1];
+	char newhex[2 * SHA1_DIGEST_LENGTH + 1];
+	struct stat sb;
+	unsigned char *buf;
+	char *tmpname = NULL;
+	FILE *outfp = NULL;
+	double start, cpu;
+	int fd;
+	int ret;
+
+	diag_init(&t->diag, t->opts.warning, t->opts.cbarg);
+	t->outname = outfile != NULL ? outfile : "output";
+	memset(&t->stats, 0, sizeof t->stats);
+	start = wall_time();
+	cpu = thread_cpu_time();
+
+	fd = open(inputfile, O_RDONLY);
+	if (fd == -1)
+		return diag_err(&t->diag, "cannot open %s", inputfile);
+	if (fstat(fd, &sb) == -1)
+	{
+		diag_err(&t->diag, "cannot stat %s", inputfile);
+		close(fd);
+		return -1;
+	}
+	if (sb.st_size == 0)
+	{
+		close(fd);
+		return diag_errx(&t->diag, "%s is empty", inputfile);
+	}
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return diag_err(&t->diag, "cannot map %s", inputfile);
+
+	// Write to a new file and rename it into place, as outfile may be
+	// the one being read.
+	if (t->opts.write != NULL)
+	{
+		t->sink = t->opts.write;
+		t->sinkarg = t->opts.writearg;
+	}
+	else
+	{
+		tmpname = xm(1, strlen(outfile) + strlen(".tmp") + 1);
+		strcpy(tmpname, outfile);
+		strcat(tmpname, ".tmp");
+		outfp = fopen(tmpname, "wb");
+		if (outfp == NULL)
+		{
+			diag_err(&t->diag, "cannot create %s", tmpname);
+			free(tmpname);
+			munmap(buf, sb.st_size);
+			return -1;
+		}
+		t->sink = benc_write_file;
+		t->sinkarg = outfp;
+	}
+	benc_init(&t->out, counted_write, t);
+
+	ret = edit_torrent(inputfile, buf, sb.st_size, c, &t->out, oldhash,
+		newhash, &t->diag);
+	if (ret == 0 && benc_flush(&t->out) == -1)
+		ret = diag_err(&t->diag, "error writing to %s", t->outname);
+	munmap(buf, sb.st_size);
+
+	if (outfp != NULL)
+	{
+		if (fclose(outfp) != 0 && ret == 0)
+		{
+			ret = diag_err(&t->diag, "error writing to %s",
+				tmpname);
+		}
+		if (ret == 0 && rename(tmpname, outfile) == -1)
+		{
+			ret = diag_err(&t->diag, "cannot rename %s to %s",
+				tmpname, outfile);
+		}
+		if (ret == -1)
+			remove(tmpname);
+		free(tmpname);
+	}
+
+	if (ret == 0)
+	{
+		hex(oldhex, oldhash, SHA1_DIGEST_LENGTH);
+		hex(newhex, newhash, SHA1_DIGEST_LENGTH);
+		if (strcmp(oldhex, newhex) != 0)
+		{
+			diag_warnx(&t->diag, "%s has a new info-hash, %s (was "
+				"%s): peers will see it as a different torrent",
+				t->outname, newhex, oldhex);
+		}
+		else
+			info(t, "info-hash: %s", newhex);
+	}
 
-	fclose(out);
+	t->stats.wall = t->stats.write.wall = wall_time() - start;
+	t->stats.cpu = t->stats.write.cpu = thread_cpu_time() - cpu;
+	return ret;
 }
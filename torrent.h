@@ -1,5 +1,286 @@
-void create_torrent(const char *filename, const char *inputfile,
-	const char *rename, int piecesize, int private, int quiet,
-	int sortext,
-	int num_tracker_urls, const char *const *tracker_urls,
-	int num_ignore_patterns, const char *const *ignore_patterns);
+// libtorrentize: creating BitTorrent metainfo files.
+//
+// Fill in a struct torrent_opts (starting from torrent_defaults()), make a
+// struct torrent from it, and call torrent_create() once for each input.
+// A struct torrent holds all the state for the torrents made with it, so
+// several can be used at once from different threads. Those can share one
+// pool of hashing threads, so a big torrent gets all of them to itself
+// while small ones are hashed side by side.
+
+#include <stddef.h>
+
+// Per-file checksums that can be computed, for torrent_opts.checksums.
+#define TORRENT_SHA1 1
+#define TORRENT_MD5 2
+#define TORRENT_SHA256 4
+
+// Inputs starting with this are data on a server; see torrent_create().
+#define TORRENT_REMOTE "s3+http://"
+
+struct torrent_opts
+{
+	int piece_kb;		// piece size in kilobytes
+	int private;		// mark torrents private
+	int sort_by_ext;	// order files by extension first
+	int physical_order;	// read files in on-disk order
+	int per_device;		// use a reader thread per device
+	int hash_threads;	// 0 to hash in the reader threads
+	struct torrent_pool *pool; // shared hashing threads, or NULL
+	struct torrent_throttle *throttle; // limits, or NULL
+	struct torrent_tuning *tuning; // pick thread counts, or NULL
+	int memory_limit;	// in megabytes, or 0 for none
+	int verbose;		// pass extra information to info()
+	int checksums;		// per-file TORRENT_SHA1 etc. to compute
+	int checkpoint;		// seconds between checkpoints, 0 for none
+	int resume;		// carry on from a checkpoint if there is one
+	int shard, nshards;	// hash only shard (from 1) of nshards
+	int merge;		// put together from this many shards
+	int fastresume;		// also write libtorrent resume data
+	int tar;		// inputs are tar archives to look inside
+	int connections;	// to a server at once, 0 for the default
+	struct torrent_index *index; // to add torrents to, or NULL
+	int reuse;		// check files found in the index against it
+
+	const char *const *tracker_urls;
+	int num_tracker_urls;
+	const char *comment;	// or NULL for none
+	const char *const *ignore_patterns;
+	int num_ignore_patterns;
+
+	// Called with the name of each file as reading it starts. With
+	// more than one reader, calls may come from several threads at
+	// once. NULL for no progress.
+	void (*progress)(void *arg, const char *name);
+
+	// Called with warnings, and with extra information if verbose is
+	// set. Either may be NULL.
+	void (*warning)(void *arg, const char *msg);
+	void (*info)(void *arg, const char *msg);
+
+	// Called with each file's checksums in hex, in torrent order, once
+	// they are all done. name is the file's path within the torrent,
+	// starting with the torrent's name. SHA-1 and MD5 sums also go in
+	// the torrent, as each file's sha1 and md5sum. May be NULL.
+	void (*checksum)(void *arg, const char *name, const char *algo,
+		const char *hex);
+
+	void *cbarg;		// passed to the callbacks above
+
+	// Where to write the torrent, returning 0 on success or -1 on
+	// error. If NULL, the torrent is written to the output filename
+	// passed to torrent_create().
+	int (*write)(void *arg, const void *buf, size_t len);
+	void *writearg;
+};
+
+struct torrent;
+
+void torrent_defaults(struct torrent_opts *opts);
+
+// On machines with several NUMA nodes, readers and hashing threads are
+// spread over the nodes, and each piece is read into memory on the node
+// its reader runs on, and hashed there, as found from sysfs. This sets the
+// layout instead: "off" to pay nodes no attention, or the CPUs of each
+// node as lists like "0-7,16-23", separated by slashes. It must come
+// before any torrents or pools are made. Returns -1 if layout makes no
+// sense.
+int torrent_numa(const char *layout);
+
+// A pool of hashing threads for torrents to share, in place of each using
+// hash_threads of its own. Returns NULL if the threads can't be created.
+// It must outlive every torrent using it.
+struct torrent_pool *torrent_pool_new(int nthreads);
+void torrent_pool_free(struct torrent_pool *pool);
+
+// Limits on reading, so that making torrents can share a machine with
+// other work: at most max_rate bytes and max_iops reads (counting opening
+// files) a second, and cpu_share percent of one CPU (200 for two), with 0
+// for no limit. With adaptive set, reading also backs off when the disk
+// seems busy with other work. Torrents sharing a throttle are limited
+// together. It must outlive every torrent using it.
+struct torrent_throttle *torrent_throttle_new(long long max_rate,
+	int max_iops, int cpu_share, int adaptive);
+void torrent_throttle_free(struct torrent_throttle *th);
+
+// Working out as it goes how many threads to read and hash with, in place
+// of hash_threads and per_device, for the torrents sharing it. Each device
+// (or server) is read by as many readers as make it faster, sharing its
+// files between them, and the hashing threads follow how fast the data
+// comes in: more while readers wait on them, fewer while some are idle,
+// up to hash_threads or the number of CPUs. With cache_path given, what
+// is settled on for each device is read from that file, to start from,
+// and torrent_tuning_save() writes it back. It must outlive every torrent
+// using it.
+struct torrent_tuning *torrent_tuning_new(const char *cache_path);
+int torrent_tuning_save(struct torrent_tuning *tu);
+void torrent_tuning_free(struct torrent_tuning *tu);
+
+// An index of the pieces and files of every torrent made with it as
+// opts.index, kept in the file at path, which only ever grows and may be
+// shared by many processes at once. It's created if it doesn't exist and
+// create is set; without create, it's only for torrent_index_lookup().
+// Returns NULL with errno set on error. It must outlive every torrent
+// using it.
+//
+// Files are known by their length and a fingerprint of their content,
+// worked out from the data as it's read. For files over a megabyte, it's
+// of blocks sampled through them, so a file changed in place can keep its
+// fingerprint, and a match is only a candidate. With opts.reuse, files
+// found that start at a piece boundary, as they did in the torrent they
+// were indexed with, still have every piece hashed, and their whole
+// pieces' digests are checked against the index's; a file whose digests
+// differ has changed since, and gets a warning.
+struct torrent_index *torrent_index_open(const char *path, int create);
+void torrent_index_close(struct torrent_index *ix);
+
+struct torrent_index_match
+{
+	const char *torrent;	// the path it was written to
+	const char *info_hash;	// in hex
+	const char *file;	// its path in the torrent, after its name
+	int piece;		// for a digest, which piece; otherwise -1
+};
+
+// Find the torrents holding query, which is either a piece's SHA-1 digest
+// in hex, or the name of a file to look for torrents with the same
+// content. found is called for each file the piece falls in, or with the
+// same content, and mustn't use ix. Returns how many were found, or -1
+// with errno set if query is a file that can't be read.
+int torrent_index_lookup(struct torrent_index *ix, const char *query,
+	void (*found)(void *arg, const struct torrent_index_match *m),
+	void *arg);
+
+// The options are copied, but the strings they point to must stay around
+// until torrent_free(). Hashing threads and piece buffers are kept until
+// then too, so making many torrents with one struct torrent doesn't set
+// them up again each time.
+struct torrent *torrent_new(const struct torrent_opts *opts);
+void torrent_free(struct torrent *t);
+
+// Make a torrent of inputfile, a file or directory, writing it to outfile
+// (or the write callback, in which case outfile is only used in
+// messages). name is the name to give it in the torrent, or NULL to use
+// inputfile. Returns 0 on success, or -1 with torrent_error() describing
+// what went wrong.
+//
+// With opts.checkpoint set, the piece hashes worked out so far are saved
+// that often to outfile with .part added, which is removed once the
+// torrent is written. With opts.resume, a torrent whose files are the
+// same as when the checkpoint was saved carries on from there. Resuming
+// is skipped with per-file checksums, which need every file read.
+//
+// With opts.nshards set, the pieces are split into that many runs, and
+// only the opts.shard'th is hashed; no torrent is written, but the
+// digests go to outfile with .shardKofN added (.shard2of4, say). Several
+// machines with the same files can each hash one shard, and with
+// opts.merge set to the number of shards, the torrent is then put
+// together from those files alone, reading no data. The files must have
+// the same names, sizes and modification times everywhere.
+//
+// With opts.fastresume, resume data for clients using libtorrent is
+// written beside the torrent, with .fastresume in place of .torrent. It
+// says that every piece is there, and where, so the client can start
+// seeding the data without checking it all first.
+//
+// With opts.tar, inputfile is a tar archive, and the torrent is of what
+// extracting it would give, made without extracting it: the files are
+// listed from its headers, and their data read from where it lies in the
+// archive, in one pass from start to end. If everything is in one
+// directory, that is the torrent's top directory, and its name unless
+// name is given; if the archive holds a single file outside of any
+// directory, the torrent is of that file. Otherwise the torrent is named
+// after the archive, without .tar.
+//
+// An inputfile starting s3+http:// is data on an S3-compatible server,
+// read with HTTP range requests, piece by piece, over opts.connections
+// connections at once (8 by default), so the pieces come in out of order.
+// The rest is a path-style URL, http://host[:port]/bucket/key: if the key
+// ends in a slash, or there's no key, the torrent is of every object
+// under it, named after its last part (or the bucket); otherwise it's of
+// the one object. Files are in the order they would be once copied to
+// disk, and can be ignored as usual.
+int torrent_create(struct torrent *t, const char *inputfile,
+	const char *name, const char *outfile);
+
+// Like torrent_create(), but for a single file whose data is read from fd
+// until the end, such as a pipe. The data is hashed as it arrives, and if
+// teefd isn't -1, also written there, so it doesn't have to be saved
+// first and read back. name is required.
+int torrent_create_stream(struct torrent *t, int fd, int teefd,
+	const char *name, const char *outfile);
+
+// Changes for torrent_edit() to make to an existing torrent.
+struct torrent_changes
+{
+	// New trackers to replace the old ones, if there are any.
+	const char *const *tracker_urls;
+	int num_tracker_urls;
+
+	const char *comment;	// "" to remove it, NULL to leave it
+	const char *name;	// NULL to leave it
+	int private;		// 1 or 0 to set or clear, -1 to leave it
+};
+
+// Copy the torrent in inputfile to outfile (or the write callback), which
+// may be the same file, with changes made, and without reading the data
+// it describes: the pieces and everything else left alone are copied as
+// they are. A new name or private flag gives the torrent a new info-hash,
+// which peers see as a different torrent, so is warned about. Returns 0
+// on success, or -1 with torrent_error() describing what went wrong.
+int torrent_edit(struct torrent *t, const char *inputfile,
+	const struct torrent_changes *c, const char *outfile);
+
+const char *torrent_error(const struct torrent *t);
+
+// One stage of making a torrent, for torrent_stats(). Times are in
+// seconds, with CPU time summed over the threads doing the work. Stall
+// time is time spent blocked on the following stage: for reading, waiting
+// for piece buffers to come back from hashing or for room in its queue;
+// for writing, waiting on the output. Throttled time is time spent held
+// back by opts.throttle.
+struct torrent_stage
+{
+	double wall;		// from the stage's start to its end
+	double cpu;
+	double stall;
+	double throttled;
+	long long bytes;
+	long long calls;	// system calls, roughly
+	long long items;	// directory entries, files, or pieces
+};
+
+struct torrent_stats
+{
+	double wall, cpu;	// the whole torrent
+
+	// Listing directories, stat()ing the files found, reading them in,
+	// hashing the pieces, and encoding and writing out the torrent.
+	// Reading and hashing overlap.
+	struct torrent_stage scan, stat, read, hash, write;
+
+	int readers;		// reader threads (at the end, if tuning)
+	int hashers;		// hashing threads, 0 if the readers hashed
+	int queue_limit;	// room in the hashing queue (at the end)
+	int max_queue;		// most pieces queued for hashing at once
+	int max_pending;	// most partly filled pieces at once
+	int max_buffers;	// most piece buffers in use at once
+	int reused;		// pieces hashed the same as in the index
+};
+
+// Figures for the last torrent made with t, whether it worked or not.
+const struct torrent_stats *torrent_stats(const struct torrent *t);
+
+// How far along the torrent being made with t is. The totals are known
+// once its files have been listed, except for a stream, whose length
+// stays 0. Once a torrent is done, its figures stay until the next one
+// starts. all_bytes and all_files count everything t has done, so rates
+// can be worked out across torrents.
+struct torrent_progress
+{
+	long long total_bytes, done_bytes;
+	int total_files, done_files;
+	long long all_bytes, all_files;
+};
+
+// Safe to call from any thread, while torrent_create() runs in another.
+void torrent_progress(struct torrent *t, struct torrent_progress *p);
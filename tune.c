@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "xm.h"
+#include "tune.h"
+
+// Longest device name kept.
+#define DEV_LEN 256
+
+// A change is given this many intervals to take effect before it's judged.
+#define SETTLE_STEPS 1
+
+// More readers are kept if they make it this much faster...
+#define GAIN 1.05
+
+// ... and fewer if they keep it at least this fast.
+#define LOSS 0.97
+
+// After a change that didn't help, leave a device alone this long.
+#define COOLDOWN_STEPS 8
+
+// Readers waiting for room in the hashing queue for this share of the
+// time means hashing is what holds them up.
+#define HASH_BOUND 0.2
+
+// Drop a hashing thread when more than this many have been idle.
+#define HASH_SPARE 1.5
+
+struct entry
+{
+	char *dev;
+	int readers, hashers;
+	double rate;		// bytes a second
+};
+
+struct tuning
+{
+	char *path;
+	pthread_mutex_t lock;
+	struct entry *entries;
+	int n, s;
+};
+
+struct tuner
+{
+	int nruns;
+	int *maxreaders;
+	int maxhashers;
+
+	// Intervals until each device is tried again, and which way the
+	// last try on it went.
+	int *cooldown;
+	int *lastdir;
+	int next_run;		// the device to try next
+
+	// The change on trial: readers on trial_run changed by trial_dir,
+	// from a rate of trial_base. trial_run is -1 with none.
+	int trial_run, trial_dir;
+	double trial_base;
+
+	int settle;		// intervals left before judging
+	int nsteps;
+};
+
+static struct entry *find(struct tuning *tu, const char *dev)
+{
+	int ix;
+
+	for (ix = 0; ix < tu->n; ix++)
+	{
+		if (strcmp(tu->entries[ix].dev, dev) == 0)
+			return &tu->entries[ix];
+	}
+	return NULL;
+}
+
+static void put(struct tuning *tu, const char *dev, int readers,
+	int hashers, double rate)
+{
+	struct entry *e;
+
+	e = find(tu, dev);
+	if (e == NULL)
+	{
+		XPND(tu->entries, tu->n, tu->s);
+		e = &tu->entries[tu->n++];
+		e->dev = xsd(dev);
+	}
+	e->readers = readers;
+	e->hashers = hashers;
+	e->rate = rate;
+}
+
+// Lines of the file are a device, the readers and hashers settled on for
+// it, and the rate they got in MB a second.
+static void load(struct tuning *tu)
+{
+	FILE *fp;
+	char line[DEV_LEN + 64];
+	char dev[DEV_LEN];
+	int readers, hashers;
+	double rate;
+
+	fp = fopen(tu->path, "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof line, fp) != NULL)
+	{
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%255s %d %d %lf", dev, &readers, &hashers,
+			&rate) != 4 || readers < 1 || hashers < 0)
+		{
+			continue;
+		}
+		put(tu, dev, readers, hashers, rate * 1024 * 1024);
+	}
+	fclose(fp);
+}
+
+struct tuning *tuning_new(const char *path)
+{
+	struct tuning *tu;
+
+	tu = xm(sizeof *tu, 1);
+	tu->path = path != NULL ? xsd(path) : NULL;
+	pthread_mutex_init(&tu->lock, NULL);
+	tu->entries = NULL;
+	tu->n = tu->s = 0;
+	if (path != NULL)
+		load(tu);
+	return tu;
+}
+
+void tuning_free(struct tuning *tu)
+{
+	int ix;
+
+	for (ix = 0; ix < tu->n; ix++)
+		free(tu->entries[ix].dev);
+	free(tu->entries);
+	free(tu->path);
+	pthread_mutex_destroy(&tu->lock);
+	free(tu);
+}
+
+int tuning_get(struct tuning *tu, const char *dev, int *readers,
+	int *hashers)
+{
+	struct entry *e;
+	int ret = -1;
+
+	pthread_mutex_lock(&tu->lock);
+	e = find(tu, dev);
+	if (e != NULL)
+	{
+		*readers = e->readers;
+		*hashers = e->hashers;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&tu->lock);
+	return ret;
+}
+
+void tuning_put(struct tuning *tu, const char *dev, int readers,
+	int hashers, double rate)
+{
+	if (strlen(dev) >= DEV_LEN)
+		return;
+	pthread_mutex_lock(&tu->lock);
+	put(tu, dev, readers, hashers, rate);
+	pthread_mutex_unlock(&tu->lock);
+}
+
+// Written to a new file, then renamed over the old one, so that it's
+// never left half written.
+int tuning_save(struct tuning *tu)
+{
+	FILE *fp;
+	char *tmp;
+	int ix;
+	int ret = 0;
+	int saved;
+
+	if (tu->path == NULL)
+		return 0;
+	tmp = xm(1, strlen(tu->path) + sizeof ".tmp");
+	strcpy(tmp, tu->path);
+	strcat(tmp, ".tmp");
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+	{
+		free(tmp);
+		return -1;
+	}
+	pthread_mutex_lock(&tu->lock);
+	fprintf(fp, "# device readers hashers MB/s\n");
+	for (ix = 0; ix < tu->n; ix++)
+	{
+		fprintf(fp, "%s %d %d %.1f\n", tu->entries[ix].dev,
+			tu->entries[ix].readers, tu->entries[ix].hashers,
+			tu->entries[ix].rate / (1024 * 1024));
+	}
+	pthread_mutex_unlock(&tu->lock);
+
+	if (fclose(fp) != 0 || rename(tmp, tu->path) == -1)
+	{
+		saved = errno;
+		remove(tmp);
+		errno = saved;
+		ret = -1;
+	}
+	free(tmp);
+	return ret;
+}
+
+struct tuner *tuner_new(int nruns, const int *maxreaders, int maxhashers)
+{
+	struct tuner *tn;
+	int ix;
+
+	tn = xm(sizeof *tn, 1);
+	tn->nruns = nruns;
+	tn->maxreaders = xm(sizeof tn->maxreaders[0], nruns + 1);
+	tn->cooldown = xm(sizeof tn->cooldown[0], nruns + 1);
+	tn->lastdir = xm(sizeof tn->lastdir[0], nruns + 1);
+	for (ix = 0; ix < nruns; ix++)
+	{
+		tn->maxreaders[ix] = maxreaders[ix];
+		tn->cooldown[ix] = 0;
+		tn->lastdir[ix] = 1;
+	}
+	tn->maxhashers = maxhashers;
+	tn->next_run = 0;
+	tn->trial_run = -1;
+	tn->settle = SETTLE_STEPS;
+	tn->nsteps = 0;
+	return tn;
+}
+
+void tuner_free(struct tuner *tn)
+{
+	free(tn->maxreaders);
+	free(tn->cooldown);
+	free(tn->lastdir);
+	free(tn);
+}
+
+int tuner_steps(const struct tuner *tn)
+{
+	return tn->nsteps;
+}
+
+// Start trying one more or one fewer reader on a device, whichever wasn't
+// tried last time unless it's the only way to go.
+static int try_readers(struct tuner *tn, int run, int *readers,
+	double rate)
+{
+	int dir;
+
+	dir = tn->lastdir[run];
+	if (readers[run] + dir < 1 || readers[run] + dir > tn->maxreaders[run])
+		dir = -dir;
+	if (readers[run] + dir < 1 || readers[run] + dir > tn->maxreaders[run])
+		return 0;
+
+	readers[run] += dir;
+	tn->trial_run = run;
+	tn->trial_dir = dir;
+	tn->trial_base = rate;
+	return 1;
+}
+
+// Judge the reader change on trial, keeping it and trying the same way
+// again, or undoing it and leaving that device be for a while.
+static int judge(struct tuner *tn, int *readers, double rate)
+{
+	int run = tn->trial_run;
+	int dir = tn->trial_dir;
+
+	tn->trial_run = -1;
+	if (dir > 0 ? rate > tn->trial_base * GAIN
+		: rate >= tn->trial_base * LOSS)
+	{
+		tn->lastdir[run] = dir;
+		return try_readers(tn, run, readers, rate);
+	}
+
+	readers[run] -= dir;
+	tn->lastdir[run] = -dir;
+	tn->cooldown[run] = COOLDOWN_STEPS;
+	return 1;
+}
+
+int tuner_step(struct tuner *tn, const struct tune_sample *s, int *readers,
+	int *hashers)
+{
+	double rate, busy;
+	int changed = 0;
+	int ix, run;
+
+	tn->nsteps++;
+	if (tn->settle > 0)
+	{
+		tn->settle--;
+		return 0;
+	}
+	rate = s->bytes / s->secs;
+	busy = s->hash_cpu / s->secs;
+
+	if (tn->trial_run != -1)
+		changed = judge(tn, readers, rate);
+	else if (s->queue_stall / s->secs >= HASH_BOUND)
+	{
+		// Hashing holds the readers up, so more of them wouldn't
+		// help; more hashing threads might.
+		if (*hashers < tn->maxhashers)
+		{
+			(*hashers)++;
+			changed = 1;
+		}
+	}
+	else if (*hashers > 1 && *hashers - busy > HASH_SPARE)
+	{
+		(*hashers)--;
+		changed = 1;
+	}
+	else if (rate > 0)
+	{
+		for (ix = 0; ix < tn->nruns && !changed; ix++)
+		{
+			run = (tn->next_run + ix) % tn->nruns;
+			if (tn->cooldown[run] > 0)
+				tn->cooldown[run]--;
+			else
+				changed = try_readers(tn, run, readers, rate);
+		}
+		tn->next_run = (tn->next_run + ix) % tn->nruns;
+	}
+
+	if (changed)
+		tn->settle = SETTLE_STEPS;
+	return changed;
+}
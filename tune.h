@@ -0,0 +1,50 @@
+// Working out how many threads to read and hash with. Several readers at
+// once help SSDs and network filesystems, which do best with many requests
+// in flight, but hurt disks that have to seek between them; and how many
+// hashing threads are needed depends on how fast the data comes in. A
+// tuner tries changes as a torrent is made, keeping those that make it
+// faster, and what it settles on can be remembered for each device, to
+// start from the next time.
+
+struct tuning;
+struct tuner;
+
+// Numbers remembered per device, kept in the file at path, which needn't
+// exist yet, or only in memory if path is NULL. Lines of the file that
+// can't be made sense of are left out. May be shared by any number of
+// threads.
+struct tuning *tuning_new(const char *path);
+void tuning_free(struct tuning *tu);
+
+// Look up what was settled on for dev, returning -1 if nothing was.
+int tuning_get(struct tuning *tu, const char *dev, int *readers,
+	int *hashers);
+void tuning_put(struct tuning *tu, const char *dev, int readers,
+	int hashers, double rate);
+
+// Write the numbers out, returning -1 with errno set on failure.
+int tuning_save(struct tuning *tu);
+
+// Tuning one torrent, read by up to maxreaders[ix] threads from each of
+// nruns devices and hashed by up to maxhashers threads.
+struct tuner *tuner_new(int nruns, const int *maxreaders, int maxhashers);
+void tuner_free(struct tuner *tn);
+
+// What happened over the last interval.
+struct tune_sample
+{
+	double secs;
+	long long bytes;	// hashed
+	double queue_stall;	// readers waiting for room to queue pieces
+	double hash_cpu;	// spent hashing
+};
+
+// Decide what to try next from the last interval, changing readers[] (the
+// number reading from each device) and *hashers in place. Returns 1 if
+// either changed.
+int tuner_step(struct tuner *tn, const struct tune_sample *s, int *readers,
+	int *hashers);
+
+// How many intervals have been looked at, as a sign of how much to trust
+// the numbers settled on.
+int tuner_steps(const struct tuner *tn);
@@ -0,0 +1,421 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xm.h"
+#include "diag.h"
+#include "watch.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+// What to hear about, the same in the spool directory itself as in
+// directories within it: anything that starts or ends an entry, or means
+// it isn't settled yet.
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+	| IN_DELETE | IN_MODIFY | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// A watched directory.
+struct wdir
+{
+	int wd;
+	char *path;
+	char *top;		// entry it belongs to, or NULL for the spool
+};
+
+// An entry that has changed, and when it last did.
+struct entry
+{
+	char *name;
+	long long changed;	// in milliseconds
+};
+
+struct watch
+{
+	char *dirname;
+	int settle_ms;
+	int fd;
+	int root;		// watch descriptor of the spool directory
+	struct diag *diag;
+	int overflowed;		// already warned about lost events
+
+	struct wdir *dirs;
+	int ndirs, sdirs;
+
+	struct entry *pending;
+	int npending, spending;
+};
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int skip_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	return name[0] == '.' || (len >= 8
+		&& strcmp(name + len - 8, ".torrent") == 0);
+}
+
+static char *join(const char *dir, const char *name)
+{
+	char *path;
+
+	path = xm(1, strlen(dir) + strlen(name) + 2);
+	strcpy(path, dir);
+	strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+// Watch a directory within entry top, and everything inside it, since
+// files may already have been put there before the watch was added.
+static void add_tree(struct watch *w, const char *path, const char *top)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat sb;
+	char *sub;
+	int wd;
+	int ix;
+
+	wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+	if (wd == -1)
+	{
+		diag_warnx(w->diag, "cannot watch %s: %s", path,
+			strerror(errno));
+		return;
+	}
+	for (ix = 0; ix < w->ndirs && w->dirs[ix].wd != wd; ix++)
+		;
+	if (ix == w->ndirs)
+	{
+		XPND(w->dirs, w->ndirs, w->sdirs);
+		w->dirs[w->ndirs].wd = wd;
+		w->dirs[w->ndirs].path = xsd(path);
+		w->dirs[w->ndirs].top = xsd(top);
+		w->ndirs++;
+	}
+
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0
+			|| strcmp(de->d_name, "..") == 0)
+		{
+			continue;
+		}
+		sub = join(path, de->d_name);
+		if (lstat(sub, &sb) == 0 && S_ISDIR(sb.st_mode))
+			add_tree(w, sub, top);
+		free(sub);
+	}
+	closedir(dir);
+}
+
+// Stop watching the directories of an entry that has gone away or been
+// handed out. They're forgotten at once, so that events already queued
+// for them don't bring the entry back.
+static void drop_tree(struct watch *w, const char *top)
+{
+	int ix;
+
+	for (ix = 0; ix < w->ndirs; )
+	{
+		if (w->dirs[ix].top != NULL
+			&& strcmp(w->dirs[ix].top, top) == 0)
+		{
+			inotify_rm_watch(w->fd, w->dirs[ix].wd);
+			free(w->dirs[ix].path);
+			free(w->dirs[ix].top);
+			w->dirs[ix] = w->dirs[--w->ndirs];
+		}
+		else
+			ix++;
+	}
+}
+
+static void forget_dir(struct watch *w, int wd)
+{
+	int ix;
+
+	for (ix = 0; ix < w->ndirs; ix++)
+	{
+		if (w->dirs[ix].wd == wd)
+		{
+			free(w->dirs[ix].path);
+			free(w->dirs[ix].top);
+			w->dirs[ix] = w->dirs[--w->ndirs];
+			return;
+		}
+	}
+}
+
+static struct wdir *find_dir(struct watch *w, int wd)
+{
+	int ix;
+
+	for (ix = 0; ix < w->ndirs; ix++)
+	{
+		if (w->dirs[ix].wd == wd)
+			return &w->dirs[ix];
+	}
+	return NULL;
+}
+
+// Note a change to an entry. Unless add is set, only entries already
+// pending are affected; a file that is still being written isn't ready
+// to wait on until it's closed.
+static void touch(struct watch *w, const char *name, int add)
+{
+	int ix;
+
+	for (ix = 0; ix < w->npending; ix++)
+	{
+		if (strcmp(w->pending[ix].name, name) == 0)
+		{
+			w->pending[ix].changed = now_ms();
+			return;
+		}
+	}
+	if (!add)
+		return;
+	XPND(w->pending, w->npending, w->spending);
+	w->pending[w->npending].name = xsd(name);
+	w->pending[w->npending].changed = now_ms();
+	w->npending++;
+}
+
+static void forget(struct watch *w, const char *name)
+{
+	int ix;
+
+	for (ix = 0; ix < w->npending; ix++)
+	{
+		if (strcmp(w->pending[ix].name, name) == 0)
+		{
+			free(w->pending[ix].name);
+			w->pending[ix] = w->pending[--w->npending];
+			return;
+		}
+	}
+}
+
+static void handle_event(struct watch *w, const struct inotify_event *ev)
+{
+	struct wdir *wdir;
+	char *path;
+
+	if (ev->mask & IN_Q_OVERFLOW)
+	{
+		if (!w->overflowed)
+		{
+			diag_warnx(w->diag, "too many changes in %s at once; "
+				"some were missed", w->dirname);
+		}
+		w->overflowed = 1;
+		return;
+	}
+	if (ev->mask & IN_IGNORED)
+	{
+		forget_dir(w, ev->wd);
+		return;
+	}
+	if ((wdir = find_dir(w, ev->wd)) == NULL)
+		return;
+
+	if (wdir->top != NULL)
+	{
+		// Anything inside an entry counts as a change to it.
+		if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+			&& (ev->mask & IN_ISDIR))
+		{
+			path = join(wdir->path, ev->name);
+			add_tree(w, path, wdir->top);
+			free(path);
+		}
+		touch(w, wdir->top, 1);
+		return;
+	}
+
+	if (ev->len == 0 || skip_name(ev->name))
+		return;
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+	{
+		if (ev->mask & IN_ISDIR)
+			drop_tree(w, ev->name);
+		forget(w, ev->name);
+	}
+	else if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+		&& (ev->mask & IN_ISDIR))
+	{
+		path = join(w->dirname, ev->name);
+		add_tree(w, path, ev->name);
+		free(path);
+		touch(w, ev->name, 1);
+	}
+	else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		touch(w, ev->name, 1);
+	else
+		touch(w, ev->name, 0);
+}
+
+struct watch *watch_new(const char *dirname, int settle_ms, struct diag *d)
+{
+	struct watch *w;
+	int wd;
+
+	w = xm(sizeof *w, 1);
+	w->dirname = xsd(dirname);
+	w->settle_ms = settle_ms;
+	w->diag = d;
+	w->overflowed = 0;
+	w->dirs = NULL;
+	w->ndirs = w->sdirs = 0;
+	w->pending = NULL;
+	w->npending = w->spending = 0;
+
+	w->fd = inotify_init1(IN_CLOEXEC);
+	if (w->fd == -1)
+	{
+		diag_err(d, "cannot watch %s", dirname);
+		free(w->dirname);
+		free(w);
+		return NULL;
+	}
+	wd = inotify_add_watch(w->fd, dirname, WATCH_MASK);
+	if (wd == -1)
+	{
+		diag_err(d, "cannot watch %s", dirname);
+		watch_free(w);
+		return NULL;
+	}
+	XPND(w->dirs, w->ndirs, w->sdirs);
+	w->dirs[w->ndirs].wd = wd;
+	w->dirs[w->ndirs].path = xsd(dirname);
+	w->dirs[w->ndirs].top = NULL;
+	w->ndirs++;
+	w->root = wd;
+
+	return w;
+}
+
+void watch_free(struct watch *w)
+{
+	int ix;
+
+	close(w->fd);
+	for (ix = 0; ix < w->ndirs; ix++)
+	{
+		free(w->dirs[ix].path);
+		free(w->dirs[ix].top);
+	}
+	for (ix = 0; ix < w->npending; ix++)
+		free(w->pending[ix].name);
+	free(w->dirs);
+	free(w->pending);
+	free(w->dirname);
+	free(w);
+}
+
+char *watch_next(struct watch *w)
+{
+	union
+	{
+		struct inotify_event ev;
+		char space[65536];
+	} u;
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	long long now, due, soonest;
+	ssize_t len;
+	char *path;
+	int ix;
+	int ret;
+
+	for (;;)
+	{
+		now = now_ms();
+		soonest = -1;
+		for (ix = 0; ix < w->npending; ix++)
+		{
+			due = w->pending[ix].changed + w->settle_ms;
+			if (due <= now)
+			{
+				// It's settled and taken now.
+				path = join(w->dirname, w->pending[ix].name);
+				drop_tree(w, w->pending[ix].name);
+				forget(w, w->pending[ix].name);
+				return path;
+			}
+			if (soonest == -1 || due < soonest)
+				soonest = due;
+		}
+
+		pfd.fd = w->fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, soonest == -1 ? -1 : (int)(soonest - now));
+		if (ret == -1 && errno != EINTR)
+		{
+			diag_err(w->diag, "cannot watch %s", w->dirname);
+			return NULL;
+		}
+		if (ret <= 0)
+			continue;
+
+		len = read(w->fd, u.space, sizeof u.space);
+		if (len == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			diag_err(w->diag, "cannot watch %s", w->dirname);
+			return NULL;
+		}
+		for (ix = 0; ix < len; ix += sizeof *ev + ev->len)
+		{
+			ev = (const struct inotify_event *)(u.space + ix);
+			handle_event(w, ev);
+		}
+
+		// The spool directory itself is gone.
+		if (find_dir(w, w->root) == NULL)
+		{
+			diag_errx(w->diag, "%s has gone away", w->dirname);
+			return NULL;
+		}
+	}
+}
+
+#else
+
+struct watch *watch_new(const char *dirname, int settle_ms, struct diag *d)
+{
+	(void)settle_ms;
+	diag_errx(d, "cannot watch %s: not supported on this system",
+		dirname);
+	return NULL;
+}
+
+void watch_free(struct watch *w)
+{
+	(void)w;
+}
+
+char *watch_next(struct watch *w)
+{
+	(void)w;
+	return NULL;
+}
+
+#endif
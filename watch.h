@@ -0,0 +1,19 @@
+// Watching a spool directory for new entries to torrentize, using inotify.
+// An entry is ready once it has been written (or moved in) and then left
+// alone for a while, so that a directory being filled in is only picked up
+// once it is complete.
+
+struct watch;
+struct diag;
+
+// Entries already in the directory are left alone; only ones added or
+// changed from now on are reported. Returns NULL, with the error in d, if
+// the directory can't be watched. d is also used for later errors and
+// warnings.
+struct watch *watch_new(const char *dirname, int settle_ms, struct diag *d);
+void watch_free(struct watch *w);
+
+// Wait for an entry to be ready, returning its path (to be freed by the
+// caller), or NULL on error. Names starting with "." are skipped as
+// temporary files, and ones ending in ".torrent" as our own output.
+char *watch_next(struct watch *w);